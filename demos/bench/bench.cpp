@@ -0,0 +1,555 @@
+// Benchmark suite v1.00 -- ISC license
+// Copyright (c) 2024 Andrew Kensler
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted, provided that the above
+// copyright notice and this permission notice appear in all copies.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+// ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+// ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+// OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+// ======== ABOUT ========
+//
+// This program benchmarks the library on a set of scenes that each stress
+// a different part of it: fills, strokes with each join and cap, dashes,
+// text, gradients, patterns, shadows, clipping, and image data I/O.  Each
+// scene is drawn to a fresh canvas for a number of trials (16 by default,
+// or as given with --trials <int>) and the fastest trial is kept.
+//
+// To see where the time goes, this defines the library's stage hooks to
+// accumulate the calls to and time spent in each of the rendering stages
+// during a trial.  Note that the stages nest: render_main includes the
+// time for lines_to_runs and render_shadow that it runs, for example.  The
+// timing of the hooks themselves also adds a little overhead, so the
+// totals are best compared against other runs of this program rather than
+// against the tiger demo.
+//
+// The results are written to standard output as JSON so that they can be
+// saved and compared across versions to track performance regressions.
+// When built with CANVAS_ITY_STATS defined, each scene also reports the
+// library's pipeline counters from its fastest trial.
+// Run with --subset <str> to only run the scenes whose names contain
+// <str>.
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#if defined( __linux__ )
+#include <time.h>
+#include <unistd.h>
+#elif defined( _WIN32 )
+#include <windows.h>
+#elif defined( __MACH__ )
+#include <mach/mach_time.h>
+#include <unistd.h>
+#else
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+void stage_begin( char const *name );
+void stage_end( char const *name );
+
+#define CANVAS_ITY_IMPLEMENTATION
+#define CANVAS_ITY_STAGE_BEGIN( name ) ::stage_begin( name )
+#define CANVAS_ITY_STAGE_END( name ) ::stage_end( name )
+#include "../../src/canvas_ity.hpp"
+
+using namespace std;
+using namespace canvas_ity;
+
+// Time in seconds since an arbitrary point.  This is only used for the
+// relative difference between the values before and after a test runs, so the
+// starting point does not particularly matter as long as it is consistent.
+//
+double get_seconds()
+{
+#if defined( __linux__ )
+    timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return ( static_cast< double >( now.tv_sec ) +
+             static_cast< double >( now.tv_nsec ) * 1.0e-9 );
+#elif defined( _WIN32 )
+    static double rate = 0.0;
+    if ( !rate )
+    {
+        static LARGE_INTEGER frequency;
+        QueryPerformanceFrequency( &frequency );
+        rate = 1.0 / frequency.QuadPart;
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter( &now );
+    return now.QuadPart * rate;
+#elif defined( __MACH__ )
+    static double rate = 0.0;
+    if ( !rate )
+    {
+        static mach_timebase_info_data_t frequency;
+        mach_timebase_info( &frequency );
+        rate = frequency.numer * 1.0e-9 / frequency.denom;
+    }
+    return mach_absolute_time() * rate;
+#else
+    timeval now;
+    gettimeofday( &now, 0 );
+    return now.tv_sec + now.tv_usec * 1.0e-6;
+#endif
+}
+
+// ======== STAGE TIMING ========
+
+// Totals for each of the rendering stages over a trial.  The depth guards
+// against counting the time twice if a stage ever runs within itself.
+//
+struct stage_total
+{
+    char const *name;
+    int depth;
+    int calls;
+    double start;
+    double seconds;
+};
+
+stage_total stages[] = {
+    { "path_to_lines", 0, 0, 0.0, 0.0 },
+    { "dash_lines", 0, 0, 0.0, 0.0 },
+    { "stroke_lines", 0, 0, 0.0, 0.0 },
+    { "lines_to_runs", 0, 0, 0.0, 0.0 },
+    { "render_shadow", 0, 0, 0.0, 0.0 },
+    { "render_main", 0, 0, 0.0, 0.0 } };
+int const stage_count = static_cast< int >( sizeof( stages ) /
+                                            sizeof( stages[ 0 ] ) );
+
+stage_total *find_stage( char const *name )
+{
+    for ( int index = 0; index < stage_count; ++index )
+        if ( strcmp( stages[ index ].name, name ) == 0 )
+            return &stages[ index ];
+    return 0;
+}
+
+void stage_begin( char const *name )
+{
+    stage_total *stage = find_stage( name );
+    if ( !stage )
+        return;
+    ++stage->calls;
+    if ( !stage->depth++ )
+        stage->start = get_seconds();
+}
+
+void stage_end( char const *name )
+{
+    stage_total *stage = find_stage( name );
+    if ( stage && !--stage->depth )
+        stage->seconds += get_seconds() - stage->start;
+}
+
+// ======== SCENES ========
+
+int const pixels = 512;
+float const scene_size = 512.0f;
+
+// Small deterministic pseudorandom number generator so that every run
+// draws exactly the same scenes.
+//
+struct random_floats
+{
+    unsigned int state;
+    random_floats() : state( 12345u ) {}
+    float operator()( float low, float high )
+    {
+        state = state * 1664525u + 1013904223u;
+        return low + ( high - low ) *
+            static_cast< float >( state >> 8 ) / 16777216.0f;
+    }
+};
+
+vector< unsigned char > font_a;
+char const font_a_base64[] =
+    "AAEAAAALAIAAAwAwT1MvMmisck8AAAE4AAAAYGNtYXAXewGCAAAB3AAAAUJjdnQgAEQFEQAA"
+    "AyAAAAAEZ2x5ZjCUlAIAAANMAAAGhmhlYWQe1bIjAAAAvAAAADZoaGVhDf8FBAAAAPQAAAAk"
+    "aG10eDmaBAMAAAGYAAAARGxvY2ERbxMOAAADJAAAAChtYXhwAHUAtwAAARgAAAAgbmFtZVZp"
+    "NvsAAAnUAAAA23Bvc3T/aQBmAAAKsAAAACAAAQAAAAEAAEPW4v5fDzz1AB0IAAAAAADcB1gv"
+    "AAAAANwUDpf/+f5tB5AH8wAAAAgAAgAAAAAAAAABAAAFu/+6ALgIAP/5/ToHkAABAAAAAAAA"
+    "AAAAAAAAAAAADwABAAAAEwBAABAAcAAIAAIAAAABAAEAAABAAAMACAABAAQD/wGQAAUAAAUz"
+    "BZkAAAEeBTMFmQAAA9cAZgISAAACAAUDAAAAAAAAAAAAQwIAAAAEAAAAAAAAAFBmRWQAgAAg"
+    "//8GQP5AALgFuwBGAAAAAQAAAAADmwW3AAAAIAABAuwARAQAAAAFogAiBikAVwK0ABQDqAA8"
+    "BGwANALYAE8CsQA8A8j/+QPI//kCtAAUAAABBQgAAAADhABkAGQAZABkAGQAAAACAAMAAQAA"
+    "ABQAAwAKAAAAigAEAHYAAAAWABAAAwAGACAAKgBJAGEAbgB0AHYAeQDNAwH//wAAACAAKgBD"
+    "AGEAbgBzAHYAeQDNAwH////h/9gAAP+k/5j/lP+T/5H/Pv0LAAEAAAAAABIAAAAAAAAAAAAA"
+    "AAAAAAAAAAMAEgAOAA8AEAARAAQADAAAAAAAuAAAAAAAAAAOAAAAIAAAACAAAAABAAAAKgAA"
+    "ACoAAAACAAAAQwAAAEMAAAADAAAARAAAAEQAAAASAAAARQAAAEgAAAAOAAAASQAAAEkAAAAE"
+    "AAAAYQAAAGEAAAAFAAAAbgAAAG4AAAAGAAAAcwAAAHQAAAAHAAAAdgAAAHYAAAAJAAAAeQAA"
+    "AHkAAAAKAAAAzQAAAM0AAAALAAADAQAAAwEAAAAMABD//QAQ//0AAAANAAAARAURAAAAFgAW"
+    "AFQAkwDSAR8BbQGtAeoCIAJhAm8CjQMRAx0DJQMtAzUDQwACAEQAAAJkBVUAAwAHAAOxAQAz"
+    "ESERJSERIUQCIP4kAZj+aAVV+qtEBM0A//8AIgBYBYEFpxCnAAwFogRQ0sAtPtLA0sAQpwAM"
+    "AX4F2NLA0sAtPtLAEKcADAACAawtPtLALT4tPhCnAAwEJAAoLT4tPtLALT4QpwAM/+oEDQAA"
+    "wABAAAAAEKcADAW+Ae4AAEAAwAAAABAvAAwD3gXswAAQBwAMAcIADAABAFf/4gW7BbsAIwAA"
+    "ExA3NiEyBRYVFAcGJwIhIAMGFRQXFiEgEzYXFgcGBwQhIAEmV7jWAY6lATUPEhIGoP7k/t+6"
+    "jZamAWkBM50JGBcCGBv+9/7M/rX+6pECxAEo1vmQB90JAwILATv++8XE9tvyAToSBQQSzRGf"
+    "ARGOAAABABT/+gJ8BbQAIwAAMyInJjc2NxI3NgMmJyY3NjMkJRYXFgcGBwIXFhMWFxYXFgcG"
+    "NxcBARefBA0BARUJoBUBARUBIgEIGwEBG7YEDAICDAO4HQIBH/8MCgg+aQFPvqYBXJUXAxUS"
+    "BAYBFw0HNYX+u7y1/qh1HwUZDQEGAAACADz/7wN5A5EACAAuAAA3Fjc2JyYHDgI+AycmJyYH"
+    "BhcWBwYnJjc2MzIDAhcWNzY3NgcGBwYnBicmJ+IDjJYDATJLpqRFkImHAgJAKE5zBAVyIhAJ"
+    "HbLN6hcUBAVNQA4qDCqZZVKQbLYEw4UND9pgDxNUO2YoLC6NfjgiBAZBOCMKLhwcq/7J/vRg"
+    "jxcTAwoifQUDdXUBAq4AAQA0//8ETgO2ADMAADMiNTQzMgMmNzYnNjMyBwYHJDc2ExIXFjcy"
+    "FRQjMCEiNTQ3NicwAyYHBgcwAwI3NhcWJyBQHDBkDQYBAUueQDoSFQIBBovUBwkDAmcSFf6m"
+    "JSFHAgUB2XpbCQ5qLQMDDv7SHhUBlbxgTCFlLzc1dAQH/ur+oo9oARoWIxgHEUQB2MoJBUP+"
+    "cv7cBQIcIgEAAQRP/+4GiQObACUAACUmNzYzMhcWNzY3NicmNzY3NhcWBwYnJicmBwYHBhcW"
+    "FxYHBiUmBFUGCAMVFAxWbJcLBqzgGiv3bWQPBgEXFA5lPGEpHJlKTFQFCf7c1zM6VBwcug4T"
+    "o01ph5P6BAI4EogUBAQYoAIDkmRmMkNJg+UBAQABADz/7AKEBBEAIwAAEyYnJjc2NzYXFgcG"
+    "FxY3FhUUBwYnJgcCFxYXFjcGJyYTEjU0aCIGBBxcQhUKIAMIVD+VMjKMTk8BCAgJoVVJOc3z"
+    "ERQDLgUXEBZKQhUECyBQAgEHCi41AwcBAVH+u4mnAQEnlAQFAQEBNKpSAAH/+f+6A7QDjAAe"
+    "AAAlJgEmJwUyFRQHBhUUEzYTNicmJzQ3NjcGBwAHBgciAbYX/tMRaAFkHh494U93Bz4sASik"
+    "hV8Y/uEJDR4kDoACfSRdAhYSCxZAJv4/LwHaGRIMGhABAgU9Rv1/VHkBAAH/+f5tA7QDjAAm"
+    "AAAlNAEmJwUyFRQHBhUUEzYTNicmJzQ3NjcGBwIHAgcGIyY1Njc2NzYBqv7IEWgBZB4ePeFF"
+    "gQc+LAEopIVfGOJGngEYOFgBWSAGWixJApYkXQIWEgsWQCb+PygB4RoRDBoQAQIFPUb927D+"
+    "cQM1AVAZGgkNy///ABT/+gLXB/MQZwAMABEC1T/4QAASBgAEAAAAAQEFAyMCxgUeAA0AAAE2"
+    "EzY3NhcWBwYHBicmARAwqBoOWkoSHsKSFBwfA0prASUtAxQYBSf+ohcHBwAAEAAA/nAHkAYA"
+    "AAMABwALAA8AEwAXABsAHwAjACcAKwAvADMANwA7AD8AABAQIBAAECARABAhEAAQIRESESAQ"
+    "ABEgEQARIRAAESERExAgEAEQIBEBECEQARAhERMRIBABESARAREhEAERIREBkP5wAZD+cAGQ"
+    "/nABkHABkP5wAZD+cAGQ/nABkHABkP5wAZD+cAGQ/nABkHABkP5wAZD+cAGQ/nABkP5wAZD+"
+    "cAIAAZD+cAIAAZD+cAIAAZD+cPoAAZD+cAIAAZD+cAIAAZD+cAIAAZD+cPoAAZD+cAIAAZD+"
+    "cAIAAZD+cAIAAZD+cPoAAZD+cAIAAZD+cAIAAZD+cAIAAZD+cAD//wBkADIDIAWqECcAEgAA"
+    "/qIABAASAAP//wBkAZADIARMEAYAEgAA//8AZAGQAyAETBAGABIAAP//AGQBkAMgBEwQBgAS"
+    "AAAAAQBkAZADIARMAAMAABIgECBkArz9RARM/UQAAAAAAAAMAJYAAQAAAAAAAQAFAAAAAQAA"
+    "AAAAAgAHAAUAAQAAAAAAAwAFAAAAAQAAAAAABAAFAAAAAQAAAAAABQALAAwAAQAAAAAABgAF"
+    "AAAAAwABBAkAAQAKABcAAwABBAkAAgAOACEAAwABBAkAAwAKABcAAwABBAkABAAKABcAAwAB"
+    "BAkABQAWAC8AAwABBAkABgAKABdGb250QVJlZ3VsYXJWZXJzaW9uIDEuMABGAG8AbgB0AEEA"
+    "UgBlAGcAdQBsAGEAcgBWAGUAcgBzAGkAbwBuACAAMQAuADAAAAMAAAAAAAD/ZgBmAAAAAAAA"
+    "AAAAAAAAAAAAAAAAAAA=";
+
+// Valid TTF file, cmap table has type 4 subtable only and loca table is long.
+vector< unsigned char > font_b;
+
+void base64_decode(
+    char const *input,
+    vector< unsigned char > &output )
+{
+    int index = 0;
+    int data = 0;
+    int held = 0;
+    while ( int symbol = input[ index++ ] )
+    {
+        if ( symbol == '=' )
+            break;
+        int value = ( 'A' <= symbol && symbol <= 'Z' ? symbol - 'A' :
+                      'a' <= symbol && symbol <= 'z' ? symbol - 'a' + 26 :
+                      '0' <= symbol && symbol <= '9' ? symbol - '0' + 52 :
+                      symbol == '+' ? 62 :
+                      symbol == '/' ? 63 :
+                      0 );
+        data = data << 6 | value;
+        held += 6;
+        if ( held >= 8 )
+        {
+            held -= 8;
+            output.push_back( static_cast< unsigned char >( ( data >> held ) & 0xff ) );
+            data &= ( 1 << held ) - 1;
+        }
+    }
+}
+
+void scene_fills( canvas &that )
+{
+    random_floats random;
+    for ( int shape = 0; shape < 200; ++shape )
+    {
+        that.set_color( fill_style, random( 0.0f, 1.0f ),
+                        random( 0.0f, 1.0f ), random( 0.0f, 1.0f ),
+                        random( 0.5f, 1.0f ) );
+        that.begin_path();
+        that.move_to( random( 0.0f, scene_size ), random( 0.0f, scene_size ) );
+        for ( int segment = 0; segment < 4; ++segment )
+            that.bezier_curve_to( random( 0.0f, scene_size ), random( 0.0f, scene_size ),
+                                  random( 0.0f, scene_size ), random( 0.0f, scene_size ),
+                                  random( 0.0f, scene_size ), random( 0.0f, scene_size ) );
+        that.close_path();
+        that.fill();
+    }
+}
+
+void scene_strokes( canvas &that )
+{
+    static join_style const joins[] = { miter, bevel, rounded };
+    static cap_style const caps[] = { butt, square, circle };
+    random_floats random;
+    that.set_line_width( 9.0f );
+    for ( int style = 0; style < 9; ++style )
+    {
+        that.line_join = joins[ style % 3 ];
+        that.line_cap = caps[ style / 3 ];
+        for ( int line = 0; line < 12; ++line )
+        {
+            that.set_color( stroke_style, random( 0.0f, 1.0f ),
+                            random( 0.0f, 1.0f ), random( 0.0f, 1.0f ),
+                            1.0f );
+            that.begin_path();
+            that.move_to( random( 0.0f, scene_size ), random( 0.0f, scene_size ) );
+            for ( int segment = 0; segment < 8; ++segment )
+                that.line_to( random( 0.0f, scene_size ), random( 0.0f, scene_size ) );
+            that.stroke();
+        }
+    }
+}
+
+void scene_dashes( canvas &that )
+{
+    random_floats random;
+    float const dash[] = { 12.0f, 4.0f, 2.0f, 4.0f };
+    that.set_line_dash( dash, 4 );
+    that.line_cap = circle;
+    that.set_line_width( 3.0f );
+    for ( int line = 0; line < 60; ++line )
+    {
+        that.line_dash_offset = random( 0.0f, 20.0f );
+        that.set_color( stroke_style, random( 0.0f, 1.0f ),
+                        random( 0.0f, 1.0f ), random( 0.0f, 1.0f ), 1.0f );
+        that.begin_path();
+        that.move_to( random( 0.0f, scene_size ), random( 0.0f, scene_size ) );
+        that.bezier_curve_to( random( 0.0f, scene_size ), random( 0.0f, scene_size ),
+                              random( 0.0f, scene_size ), random( 0.0f, scene_size ),
+                              random( 0.0f, scene_size ), random( 0.0f, scene_size ) );
+        that.stroke();
+    }
+}
+
+void scene_text( canvas &that )
+{
+    that.set_font( &font_a[ 0 ], static_cast< int >( font_a.size() ), 24.0f );
+    that.set_color( stroke_style, 0.6f, 0.1f, 0.1f, 1.0f );
+    for ( int line = 0; line < 20; ++line )
+    {
+        float y = 24.0f * static_cast< float >( line + 1 );
+        that.set_color( fill_style, 0.0f, 0.0f,
+                        static_cast< float >( line ) / 20.0f, 1.0f );
+        that.fill_text( "DICE HEDGE a FIG CHaFF s HIDE", 8.0f, y );
+        that.stroke_text( "FED CaGE", 360.0f, y );
+    }
+}
+
+void scene_gradients( canvas &that )
+{
+    for ( int tile = 0; tile < 16; ++tile )
+    {
+        float x = static_cast< float >( tile % 4 ) * 128.0f;
+        float y = static_cast< float >( tile / 4 ) * 128.0f;
+        if ( tile & 1 )
+            that.set_linear_gradient( fill_style, x, y,
+                                      x + 128.0f, y + 64.0f );
+        else
+            that.set_radial_gradient( fill_style, x + 40.0f, y + 40.0f, 4.0f,
+                                      x + 64.0f, y + 64.0f, 90.0f );
+        that.add_color_stop( fill_style, 0.0f, 1.0f, 0.8f, 0.1f, 1.0f );
+        that.add_color_stop( fill_style, 0.5f, 0.2f, 0.4f, 0.9f, 0.7f );
+        that.add_color_stop( fill_style, 1.0f, 0.1f, 0.6f, 0.3f, 1.0f );
+        that.fill_rectangle( x, y, 128.0f, 128.0f );
+    }
+}
+
+void scene_patterns( canvas &that )
+{
+    unsigned char checker[ 32 * 32 * 4 ];
+    for ( int index = 0; index < 32 * 32 * 4; ++index )
+        checker[ index ] = static_cast< unsigned char >(
+            ( index & 3 ) == 3 ? 255 :
+            ( ( index >> 4 & 1 ) ^ ( index >> 9 & 1 ) ) * 200 + 20 );
+    that.set_pattern( fill_style, checker, 32, 32, 32 * 4, repeat );
+    that.save();
+    that.rotate( 0.3f );
+    that.scale( 1.7f, 0.9f );
+    that.fill_rectangle( -256.0f, -256.0f, 1024.0f, 1024.0f );
+    that.restore();
+    for ( int image = 0; image < 8; ++image )
+    {
+        float place = static_cast< float >( image ) * 56.0f;
+        that.draw_image( checker, 32, 32, 32 * 4, place, place,
+                         48.0f + place * 0.25f, 48.0f + place * 0.25f );
+    }
+}
+
+void scene_shadows( canvas &that )
+{
+    random_floats random;
+    that.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.6f );
+    that.set_shadow_blur( 8.0f );
+    that.shadow_offset_x = 6.0f;
+    that.shadow_offset_y = 6.0f;
+    for ( int shape = 0; shape < 24; ++shape )
+    {
+        that.set_color( fill_style, random( 0.0f, 1.0f ),
+                        random( 0.0f, 1.0f ), random( 0.0f, 1.0f ), 1.0f );
+        float x = random( 0.0f, scene_size - 80.0f );
+        float y = random( 0.0f, scene_size - 80.0f );
+        if ( shape & 1 )
+            that.fill_rectangle( x, y, 80.0f, 60.0f );
+        else
+        {
+            that.begin_path();
+            that.arc( x + 40.0f, y + 40.0f, 36.0f, 0.0f, 6.28318531f );
+            that.fill();
+        }
+    }
+}
+
+void scene_clipping( canvas &that )
+{
+    random_floats random;
+    for ( int group = 0; group < 8; ++group )
+    {
+        that.save();
+        that.begin_path();
+        that.arc( random( 64.0f, scene_size - 64.0f ), random( 64.0f, scene_size - 64.0f ),
+                  random( 40.0f, 160.0f ), 0.0f, 6.28318531f );
+        that.clip();
+        that.begin_path();
+        that.rectangle( random( 0.0f, scene_size ), random( 0.0f, scene_size ),
+                        random( -200.0f, 200.0f ), random( -200.0f, 200.0f ) );
+        that.clip();
+        for ( int shape = 0; shape < 8; ++shape )
+        {
+            that.set_color( fill_style, random( 0.0f, 1.0f ),
+                            random( 0.0f, 1.0f ), random( 0.0f, 1.0f ),
+                            0.8f );
+            that.fill_rectangle( random( 0.0f, scene_size ), random( 0.0f, scene_size ),
+                                 random( 20.0f, 200.0f ),
+                                 random( 20.0f, 200.0f ) );
+        }
+        that.restore();
+    }
+}
+
+void scene_image_io( canvas &that )
+{
+    vector< unsigned char > image( pixels * pixels * 4 );
+    for ( size_t index = 0; index < image.size(); ++index )
+        image[ index ] = static_cast< unsigned char >( index * 7 >> 3 );
+    for ( int pass = 0; pass < 4; ++pass )
+    {
+        that.put_image_data( &image[ 0 ], pixels, pixels, pixels * 4, 0, 0 );
+        that.get_image_data( &image[ 0 ], pixels, pixels, pixels * 4, 0, 0 );
+    }
+}
+
+struct scene_entry
+{
+    void ( *draw )( canvas & );
+    char const *name;
+};
+
+scene_entry const scenes[] = {
+    { scene_fills, "fills" },
+    { scene_strokes, "strokes" },
+    { scene_dashes, "dashes" },
+    { scene_text, "text" },
+    { scene_gradients, "gradients" },
+    { scene_patterns, "patterns" },
+    { scene_shadows, "shadows" },
+    { scene_clipping, "clipping" },
+    { scene_image_io, "image_io" } };
+
+// ======== MAIN ========
+
+int main(
+    int argc,
+    char **argv )
+{
+    int trials = 16;
+    char const *subset = "";
+    for ( int index = 1; index < argc; ++index )
+    {
+        string option( argv[ index ] );
+        if ( option == "--trials" && index < argc - 1 )
+            trials = max( atoi( argv[ ++index ] ), 1 );
+        else if ( option == "--subset" && index < argc - 1 )
+            subset = argv[ ++index ];
+        else
+        {
+            cerr <<
+                "Usage: " << argv[ 0 ] << " [options...]\n"
+                "Options:\n"
+                "  --trials <int> : Draw each scene <int> times, keep fastest\n"
+                "  --subset <str> : Only run scenes with names containing <str>\n";
+            return option == "--help" ? 0 : 1;
+        }
+    }
+    base64_decode( font_a_base64, font_a );
+    cout << "{\n  \"trials\": " << trials << ",\n  \"scenes\": [";
+    char const *separator = "\n";
+    for ( size_t entry = 0; entry < sizeof( scenes ) / sizeof( scenes[ 0 ] );
+          ++entry )
+    {
+        if ( !strstr( scenes[ entry ].name, subset ) )
+            continue;
+        double best = 1.0e30;
+        vector< stage_total > fastest( stages, stages + stage_count );
+#ifdef CANVAS_ITY_STATS
+        canvas_stats counts;
+#endif
+        for ( int trial = 0; trial < trials; ++trial )
+        {
+            canvas that( pixels, pixels );
+            for ( int index = 0; index < stage_count; ++index )
+            {
+                stages[ index ].calls = 0;
+                stages[ index ].seconds = 0.0;
+            }
+            double start = get_seconds();
+            scenes[ entry ].draw( that );
+            double elapsed = get_seconds() - start;
+            if ( elapsed < best )
+            {
+                best = elapsed;
+                fastest.assign( stages, stages + stage_count );
+#ifdef CANVAS_ITY_STATS
+                counts = that.stats;
+#endif
+            }
+        }
+        cout << separator << "    { \"name\": \"" << scenes[ entry ].name
+             << "\", \"ms\": " << fixed << setprecision( 4 )
+             << best * 1000.0 << ",\n      \"stages\": {";
+        for ( size_t index = 0; index < fastest.size(); ++index )
+            cout << ( index ? "," : "" ) << "\n        \""
+                 << fastest[ index ].name << "\": { \"calls\": "
+                 << fastest[ index ].calls << ", \"ms\": "
+                 << fastest[ index ].seconds * 1000.0 << " }";
+        cout << " }";
+#ifdef CANVAS_ITY_STATS
+        cout << ",\n      \"counts\": {"
+             << "\n        \"bezier_segments\": " << counts.bezier_segments
+             << ",\n        \"dashed_points\": " << counts.dashed_points
+             << ",\n        \"stroked_points\": " << counts.stroked_points
+             << ",\n        \"unmerged_runs\": " << counts.unmerged_runs
+             << ",\n        \"merged_runs\": " << counts.merged_runs
+             << ",\n        \"color_pixels\": " << counts.color_pixels
+             << ",\n        \"linear_pixels\": " << counts.linear_pixels
+             << ",\n        \"radial_pixels\": " << counts.radial_pixels
+             << ",\n        \"pattern_pixels\": " << counts.pattern_pixels
+             << ",\n        \"shadow_floats\": " << counts.shadow_floats
+             << ",\n        \"largest_shadow\": " << counts.largest_shadow
+             << " }";
+#endif
+        cout << " }";
+        separator = ",\n";
+    }
+    cout << "\n  ]\n}" << endl;
+    return 0;
+}
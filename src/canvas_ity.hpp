@@ -67,11 +67,14 @@
 //     code and does not require a GPU or GPU context.
 // - Has extensive Doxygen-style documentation comments for the public API.
 // - Compiles cleanly at moderately high warning levels on most compilers.
-// - Shares no internal pointers, nor holds any external pointers.  Newcomers
-//     to C++ can have fun drawing with this library without worrying so much
+// - Shares no internal pointers, nor holds any external pointers (except
+//     for an opt-in task runner or image to draw into).  Newcomers to C++
+//     can have fun drawing with this library without worrying so much
 //     about resource lifetimes or mutability.
 // - Uses no static or global variables.  Threads may safely work with
-//     different canvas instances concurrently without locking.
+//     different canvas instances concurrently without locking.  Images
+//     and fonts loaded once into shared handles may be used by canvases
+//     on many threads at once without each keeping its own copy.
 // - Allocates no dynamic memory after reaching the high-water mark.  Except
 //     for the pixel buffer, flat std::vector instances embedded in the canvas
 //     instance handle all dynamic memory.  This reduces fragmentation and
@@ -83,15 +86,15 @@
 //     pointer arithmetic) easier to port natively to other languages.  The
 //     accompanying test suite may also help with porting.
 //
-// Compact size:
+// Size:
 //
-// - The source code for the entire library consists of a bit over 2300 lines
+// - The source code for the entire library consists of a bit over 5400 lines
 //     (not counting comments or blanks), each no longer than 78 columns.
-//     Alternately measured, it has fewer than 1300 semicolons.
-// - The object code for the library can be less than 36 KiB on x86-64 with
+//     Alternately measured, it has fewer than 2900 semicolons.
+// - The object code for the library can be less than 84 KiB on x86-64 with
 //     appropriate compiler settings for size.
-// - Due to the library's small size, the accompanying automated test suite
-//     achieves 100% line coverage of the library in gcov and llvm-cov.
+// - The accompanying automated test suite covers 99% of the lines of the
+//     library in gcov in a default build.
 
 // ======== LIMITATIONS ========
 //
@@ -108,9 +111,12 @@
 // - TRUETYPE FONT PARSING IS NOT SECURE!  It does some basic validity
 //     checking, but should only be used with known-good or sanitized fonts.
 // - Parameter checking does not test for non-finite floating-point values.
-// - Rendering is single-threaded, not explicitly vectorized, and not GPU-
-//     accelerated.  It also copies data to avoid ownership issues.  If you
-//     need the speed, you are better off using a more fully-featured library.
+// - Rendering is single-threaded unless given a task runner, is only
+//     vectorized for blending solid colors, and is not GPU-accelerated.
+//     Even with a task runner, only the main compositing is split into
+//     parallel bands.  It also copies data to avoid ownership issues.  If
+//     you need the speed, you are better off using a more fully-featured
+//     library.
 // - The library does no input or output on its own.  Instead, you must
 //     provide it with buffers to copy into or out of.
 
@@ -120,7 +126,45 @@
 // your source files to declare the canvas_ity namespace and its members.
 // However, to get the implementation, you must
 //     #define CANVAS_ITY_IMPLEMENTATION
-// in exactly one C++ file before including this header.
+// in exactly one C++ file before including this header.  When compiling
+// for targets with SSE or NEON, the implementation will use intrinsics for
+// a few hot loops.  To build using only plain C++03 code instead, also
+//     #define CANVAS_ITY_NO_SIMD
+// in that same file.  For profiling, you may also define both
+//     #define CANVAS_ITY_STAGE_BEGIN( name ) ...
+//     #define CANVAS_ITY_STAGE_END( name ) ...
+// in that file to have them expanded at the start and end of each of the
+// rendering stages listed in the IMPLEMENTATION section below.  Each gets
+// the name of its stage as a C string with static storage.  Some stages
+// run within others, and when replaying tiles with a task runner, they may
+// run on its threads concurrently.  Defining
+//     #define CANVAS_ITY_STATS
+// before every inclusion of this header adds a set of counters to each
+// canvas for the work done along the pipeline.  Since it changes the
+// layout of the class, it must be consistent everywhere.  Without it, the
+// counting compiles away entirely.
+//
+// Canvases are normally limited to 32768 pixels on a side so that the
+// coverage runs can use compact 16-bit coordinates.  For taller or wider
+// canvases, up to 1048576 pixels on a side (but still fewer than 2^31
+// pixels in total), also
+//     #define CANVAS_ITY_WIDE_RUNS
+// before every inclusion of this header, since it changes the layout of
+// the class.  Runs then take 12 bytes each rather than 8.
+//
+// Each canvas, display list, and handle must only be used by one thread at
+// a time, but different ones may be used concurrently on different threads
+// without locking.  The images held by canvas_ity::shared_image handles
+// never change once loaded and their reference counts are atomic, so any
+// number of canvases and handles on different threads may refer to the
+// same image.  Fonts held by canvas_ity::typeface handles work the same
+// way, except that each font also has a cache of glyph outlines that is
+// filled in as text is drawn.  So, canvases that draw text concurrently
+// with a shared font should each be given their own view of it.  Setting
+// up a view only requires reading the original, so that is safe too.
+// Reference counts use atomic compiler intrinsics with GCC, Clang, and
+// MSVC; with other compilers, they are plain integers and nothing should
+// be shared across threads.
 //
 // Then, construct an instance of the canvas_ity::canvas class with the pixel
 // dimensions that you want and draw into it using any of the various drawing
@@ -154,25 +198,375 @@ enum repetition_style { repeat, repeat_x, repeat_y, no_repeat };
 enum align_style { leftward, rightward, center, start = 0, ending };
 enum baseline_style {
     alphabetic, top, middle, bottom, hanging, ideographic = 3 };
+enum smoothing_style { nearest, bilinear, bicubic };
+enum pixel_format { linear_float, linear_half, linear_short, srgb_byte };
+
+// Public API interface
+class task_runner
+{
+public:
+
+    /// @brief  Run a batch of independent tasks, possibly concurrently.
+    ///
+    /// Implementations must call the task function exactly once for each
+    /// index from 0 up to (but not including) the count, passing along the
+    /// data pointer, and must not return until all of those calls have
+    /// finished.  The calls may be made in any order and from any threads.
+    /// Implementations are free to simply run everything on the calling
+    /// thread in a loop.
+    ///
+    /// @param task   function to call for each task index
+    /// @param data   opaque pointer to pass through to the task function
+    /// @param count  number of task indices to run
+    ///
+    virtual void run(
+        void ( *task )( void *data, int index ),
+        void *data,
+        int count ) = 0;
+
+    /// @brief  Destroy the task runner.
+    ///
+    virtual ~task_runner();
+};
+
+#ifdef CANVAS_ITY_STATS
+
+/// @brief  Counts of the work done by a canvas along its rendering pipeline.
+///
+/// These are only available when building with CANVAS_ITY_STATS defined
+/// (see USAGE), for finding out why a particular frame was slow.  Each
+/// canvas adds to its own counts as it draws, clips, or prepares paths,
+/// and they keep growing until reset by assigning a new set of counts.
+/// The pixel counts are for the main drawing and do not include shadows.
+///
+struct canvas_stats
+{
+
+    /// @brief  Construct a new set of counts, all zero.
+    ///
+    canvas_stats();
+
+    /// @brief  Flat pieces of Bezier curves added to the polylines.
+    ///
+    size_t bezier_segments;
+
+    /// @brief  Polyline points produced by breaking lines into dashes.
+    ///
+    size_t dashed_points;
+
+    /// @brief  Polyline points produced by expanding strokes to outlines.
+    ///
+    size_t stroked_points;
+
+    /// @brief  Changes in coverage produced before merging them by pixel.
+    ///
+    size_t unmerged_runs;
+
+    /// @brief  Runs of pixel coverage left after merging the changes.
+    ///
+    size_t merged_runs;
+
+    /// @brief  Pixels painted with a solid color.
+    ///
+    size_t color_pixels;
+
+    /// @brief  Pixels painted with a linear gradient.
+    ///
+    size_t linear_pixels;
+
+    /// @brief  Pixels painted with a radial gradient.
+    ///
+    size_t radial_pixels;
+
+    /// @brief  Pixels painted with an image pattern or by drawing an image.
+    ///
+    size_t pattern_pixels;
+
+    /// @brief  Total number of floats in the working buffers for shadows.
+    ///
+    size_t shadow_floats;
+
+    /// @brief  Number of floats in the largest working buffer for a shadow.
+    ///
+    size_t largest_shadow;
+};
+
+#endif
 
 // Implementation details
 struct xy { float x, y; xy(); xy( float, float ); };
 struct rgba { float r, g, b, a; rgba(); rgba( float, float, float, float ); };
 struct affine_matrix { float a, b, c, d, e, f; };
+struct image_data { std::vector< rgba > texels, mipmaps; int width, height;
+                    long references; };
+struct image_ref { image_data *data; image_ref();
+                   image_ref( image_ref const & );
+                   image_ref &operator=( image_ref const & ); ~image_ref(); };
 struct paint_brush { enum types { color, linear, radial, pattern } type;
                      std::vector< rgba > colors; std::vector< float > stops;
                      xy start, end; float start_radius, end_radius;
-                     int width, height; repetition_style repetition; };
+                     int width, height; repetition_style repetition;
+                     std::vector< rgba > mipmaps; image_ref image; };
+struct filter_taps { std::vector< int > first; std::vector< float > weights;
+                     int taps; };
+struct glyph_point { float x, y; bool on_curve; };
+struct glyph_part { int glyph; float a, b, c, d, e, f; };
+struct glyph_outline { std::vector< glyph_point > points;
+                       std::vector< int > ends;
+                       std::vector< glyph_part > parts;
+                       int glyph; unsigned int used; };
+struct glyph_cache { std::vector< glyph_outline > outlines;
+                     std::vector< int > slots;
+                     size_t bytes; unsigned int clock; };
 struct font_face { std::vector< unsigned char > data;
+                   unsigned char const *bytes;
                    int cmap, glyf, head, hhea, hmtx, loca, maxp, os_2;
-                   float scale; };
+                   int format_12, format_4, format_0;
+                   glyph_cache glyphs; font_face *source;
+                   long references; };
 struct subpath_data { size_t count; bool closed; };
+struct arc_data { size_t first, last; affine_matrix transform;
+                  xy center, from; float span; };
 struct bezier_path { std::vector< xy > points;
-                     std::vector< subpath_data > subpaths; };
+                     std::vector< subpath_data > subpaths;
+                     std::vector< arc_data > arcs; };
 struct line_path { std::vector< xy > points;
                    std::vector< subpath_data > subpaths; };
-struct pixel_run { unsigned short x, y; float delta; };
+#ifdef CANVAS_ITY_WIDE_RUNS
+typedef int run_coordinate;
+int const largest_size = 1048576;
+#else
+typedef unsigned short run_coordinate;
+int const largest_size = 32768;
+#endif
+struct pixel_run { run_coordinate x, y; float delta; };
 typedef std::vector< pixel_run > pixel_runs;
+struct clip_mask { pixel_runs runs; int references; };
+struct canvas_state { composite_operation global_composite_operation;
+                      float shadow_offset_x, shadow_offset_y;
+                      cap_style line_cap; join_style line_join;
+                      float line_dash_offset; align_style text_align;
+                      baseline_style text_baseline;
+                      smoothing_style image_smoothing;
+                      affine_matrix forward, inverse; float global_alpha;
+                      rgba shadow_color; float shadow_blur, line_width;
+                      float miter_limit, font_scale;
+                      std::vector< float > line_dash;
+                      paint_brush fill_brush, stroke_brush;
+                      clip_mask *clipping; font_face *face;
+                      bool dash_owned, fill_owned, stroke_owned; };
+
+/// @brief  Font that has been loaded for sharing between canvases.
+///
+/// Setting a font on a canvas directly from the TTF file contents gives
+/// that canvas its own copy of the font.  Instead, load the file into one
+/// of these once and pass it to set_font() on as many canvases as needed.
+/// They will all refer to the same font data and share one cache of glyph
+/// outlines rather than each keeping their own.  Copying a handle just
+/// refers to the same font again; it is freed once no handles, canvases,
+/// or saved canvas states refer to it.  Once loaded, a font never changes
+/// apart from its glyph cache.  The reference counting is thread-safe, but
+/// the cache is not, so canvases that draw text with the same handle must
+/// only do so from one thread at a time.  For drawing text concurrently,
+/// give each thread its own view of the font instead.
+///
+class typeface
+{
+public:
+
+    /// @brief  Construct a new handle without a font.
+    ///
+    typeface();
+
+    /// @brief  Construct a handle to the same font as another handle.
+    ///
+    /// @param that  handle to the font to share
+    ///
+    typeface(
+        typeface const &that );
+
+    /// @brief  Release this handle's font and refer to another's instead.
+    ///
+    /// @param that  handle to the font to share
+    /// @return      this handle
+    ///
+    typeface &operator=(
+        typeface const &that );
+
+    /// @brief  Release the font, freeing it if nothing else refers to it.
+    ///
+    ~typeface();
+
+    /// @brief  Load a font for use by this handle.
+    ///
+    /// This releases any font that the handle referred to before, and then
+    /// parses and validates the new one as with canvas::set_font().  The
+    /// result is a fresh font; other handles and any canvases referring to
+    /// the previous font are not affected.  Normally, the relevant sections
+    /// of the font file contents are copied, so the file contents are safe
+    /// to change or destroy after this call.  When borrowing, the font is
+    /// used in place instead, without any copying.  This suits font files
+    /// that have been memory-mapped, but then the caller must keep the
+    /// contents unchanged and accessible for as long as anything still
+    /// refers to the font.  Note that the font parsing is not meant to be
+    /// secure; only use this with trusted TTF files!
+    ///
+    /// @param font    pointer to the contents of a TrueType font (TTF) file
+    /// @param bytes   number of bytes in the font file
+    /// @param borrow  use the font contents in place rather than copying
+    /// @return        true if the font was loaded successfully
+    ///
+    bool load(
+        unsigned char const *font,
+        int bytes,
+        bool borrow = false );
+
+    /// @brief  Refer to another handle's font with a separate glyph cache.
+    ///
+    /// This releases any font that the handle referred to before, and then
+    /// creates a view of the other handle's font.  The view uses the same
+    /// font data in place without copying it, but has its own empty cache
+    /// of glyph outlines.  Creating the view only reads the other's font,
+    /// and the view never writes to it, so canvases on different threads
+    /// may draw text concurrently as long as each uses a different view.
+    /// The font data is freed once nothing refers to it or to its views.
+    ///
+    /// @param that  handle to the font to view
+    /// @return      true if the other handle had a font to view
+    ///
+    bool view(
+        typeface const &that );
+
+private:
+
+    friend class canvas;
+    font_face *face;
+};
+
+/// @brief  Image that has been loaded for sharing between canvases.
+///
+/// Setting a pattern or drawing an image on a canvas directly from the
+/// pixel data converts and copies it into that canvas each time.  Instead,
+/// load the image into one of these once and pass it to set_pattern() or
+/// draw_image() on as many canvases as needed.  They will all refer to
+/// the same converted texels and mipmaps rather than each keeping their
+/// own.  Copying a handle just refers to the same image again; it is freed
+/// once no handles, canvases, saved canvas states, or display lists refer
+/// to it.  Once loaded, an image never changes and its reference counting
+/// is thread-safe, so canvases on different threads may all draw with the
+/// same image concurrently.
+///
+class shared_image
+{
+public:
+
+    /// @brief  Construct a new handle without an image.
+    ///
+    shared_image();
+
+    /// @brief  Load an image for use by this handle.
+    ///
+    /// This releases any image that the handle referred to before, and
+    /// then converts the new one to the internal format, as with
+    /// canvas::set_pattern(), and builds its pyramid of mipmaps for drawing
+    /// it shrunken.  The result is a fresh image; other handles and any
+    /// canvases referring to the previous image are not affected.  The
+    /// pixel data is copied, so it is safe to change or destroy after this
+    /// call.  If the pointer is null or either dimension is not positive,
+    /// the handle is left without an image.
+    ///
+    /// @param image   pointer to unpremultiplied sRGB RGBA8 image data
+    /// @param width   width of the image in pixels
+    /// @param height  height of the image in pixels
+    /// @param stride  number of bytes between the start of each image row
+    /// @return        true if the image was loaded successfully
+    ///
+    bool load(
+        unsigned char const *image,
+        int width,
+        int height,
+        int stride );
+
+private:
+
+    friend class canvas;
+    image_ref shared;
+};
+
+enum display_call {
+    scale_call, rotate_call, translate_call, transform_call,
+    set_transform_call, set_global_alpha_call, set_shadow_color_call,
+    set_shadow_blur_call, set_line_width_call, set_miter_limit_call,
+    set_line_dash_call, set_color_call, set_linear_gradient_call,
+    set_radial_gradient_call, add_color_stop_call, set_pattern_call,
+    set_shared_pattern_call, begin_path_call, move_to_call, close_path_call,
+    line_to_call, quadratic_curve_to_call, bezier_curve_to_call,
+    arc_to_call, arc_call, rectangle_call, fill_call, stroke_call,
+    clip_call, fill_batch_call, clear_rectangle_call, fill_rectangle_call,
+    stroke_rectangle_call, set_font_call, set_font_size_call,
+    fill_text_call, stroke_text_call, draw_image_call,
+    draw_shared_image_call, put_image_data_call, save_call, restore_call,
+    fields_call };
+
+/// @brief  Drawing calls recorded from a canvas for replaying onto others.
+///
+/// While a canvas is recording into one of these, each call that changes
+/// its state or draws onto it is appended here along with copies of its
+/// arguments, including any image data, dash patterns, and text.  Fonts
+/// and shared images are kept as handles.  The calls are recorded as they
+/// were made, before applying any transform, so a list can be replayed
+/// onto canvases of any size or with any transform set beforehand (e.g.,
+/// to scale a scene down or pick out one tile).  Copying a list copies the
+/// recorded calls.
+///
+class display_list
+{
+public:
+
+    /// @brief  Construct a new, empty display list.
+    ///
+    display_list();
+
+    /// @brief  Discard all of the recorded calls.
+    ///
+    void clear();
+
+private:
+
+    friend class canvas;
+    std::vector< int > calls;
+    std::vector< float > values;
+    std::vector< unsigned char > bytes;
+    std::vector< typeface > fonts;
+    std::vector< shared_image > images;
+    std::vector< float > fields;
+};
+
+/// @brief  Path that has been prepared for drawing repeatedly.
+///
+/// This holds the scan-converted results of preparing a path to be filled
+/// or stroked by a canvas, along with the polylines for drawing shadows.
+/// Construct one, pass it to prepare_fill() or prepare_stroke() and then
+/// pass it to draw_prepared() as many times as needed.  It may be drawn
+/// with any canvas, not just the one that prepared it.  Its contents are
+/// implementation details; treat it as opaque.
+///
+struct prepared_path { line_path lines; pixel_runs runs;
+                       int left, top; bool stroked; prepared_path(); };
+
+/// @brief  Path that has been prepared for testing points repeatedly.
+///
+/// This holds the edges of a path that has been prepared by a canvas for
+/// hit testing, along with its bounding box and an index of the edges by
+/// their vertical extent.  Construct one, pass it to prepare_hit_test()
+/// and then pass it to is_point_in_prepared() or are_points_in_prepared()
+/// as many times as needed.  It may be tested with any canvas, not just
+/// the one that prepared it.  Its contents are implementation details;
+/// treat it as opaque.
+///
+struct hit_test_path { std::vector< xy > edges; std::vector< size_t > starts;
+                       std::vector< size_t > entries; xy low, high;
+                       float scale; hit_test_path(); };
 
 class canvas
 {
@@ -186,14 +580,58 @@ public:
     /// the visible coordinates will run from (0, 0) in the upper-left to
     /// (width, height) in the lower-right and with pixel centers offset
     /// (0.5, 0.5) from the integer grid, though all this may be changed
-    /// by transforms.  The sizes must be between 1 and 32768, inclusive.
+    /// by transforms.  The sizes must be between 1 and 32768, inclusive,
+    /// or 1048576 when built with CANVAS_ITY_WIDE_RUNS (see USAGE).
+    ///
+    /// The pixels are always stored as linear premultiplied RGBA, but the
+    /// storage format trades off memory against precision.  This does not
+    /// change how the drawing functions work, only how the results are
+    /// kept between them.  Defaults to linear_float.
+    ///
+    /// linear_float:  Use 32-bit floats for 16 bytes per pixel.
+    /// linear_half:   Use 16-bit half floats for 8 bytes per pixel.
+    /// linear_short:  Use 16-bit normalized integers for 8 bytes per pixel;
+    ///                values clamp to the 0.0 to 1.0 range, inclusive.
+    /// srgb_byte:     Use 8-bit sRGB bytes for 4 bytes per pixel, laid out
+    ///                and dithered as for get_image_data().
+    ///
+    /// @param width   horizontal size of the new canvas in pixels
+    /// @param height  vertical size of the new canvas in pixels
+    /// @param format  storage format for the pixels of the new canvas
     ///
-    /// @param width  horizontal size of the new canvas in pixels
+    canvas(
+        int width,
+        int height,
+        pixel_format format = linear_float );
+
+    /// @brief  Construct a new canvas that draws directly into an image.
+    ///
+    /// This is like using the srgb_byte storage format, except that the
+    /// canvas uses the given image as its pixel storage rather than
+    /// allocating its own.  The image must be in the same 8-bit RGBA form
+    /// used by get_image_data() and put_image_data(), and its contents at
+    /// the time of construction become the initial pixels of the canvas.
+    /// Every drawing operation then updates the image in place, so there is
+    /// no need to retrieve it afterwards.  Note that the canvas holds onto
+    /// the pointer but does not take ownership; the image must outlive the
+    /// canvas.  If the pointer is null, the canvas allocates its own buffer
+    /// instead.  The sizes must be between 1 and 32768, inclusive, or
+    /// 1048576 when built with CANVAS_ITY_WIDE_RUNS (see USAGE).
+    ///
+    /// Tip: since each drawing operation dithers and rounds its results to
+    ///      bytes, layering many translucent drawing operations will
+    ///      accumulate a bit more error than with the linear formats.
+    ///
+    /// @param width   horizontal size of the new canvas in pixels
     /// @param height  vertical size of the new canvas in pixels
+    /// @param image   pointer to top-left pixel of the image to draw into
+    /// @param stride  number of bytes between the starts of adjacent rows
     ///
     canvas(
         int width,
-        int height );
+        int height,
+        unsigned char *image,
+        int stride );
 
     /// @brief  Destroy the canvas and release all associated memory.
     ///
@@ -569,15 +1007,16 @@ public:
     /// Initially, pixels in the pattern correspond exactly to pixels on the
     /// canvas, with the pattern starting in the upper left.  The pattern
     /// is affected by the current transform at the time of drawing, and
-    /// the pattern will be resampled as needed (with the filtering always
-    /// wrapping regardless of the repetition setting).  The pattern can be
-    /// repeated either horizontally, vertically, both, or neither, relative
-    /// to the source image.  If the pattern is not repeated, then beyond it
-    /// will be considered transparent black.  The pattern image, which should
-    /// be in top to bottom rows of contiguous pixels from left to right,
-    /// is copied and it is safe to change or destroy it after this call.
-    /// The width and height must both be positive.  If either are not, or
-    /// the image pointer is null, this does nothing.
+    /// the pattern will be resampled as needed according to the setting of
+    /// image_smoothing then (with the filtering always wrapping regardless
+    /// of the repetition setting).  The pattern can be repeated either
+    /// horizontally, vertically, both, or neither, relative to the source
+    /// image.  If the pattern is not repeated, then beyond it will be
+    /// considered transparent black.  The pattern image, which should be
+    /// in top to bottom rows of contiguous pixels from left to right, is
+    /// copied and it is safe to change or destroy it after this call.  The
+    /// width and height must both be positive.  If either are not, or the
+    /// image pointer is null, this does nothing.
     ///
     /// Tip: to use a small piece of a larger image, reduce the width and
     ///      height, and offset the image pointer while keeping the stride.
@@ -597,6 +1036,23 @@ public:
         int stride,
         repetition_style repetition );
 
+    /// @brief  Set filling or stroking to draw with a shared image pattern.
+    ///
+    /// This is like setting the pattern from the image data, except that
+    /// the canvas refers to the already loaded image rather than copying
+    /// it.  The image stays alive for as long as the canvas or any of its
+    /// saved states use it, even if the handle to it is destroyed.  If the
+    /// handle has not been successfully loaded, this does nothing.
+    ///
+    /// @param type        whether to set the fill_style or stroke_style
+    /// @param image       handle to a loaded image
+    /// @param repetition  repeat, repeat_x, repeat_y, or no_repeat
+    ///
+    void set_pattern(
+        brush_type type,
+        shared_image const &image,
+        repetition_style repetition );
+
     // ======== BUILDING PATHS ========
 
     /// @brief  Reset the current path.
@@ -844,6 +1300,144 @@ public:
         float x,
         float y );
 
+    /// @brief  Prepare the current path to be tested against repeatedly.
+    ///
+    /// This flattens the current path to edges just as is_point_in_path()
+    /// would, and saves them for later testing with is_point_in_prepared()
+    /// or are_points_in_prepared().  The edges are indexed into horizontal
+    /// bands so that testing a point only needs to look at the few edges
+    /// that cross its band, rather than every edge in the path.  Any
+    /// previous contents of the prepared path are replaced.  The current
+    /// path is left unchanged.
+    ///
+    /// @param prepared  place to save the path prepared for testing
+    ///
+    void prepare_hit_test(
+        hit_test_path &prepared );
+
+    /// @brief  Tests whether a point is in or on a prepared path.
+    ///
+    /// This gives the same answer that is_point_in_path() would have given
+    /// for the path when it was prepared, but usually looks at only a few
+    /// edges.  Points outside the bounding box of the path are rejected
+    /// right away.  As with that, the point is not affected by the current
+    /// transform, nor is the clip region considered.
+    ///
+    /// @param prepared  path previously prepared for testing
+    /// @param x         horizontal coordinate of the point to test
+    /// @param y         vertical coordinate of the point to test
+    /// @return          true if the point is in or on the prepared path
+    ///
+    bool is_point_in_prepared(
+        hit_test_path const &prepared,
+        float x,
+        float y );
+
+    /// @brief  Tests whether each of many points is in or on a prepared path.
+    ///
+    /// This is equivalent to calling is_point_in_prepared() for each point
+    /// in turn, such as for testing a whole set of shapes against a batch
+    /// of pointer positions.
+    ///
+    /// @param prepared  path previously prepared for testing
+    /// @param points    horizontal and vertical coordinate pairs to test
+    /// @param count     number of points to test
+    /// @param inside    place to store whether each point is in or on it
+    ///
+    void are_points_in_prepared(
+        hit_test_path const &prepared,
+        float const *points,
+        int count,
+        bool *inside );
+
+    /// @brief  Prepare the current path to be filled repeatedly.
+    ///
+    /// This does all of the work of fill() up to the point of painting and
+    /// compositing the pixels, and saves the result for later drawing with
+    /// draw_prepared().  Drawing it again that way skips the tessellation
+    /// and scan conversion entirely.  The path is prepared using the current
+    /// transform, but without the clip region or any of the settings used
+    /// when painting and compositing.  Any previous contents of the prepared
+    /// path are replaced.  The current path is left unchanged.  If the
+    /// current transform is not invertible, the prepared path is empty.
+    ///
+    /// @param prepared  place to save the prepared path
+    ///
+    void prepare_fill(
+        prepared_path &prepared );
+
+    /// @brief  Prepare the current path to be stroked repeatedly.
+    ///
+    /// This does all of the work of stroke() up to the point of painting
+    /// and compositing the pixels, and saves the result for later drawing
+    /// with draw_prepared().  Drawing it again that way skips the dashing,
+    /// stroke expansion, tessellation, and scan conversion entirely.  The
+    /// path is prepared using the current transform and line styles, but
+    /// without the clip region or any of the settings used when painting
+    /// and compositing.  Any previous contents of the prepared path are
+    /// replaced.  The current path is left unchanged.  If the current
+    /// transform is not invertible, the prepared path is empty.
+    ///
+    /// @param prepared  place to save the prepared path
+    ///
+    void prepare_stroke(
+        prepared_path &prepared );
+
+    /// @brief  Draw a prepared path, shifted by a whole number of pixels.
+    ///
+    /// This draws the prepared path just as fill() or stroke() would have
+    /// when it was prepared, except shifted right and down by the given
+    /// number of pixels.  It uses the fill style for paths prepared for
+    /// filling and the stroke style for paths prepared for stroking.  The
+    /// shadow, global alpha, global compositing operation, and clip region
+    /// all apply as they are now.  A gradient or pattern style is affected
+    /// by the current transform, but the shape is not.  The current path is
+    /// not affected.  If the current transform is not invertible, this does
+    /// nothing.
+    ///
+    /// Tip: for the best reuse, prepare icons and glyphs once at the origin
+    ///      and then draw them at whole pixel positions.
+    ///
+    /// @param prepared  path previously prepared for filling or stroking
+    /// @param x         number of pixels to shift the path right
+    /// @param y         number of pixels to shift the path down
+    ///
+    void draw_prepared(
+        prepared_path const &prepared,
+        int x,
+        int y );
+
+    /// @brief  Fill copies of the current path at many offsets in one call.
+    ///
+    /// This draws the current path as fill() would, once for each of the
+    /// given offsets and in that order, with each copy shifted by its
+    /// offset as measured in the coordinates of the current transform.  The
+    /// path is only tessellated once and then shared by every copy, which
+    /// saves most of the work per shape when drawing many small ones, such
+    /// as the markers of a scatter plot.  Since the copies are shifted after
+    /// tessellating, their edges match those of separately filled paths
+    /// only up to rounding, and may differ by a code value or so.  If
+    /// colors are given, each copy is painted with its own constant color
+    /// and opacity, clamped as with set_color(), instead of the fill style.
+    /// Otherwise every copy uses the fill style, and a gradient or pattern
+    /// stays in place rather than shifting with the copies.  The shadow,
+    /// global alpha, global compositing operation, and clip region all apply
+    /// to each copy, and each copy's shadow is drawn just before it.  The
+    /// current path is left unchanged.  If the current transform is not
+    /// invertible, this does nothing.
+    ///
+    /// Tip: begin the path with move_to() or arc() around the origin so
+    ///      that the offsets give the positions of the copies.
+    ///
+    /// @param offsets  horizontal and vertical offset pairs, one per copy
+    /// @param colors   sRGB red, green, blue, and alpha per copy, or null
+    /// @param count    number of copies to draw
+    ///
+    void fill_batch(
+        float const *offsets,
+        float const *colors,
+        int count );
+
     // ======== DRAWING RECTANGLES ========
 
     /// @brief  Clear a rectangular area back to transparent black.
@@ -957,6 +1551,44 @@ public:
         int bytes,
         float size );
 
+    /// @brief  Set a shared font to use for text drawing.
+    ///
+    /// This is like setting the font from the TTF file contents, except that
+    /// the canvas refers to the already loaded font rather than copying it.
+    /// The font stays alive for as long as the canvas or any of its saved
+    /// states use it, even if the handle to it is destroyed.  The glyph
+    /// cache belongs to the font, so it is shared with every other canvas
+    /// drawing with the same font.  Canvases on different threads should
+    /// each be given a different view of the font (see typeface::view()).
+    /// If the handle has not been successfully loaded, this fails and
+    /// leaves the canvas without a font.
+    ///
+    /// @param font  handle to a loaded font
+    /// @param size  size in pixels per em to draw at
+    /// @return      true if the font was set successfully
+    ///
+    bool set_font(
+        typeface const &font,
+        float size );
+
+    /// @brief  Set the memory limit for caching glyph outlines.
+    ///
+    /// Drawing text parses the outline of each glyph from the font data
+    /// in font units.  These parsed outlines are kept between calls so
+    /// that later text reusing the same glyphs can skip the parsing.  After
+    /// each line of text is drawn, the least recently used outlines are
+    /// discarded until the cache fits within this limit.  The cache belongs
+    /// to the current font; it is kept when only the size of the font is
+    /// changed, and when the font is shared, each canvas trims the cache to
+    /// its own limit after drawing with it.  Setting the limit to zero
+    /// discards each outline after the text using it has been drawn.
+    /// Defaults to 1 MiB.  If the limit is negative, this does nothing.
+    ///
+    /// @param bytes  approximate number of bytes of outline data to keep
+    ///
+    void set_glyph_cache(
+        int bytes );
+
     /// @brief  Draw a line of text by filling its outline.
     ///
     /// This behaves as though the current path were reset to the outline
@@ -1027,20 +1659,37 @@ public:
 
     // ======== DRAWING IMAGES ========
 
+    /// @brief  Filtering for resampling patterns and images when drawing.
+    ///
+    /// This applies to both image patterns set as the fill or stroke style
+    /// and to drawing images, and it is the setting at the time of drawing
+    /// that matters.  Where the pattern or image is shrunk, the filters
+    /// widen to keep the result antialiased, except for nearest.  When it
+    /// is shrunk by half or more, they first switch to a smaller copy
+    /// prefiltered and kept with the pattern, which bounds the cost per
+    /// pixel regardless of the scale.  Defaults to bicubic.
+    ///
+    /// nearest:   Take the texel that each pixel center lands in.
+    /// bilinear:  Use a tent filter across the nearest 2x2 texels.
+    /// bicubic:   Use a Catmull-Rom filter across the nearest 4x4 texels.
+    ///
+    smoothing_style image_smoothing;
+
     /// @brief  Draw an image onto the canvas.
     ///
     /// The position of the rectangle that the image is drawn to is affected
     /// by the current transform at the time of drawing, and the image will
-    /// be resampled as needed (with the filtering always clamping to the
-    /// edges of the image).  The drawing is also affected by the shadow,
-    /// global alpha, global compositing operation settings, and by the
-    /// clip region.  The current path is not affected by drawing an image.
-    /// The image data, which should be in top to bottom rows of contiguous
-    /// pixels from left to right, is not retained and it is safe to change
-    /// or destroy it after this call.  The width and height must both be
-    /// positive and the width and/or the height to scale to may be negative
-    /// but not zero.  Otherwise, or if the image pointer is null, or the
-    /// current transform is not invertible, this does nothing.
+    /// be resampled as needed according to the setting of image_smoothing
+    /// (with the filtering always clamping to the edges of the image).  The
+    /// drawing is also affected by the shadow, global alpha, global
+    /// compositing operation settings, and by the clip region.  The current
+    /// path is not affected by drawing an image.  The image data, which
+    /// should be in top to bottom rows of contiguous pixels from left to
+    /// right, is not retained and it is safe to change or destroy it after
+    /// this call.  The width and height must both be positive and the width
+    /// and/or the height to scale to may be negative but not zero.
+    /// Otherwise, or if the image pointer is null, or the current transform
+    /// is not invertible, this does nothing.
     ///
     /// Tip: to use a small piece of a larger image, reduce the width and
     ///      height, and offset the image pointer while keeping the stride.
@@ -1064,6 +1713,25 @@ public:
         float to_width,
         float to_height );
 
+    /// @brief  Draw a shared image onto the canvas.
+    ///
+    /// This is like drawing the image from the image data, except that the
+    /// canvas refers to the already loaded image rather than copying it.
+    /// If the handle has not been successfully loaded, this does nothing.
+    ///
+    /// @param image      handle to a loaded image
+    /// @param x          horizontal coordinate to draw the corner at
+    /// @param y          vertical coordinate to draw the corner at
+    /// @param to_width   width to scale the image to
+    /// @param to_height  height to scale the image to
+    ///
+    void draw_image(
+        shared_image const &image,
+        float x,
+        float y,
+        float to_width,
+        float to_height );
+
     // ======== PIXEL MANIPULATION ========
 
     /// @brief  Fetch a rectangle of pixels from the canvas to an image.
@@ -1128,6 +1796,31 @@ public:
         int x,
         int y );
 
+    /// @brief  Get the region of pixels changed since the last time, if any.
+    ///
+    /// This gives the bounding rectangle of all of the pixels that may have
+    /// been changed by drawing, clearing, or putting image data since the
+    /// canvas was created or since the last call to this, and then resets
+    /// it to empty.  The rectangle is conservative and lies within the
+    /// canvas.  Composite operations that affect the whole clip region
+    /// include all of it.  If nothing was changed, this sets the rectangle
+    /// to zeros and returns false.
+    ///
+    /// Tip: fetch just this rectangle with get_image_data() to update a
+    ///      copy of the canvas after drawing to small parts of it.
+    ///
+    /// @param x       set to horizontal coordinate of the upper-left pixel
+    /// @param y       set to vertical coordinate of the upper-left pixel
+    /// @param width   set to width of the rectangle in pixels
+    /// @param height  set to height of the rectangle in pixels
+    /// @return        true if any pixels may have been changed
+    ///
+    bool take_dirty_region(
+        int &x,
+        int &y,
+        int &width,
+        int &height );
+
     // ======== CANVAS STATE ========
 
     /// @brief  Save the current state as though to a stack.
@@ -1147,6 +1840,182 @@ public:
     ///
     void restore();
 
+    // ======== DISPLAY LISTS ========
+
+    /// @brief  Start or stop recording drawing calls into a display list.
+    ///
+    /// While recording, the canvas still draws as usual but also appends
+    /// each call that changes its state or draws onto it to the end of the
+    /// list.  This includes the transforms, styles, path building, drawing,
+    /// clipping, text, images, putting image data, and saving and restoring
+    /// the state.  Changes to the public settings (e.g., the composite
+    /// operation or line cap) are noted along with the next call after
+    /// them.  Queries, reading back image data, drawing prepared paths, the
+    /// glyph cache limit, and the task runner are not recorded.  The canvas
+    /// holds onto the pointer but does not take ownership; the list must
+    /// outlive its use by this canvas.  This is not part of the saved state.
+    /// Defaults to a null list (not recording).
+    ///
+    /// @param list  display list to append calls to, or null to stop
+    ///
+    void set_recording(
+        display_list *list );
+
+    /// @brief  Replay the calls recorded in a display list onto the canvas.
+    ///
+    /// This makes the same calls on this canvas as were recorded, in order,
+    /// starting from its current state.  So calls that are relative to the
+    /// current state, such as transforms and paths, build on whatever this
+    /// canvas had set beforehand, while the rest replace it as usual.
+    /// Replaying onto a canvas that is recording appends all of the calls
+    /// to the list that it is recording to, which must not be the list
+    /// being replayed.
+    ///
+    /// Tip: to draw one tile of a larger scene, translate by the negated
+    ///      corner of the tile first and then replay the scene's list.
+    ///
+    /// @param list  display list of calls to replay
+    ///
+    void replay(
+        display_list const &list );
+
+    /// @brief  Replay a display list into a region, tile by tile.
+    ///
+    /// This splits the region into square tiles of the given size and
+    /// replays the whole display list separately into each one, handing the
+    /// tiles to the task runner so that they may be drawn in parallel.  Each
+    /// tile skips rasterizing any drawing that falls completely outside of
+    /// it.  Only the pixels within the region are changed, so after small
+    /// changes, replaying just the area around them is enough to update
+    /// the canvas.  Unlike replay(), each tile starts from the default
+    /// state except for taking the current transform, and the state of this
+    /// canvas is left unchanged.  The calls are not recorded.  The region
+    /// must not be empty after clamping it to the canvas, and the tile size
+    /// must be positive.  If either does not hold, this does nothing.  The
+    /// tiles keep to the same geometry and dithering as the whole canvas,
+    /// so the pixels match those from replaying the list onto it, except
+    /// for rare off-by-one rounding where edges cross between tiles.
+    ///
+    /// Tip: the display list must not be changed while its tiles are drawn,
+    ///      but each tile gets its own glyph cache so text is safe to draw.
+    ///
+    /// @param list       display list of calls to replay
+    /// @param x          horizontal coordinate of the region's upper left
+    /// @param y          vertical coordinate of the region's upper left
+    /// @param width      width of the region in pixels
+    /// @param height     height of the region in pixels
+    /// @param tile_size  width and height of each tile in pixels
+    ///
+    void replay_tiles(
+        display_list const &list,
+        int x,
+        int y,
+        int width,
+        int height,
+        int tile_size );
+
+    /// @brief  Replay a display list in bands to stream out a taller image.
+    ///
+    /// This treats the canvas as a window onto an image with the same
+    /// width as the canvas but of the given height, which may be far too
+    /// large to hold in memory at once.  Working from the top down in bands
+    /// as tall as the canvas, it clears the canvas to transparent black,
+    /// replays the whole display list into it from its current state with
+    /// the rows offset to the band, and then hands the band's pixels to the
+    /// callback as 8-bit RGBA rows laid out as for get_image_data().  The
+    /// drawing skips anything that falls completely outside of the band,
+    /// and the band keeps to the same geometry and dithering as the whole
+    /// image would.  The last band may be shorter than the canvas.  The
+    /// state of the canvas is left unchanged, but its pixels are left
+    /// holding the last band.  The calls are not recorded.  If the height
+    /// is not positive or the callback is null, this does nothing.
+    ///
+    /// Tip: with the srgb_byte format, the callback gets the canvas's own
+    ///      rows directly and peak memory stays at about one band plus the
+    ///      display list; other formats also need a converted copy.
+    ///
+    /// @param list    display list of calls to replay
+    /// @param height  total height of the image in pixels
+    /// @param write   function to call with each band's pixel rows
+    /// @param data    opaque pointer to pass through to the callback
+    ///
+    void replay_bands(
+        display_list const &list,
+        int height,
+        void ( *write )( void *data, unsigned char const *image, int width,
+                         int height, int stride, int y ),
+        void *data );
+
+    // ======== CONCURRENCY ========
+
+    /// @brief  Set a task runner for compositing in parallel bands.
+    ///
+    /// When set, the main compositing of each drawing operation will be
+    /// split into the given number of horizontal bands of pixel rows that
+    /// are handed to the task runner to draw, possibly in parallel on other
+    /// threads.  The results are identical to drawing without it.  Note
+    /// that the canvas holds onto the pointer but does not take ownership;
+    /// the task runner must outlive its use by this canvas.  This is not
+    /// part of the saved state.  The number of bands must be positive.  If
+    /// it is not, this does nothing.  Defaults to a null runner and one
+    /// band (serial drawing on the calling thread).
+    ///
+    /// Tip: a few bands per thread helps to balance the load when drawing
+    ///      is heavier in some parts of the canvas than others.
+    ///
+    /// @param tasks  task runner to use, or null to draw serially
+    /// @param bands  number of horizontal bands to split drawing into
+    ///
+    void set_task_runner(
+        task_runner *tasks,
+        int bands );
+
+    // ======== MEMORY ========
+
+    /// @brief  Set the memory limit for keeping scratch buffers around.
+    ///
+    /// Drawing works through a number of internal buffers for the
+    /// polylines, coverage runs, shadows, and spans of pixels.  These are
+    /// normally kept between calls and grow as needed, so that later
+    /// drawing can reuse the storage, but this means that the memory from
+    /// one huge path stays with the canvas.  After each drawing or clipping
+    /// operation, if these buffers hold more than this limit in total, they
+    /// are all released.  Setting the limit to zero releases them after
+    /// every operation.  This does not include the pixels, the current
+    /// path, the saved states, or the glyph cache.  Defaults to no limit.
+    /// If the limit is negative, this does nothing.
+    ///
+    /// @param bytes  approximate number of bytes of scratch buffers to keep
+    ///
+    void set_scratch_limit(
+        int bytes );
+
+    /// @brief  Get and reset the high-water mark for scratch buffers.
+    ///
+    /// This reports the most memory that the canvas's scratch buffers (as
+    /// described for set_scratch_limit()) have held after any drawing or
+    /// clipping operation since the canvas was constructed or this was
+    /// last called, in bytes, and then resets it to what they hold now.
+    /// Values too large for an int are clamped.
+    ///
+    /// @return  peak number of bytes held in scratch buffers
+    ///
+    int take_scratch_peak();
+
+#ifdef CANVAS_ITY_STATS
+
+    // ======== STATISTICS ========
+
+    /// @brief  Running counts of the work done by this canvas.
+    ///
+    /// This is only available when building with CANVAS_ITY_STATS defined.
+    /// It starts at all zeros and is not part of the saved state.  When
+    /// replaying tiles, the work done for the tiles is not included.
+    ///
+    canvas_stats stats;
+
+#endif
+
 private:
     int size_x;
     int size_y;
@@ -1162,30 +2031,109 @@ private:
     paint_brush fill_brush;
     paint_brush stroke_brush;
     paint_brush image_brush;
+    paint_brush batch_brush;
     bezier_path path;
     line_path lines;
     line_path scratch;
     pixel_runs runs;
-    pixel_runs mask;
-    font_face face;
+    pixel_runs ordered;
+    std::vector< size_t > rows;
+    std::vector< float > cover;
+    std::vector< int > touched;
+    std::vector< xy > batch_points;
+    clip_mask *clipping;
+    font_face *face;
+    float font_scale;
+    size_t glyph_limit;
     rgba *bitmap;
-    canvas *saves;
+    std::vector< canvas_state > saves;
+    size_t depth;
+    task_runner *runner;
+    int band_count;
+    pixel_format storage;
+    unsigned short *packed;
+    unsigned char *encoded;
+    int byte_stride;
+    bool external;
+    std::vector< rgba > spans;
+    filter_taps sample_x;
+    filter_taps sample_y;
+    std::vector< rgba > filtered;
+    std::vector< rgba > sampled;
+    int filtered_stride;
+    rgba const *sample_texels;
+    int sample_width;
+    int sample_height;
+    display_list *recording;
+    int nesting;
+    xy origin;
+    int dirty_left;
+    int dirty_top;
+    int dirty_right;
+    int dirty_bottom;
+    size_t scratch_limit;
+    size_t scratch_peak;
+#ifdef CANVAS_ITY_STATS
+    std::vector< size_t > band_pixels;
+#endif
     canvas( canvas const & );
+    void initialize();
     canvas &operator=( canvas const & );
     void add_tessellation( xy, xy, xy, xy, float, int );
     void add_bezier( xy, xy, xy, xy, float );
     void path_to_lines( bool );
+    int load_glyph( int );
     void add_glyph( int, float );
+    void trim_glyphs( size_t );
     int character_to_glyph( char const *, int & );
     void text_to_lines( char const *, xy, float, bool );
     void dash_lines();
+    void add_arc( xy, xy, xy, float );
+    void add_path_arc( arc_data const &, xy, bool, float );
     void add_half_stroke( size_t, size_t, bool );
     void stroke_lines();
     void add_runs( xy, xy );
-    void lines_to_runs( xy, int );
+    void runs_to_cover( int, int );
+    bool rectangle_to_runs( xy, int, int );
+    bool rectangle_bounds( xy &, xy & );
+    void lines_to_runs( xy, int, int );
+    void prepare_lines( prepared_path &, bool );
     rgba paint_pixel( xy, paint_brush const & );
+    paint_brush &changing_brush( brush_type, bool );
+    void load_pattern( paint_brush &, unsigned char const *, int, int, int,
+                       repetition_style );
+    void share_pattern( paint_brush &, image_ref const &, repetition_style );
+    void draw_pattern( float, float, float, float );
+    void build_mipmaps( paint_brush & );
+    bool prepare_taps( filter_taps &, float, float, int, int, int, bool );
+    void prepare_sampling( paint_brush const &, int );
+    void sample_span( paint_brush const &, int, int, int, int );
+    void sample_gradient( paint_brush const &, int, int, int, int );
+    rgba load_pixel( int, int ) const;
+    void store_pixel( int, int, rgba );
+    rgba *load_span( int, int, int, int );
+    void store_span( int, int, int, int );
     void render_shadow( paint_brush const & );
-    void render_main( paint_brush const & );
+    void render_band( paint_brush const &, int, int, int );
+    static void render_band_task( void *, int );
+    void render_runs( paint_brush const & );
+    void mark_dirty( int, int, int, int );
+    bool lines_visible();
+    void render_main( paint_brush & );
+    void replay_calls( display_list const &, typeface const * );
+    static void replay_tile_task( void *, int );
+    void copy_tile( canvas &, int, int, bool );
+    void clear_pixels();
+    size_t scratch_bytes() const;
+    void trim_scratch();
+    void note( display_call, int = 0, float = 0.0f, float = 0.0f,
+               float = 0.0f, float = 0.0f, float = 0.0f, float = 0.0f,
+               float = 0.0f );
+    void note_values( float const *, int );
+    void note_text( char const * );
+    void note_font( typeface const & );
+    void note_image( unsigned char const *, int, int, int );
+    void note_shared( shared_image const & );
 };
 
 }
@@ -1215,11 +2163,43 @@ private:
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <numeric>
 
+#if !defined( CANVAS_ITY_NO_SIMD ) && \
+    ( defined( __SSE__ ) || defined( _M_X64 ) || \
+      ( defined( _M_IX86_FP ) && _M_IX86_FP >= 1 ) )
+#define CANVAS_ITY_SSE
+#include <xmmintrin.h>
+#elif !defined( CANVAS_ITY_NO_SIMD ) && defined( __ARM_NEON )
+#define CANVAS_ITY_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifndef CANVAS_ITY_STAGE_BEGIN
+#define CANVAS_ITY_STAGE_BEGIN( name )
+#endif
+#ifndef CANVAS_ITY_STAGE_END
+#define CANVAS_ITY_STAGE_END( name )
+#endif
+
 namespace canvas_ity
 {
 
+// Scope guard around a rendering stage for the profiling hooks, so that the
+// end hook runs however the stage returns.  With the hooks left undefined,
+// this compiles away to nothing.
+//
+struct stage_scope {
+    char const *stage;
+    explicit stage_scope( char const *name ) : stage( name ) {
+        CANVAS_ITY_STAGE_BEGIN( stage ); }
+    ~stage_scope() { CANVAS_ITY_STAGE_END( stage ); } };
+
 // 2D vector math operations
 xy::xy() : x( 0.0f ), y( 0.0f ) {}
 xy::xy( float new_x, float new_y ) : x( new_x ), y( new_y ) {}
@@ -1282,9 +2262,6 @@ static rgba const premultiplied( rgba that ) {
 static float delinearized( float value ) {
     return value < 0.0031308f ? 12.92f * value :
         1.055f * powf( value, 1.0f / 2.4f ) - 0.055f; }
-static rgba const delinearized( rgba that ) {
-    return rgba( delinearized( that.r ), delinearized( that.g ),
-                 delinearized( that.b ), that.a ); }
 static rgba const unpremultiplied( rgba that ) {
     static float const threshold = 1.0f / 8160.0f;
     return that.a < threshold ? rgba( 0.0f, 0.0f, 0.0f, 0.0f ) :
@@ -1296,23 +2273,457 @@ static rgba const clamped( rgba that ) {
                  std::min( std::max( that.b, 0.0f ), 1.0f ),
                  std::min( std::max( that.a, 0.0f ), 1.0f ) ); }
 
+// Table-driven sRGB conversions for 8-bit values.  Decoding simply looks
+// up the exact results of linearized().  Encoding interpolates between the
+// results of delinearized() sampled at 32 points per octave from 2^-9 up
+// to 1, indexed directly by the exponent and leading mantissa bits.  This
+// stays within 0.01 of a byte of the exact result after scaling to bytes,
+// so encoding only needs to fall back to the exact conversion when it is
+// that close to rounding to a different byte.
+static float linearized( unsigned char value ) {
+    static float const table[] = {
+        0.0f, 0.000303526991f, 0.000607053982f, 0.000910580973f,
+        0.00121410796f, 0.00151763496f, 0.00182116195f, 0.00212468882f,
+        0.00242821593f, 0.00273174304f, 0.00303526991f, 0.00334653561f,
+        0.00367650692f, 0.00402471703f, 0.00439144205f, 0.00477695325f,
+        0.00518151699f, 0.00560539169f, 0.00604883255f, 0.00651209103f,
+        0.00699541019f, 0.00749903172f, 0.00802319217f, 0.00856812485f,
+        0.00913405698f, 0.00972121768f, 0.010329823f, 0.0109600937f,
+        0.0116122449f, 0.012286487f, 0.0129830306f, 0.0137020806f,
+        0.0144438436f, 0.0152085144f, 0.0159962922f, 0.0168073755f,
+        0.0176419523f, 0.0185002182f, 0.0193823613f, 0.0202885624f,
+        0.0212190095f, 0.0221738834f, 0.0231533647f, 0.0241576303f,
+        0.0251868572f, 0.0262412224f, 0.0273208916f, 0.0284260381f,
+        0.0295568332f, 0.0307134409f, 0.0318960287f, 0.0331047624f,
+        0.0343398079f, 0.0356013142f, 0.036889445f, 0.0382043645f,
+        0.0395462364f, 0.0409151986f, 0.0423114114f, 0.0437350273f,
+        0.045186203f, 0.0466650836f, 0.048171822f, 0.0497065634f,
+        0.0512694679f, 0.0528606549f, 0.0544802807f, 0.0561284944f,
+        0.0578054339f, 0.0595112406f, 0.061246071f, 0.0630100295f,
+        0.0648032799f, 0.0666259527f, 0.068478182f, 0.0703601092f,
+        0.0722718611f, 0.0742135793f, 0.0761853904f, 0.0781874284f,
+        0.0802198276f, 0.0822827145f, 0.0843762159f, 0.0865004659f,
+        0.0886556059f, 0.0908417329f, 0.093058981f, 0.0953074843f,
+        0.0975873619f, 0.0998987406f, 0.102241747f, 0.104616493f,
+        0.107023112f, 0.109461717f, 0.111932434f, 0.114435382f, 0.116970673f,
+        0.119538434f, 0.122138798f, 0.124771841f, 0.127437696f, 0.13013649f,
+        0.132868335f, 0.135633349f, 0.138431624f, 0.141263306f, 0.144128487f,
+        0.147027284f, 0.149959803f, 0.152926162f, 0.155926466f, 0.158960864f,
+        0.1620294f, 0.165132225f, 0.168269396f, 0.171441093f, 0.174647391f,
+        0.177888408f, 0.181164235f, 0.18447499f, 0.187820762f, 0.191201672f,
+        0.194617808f, 0.198069304f, 0.201556236f, 0.205078706f, 0.20863685f,
+        0.212230727f, 0.215860531f, 0.219526231f, 0.223227978f, 0.226965889f,
+        0.23074007f, 0.234550655f, 0.238397658f, 0.242281199f, 0.246201396f,
+        0.25015837f, 0.254152179f, 0.258182913f, 0.262250721f, 0.266355664f,
+        0.270497859f, 0.274677366f, 0.278894335f, 0.283148795f, 0.287440896f,
+        0.291770697f, 0.296138316f, 0.300543845f, 0.304987371f, 0.309468955f,
+        0.313988745f, 0.318546832f, 0.323143244f, 0.327778131f, 0.332451582f,
+        0.337163657f, 0.341914445f, 0.346704096f, 0.351532698f, 0.356400251f,
+        0.361306876f, 0.366252691f, 0.371237785f, 0.376262218f, 0.381326109f,
+        0.386429518f, 0.391572565f, 0.396755308f, 0.401977867f, 0.407240301f,
+        0.412542701f, 0.417885154f, 0.423267752f, 0.428690553f, 0.434153706f,
+        0.439657241f, 0.445201248f, 0.450785846f, 0.456411064f, 0.462077051f,
+        0.467783839f, 0.473531544f, 0.479320228f, 0.48514998f, 0.491020888f,
+        0.496933043f, 0.502886593f, 0.50888145f, 0.514917791f, 0.520995677f,
+        0.527115226f, 0.533276498f, 0.539479613f, 0.545724571f, 0.55201149f,
+        0.55834049f, 0.56471163f, 0.571124911f, 0.577580512f, 0.584078491f,
+        0.590618908f, 0.597201884f, 0.603827417f, 0.610495627f, 0.617206633f,
+        0.623960435f, 0.630757213f, 0.637596965f, 0.644479752f, 0.651405692f,
+        0.658374846f, 0.665387332f, 0.672443211f, 0.679542542f, 0.686685443f,
+        0.693871915f, 0.701102018f, 0.708375931f, 0.715693653f, 0.723055243f,
+        0.730460882f, 0.737910569f, 0.745404363f, 0.752942324f, 0.760524631f,
+        0.768151283f, 0.775822341f, 0.783537924f, 0.791298032f, 0.799102843f,
+        0.806952357f, 0.814846694f, 0.822785854f, 0.830769956f, 0.838799119f,
+        0.846873283f, 0.854992688f, 0.863157272f, 0.871367216f, 0.87962234f,
+        0.887923181f, 0.896269381f, 0.904661357f, 0.913098693f, 0.921582043f,
+        0.930110872f, 0.938685894f, 0.947306573f, 0.955973506f, 0.964686275f,
+        0.973445475f, 0.982250571f, 0.991102219f, 1.0f };
+    return table[ value ]; }
+static float delinearized_quickly( float value ) {
+    static float const table[] = {
+        0.0234133452f, 0.0244251937f, 0.0254193172f, 0.0263965204f,
+        0.0273575708f, 0.0283031762f, 0.0292339846f, 0.0301506072f,
+        0.031053625f, 0.0319435596f, 0.0328209251f, 0.0336861983f,
+        0.0345397964f, 0.0353821516f, 0.0362136737f, 0.0370346978f,
+        0.0378455967f, 0.0386467129f, 0.0394383371f, 0.0402207822f,
+        0.0409943163f, 0.0417592376f, 0.0425157771f, 0.0432641879f,
+        0.0440047011f, 0.0447375476f, 0.0454629287f, 0.0461810455f,
+        0.0468920991f, 0.0475962758f, 0.0482937396f, 0.0489846841f,
+        0.0496692583f, 0.0510199219f, 0.0523469076f, 0.053651318f,
+        0.0549341664f, 0.0561963916f, 0.0574388728f, 0.058662422f,
+        0.0598678067f, 0.0610557348f, 0.0622268766f, 0.0633818656f,
+        0.0645212904f, 0.0656457022f, 0.066755645f, 0.0678515807f,
+        0.0689340085f, 0.070003368f, 0.071060054f, 0.0721044913f,
+        0.0731370524f, 0.0741580799f, 0.0751679465f, 0.0761669502f,
+        0.0771554187f, 0.078133665f, 0.0791019127f, 0.0800604895f,
+        0.0810096338f, 0.0819495991f, 0.0828806087f, 0.0838029012f,
+        0.0847167f, 0.0865196064f, 0.0882909223f, 0.0900321081f,
+        0.0917445049f, 0.0934293792f, 0.0950878933f, 0.0967211351f,
+        0.0983301178f, 0.0999158248f, 0.101479106f, 0.103020824f,
+        0.104541771f, 0.106042691f, 0.107524268f, 0.10898719f, 0.110432066f,
+        0.111859463f, 0.113269977f, 0.114664145f, 0.116042443f, 0.117405362f,
+        0.118753351f, 0.120086886f, 0.121406324f, 0.122712098f, 0.12400458f,
+        0.125284106f, 0.126551092f, 0.127805769f, 0.129048526f, 0.13027966f,
+        0.13149941f, 0.133906007f, 0.136270434f, 0.138594627f, 0.140880406f,
+        0.143129438f, 0.145343304f, 0.147523403f, 0.149671167f, 0.151787788f,
+        0.153874546f, 0.155932516f, 0.157962739f, 0.159966201f, 0.161943883f,
+        0.16389665f, 0.165825307f, 0.167730659f, 0.169613481f, 0.171474457f,
+        0.173314273f, 0.175133556f, 0.176932901f, 0.178712934f, 0.180474192f,
+        0.182217181f, 0.183942437f, 0.185650438f, 0.187341601f, 0.189016432f,
+        0.190675318f, 0.192318648f, 0.193946838f, 0.197159261f, 0.200315416f,
+        0.203417838f, 0.20646897f, 0.209471047f, 0.212426215f, 0.215336293f,
+        0.218203187f, 0.221028596f, 0.22381404f, 0.226561099f, 0.229271114f,
+        0.231945425f, 0.234585315f, 0.237191945f, 0.239766389f, 0.242309779f,
+        0.244823009f, 0.247307092f, 0.249762952f, 0.252191395f, 0.254593283f,
+        0.256969333f, 0.259320349f, 0.261646956f, 0.263949871f, 0.266229779f,
+        0.268487215f, 0.270722836f, 0.272937208f, 0.275130779f, 0.277304173f,
+        0.28159225f, 0.285805166f, 0.289946407f, 0.294019222f, 0.298026532f,
+        0.301971138f, 0.305855662f, 0.309682518f, 0.313453972f, 0.31717211f,
+        0.320838958f, 0.324456424f, 0.328026235f, 0.331550032f, 0.335029423f,
+        0.338465929f, 0.34186089f, 0.345215708f, 0.348531574f, 0.35180974f,
+        0.355051339f, 0.358257473f, 0.361429125f, 0.36456728f, 0.36767298f,
+        0.370747f, 0.373790294f, 0.376803637f, 0.379787832f, 0.382743627f,
+        0.385671735f, 0.388572842f, 0.394296736f, 0.399920315f, 0.405448228f,
+        0.410884768f, 0.416233897f, 0.421499342f, 0.426684529f, 0.431792766f,
+        0.436827034f, 0.441790164f, 0.446684837f, 0.451513529f, 0.456278682f,
+        0.460982382f, 0.465626836f, 0.470214009f, 0.47474575f, 0.479223847f,
+        0.483650029f, 0.488025904f, 0.492352843f, 0.496632516f, 0.500866175f,
+        0.50505513f, 0.509200752f, 0.513304114f, 0.517366409f, 0.52138871f,
+        0.525372148f, 0.529317617f, 0.533226192f, 0.537098706f, 0.544739187f,
+        0.552245796f, 0.559624672f, 0.566881537f, 0.574021757f, 0.581050336f,
+        0.587971687f, 0.594790399f, 0.601510346f, 0.608135283f, 0.614668906f,
+        0.621114433f, 0.627475142f, 0.633753836f, 0.639953494f, 0.64607656f,
+        0.652125716f, 0.658103287f, 0.664011538f, 0.669852555f, 0.675628424f,
+        0.681341052f, 0.686992347f, 0.692583919f, 0.698117614f, 0.703594923f,
+        0.709017456f, 0.714386642f, 0.719703853f, 0.72497046f, 0.730187714f,
+        0.735356927f, 0.745555758f, 0.755575895f, 0.765425503f, 0.775112271f,
+        0.784643292f, 0.794025242f, 0.80326426f, 0.812366128f, 0.821336091f,
+        0.830179453f, 0.838900745f, 0.847504497f, 0.855994999f, 0.864376128f,
+        0.872651577f, 0.880824983f, 0.888899624f, 0.896878719f, 0.904765248f,
+        0.912562072f, 0.920271933f, 0.927897394f, 0.935440898f, 0.94290483f,
+        0.950291336f, 0.957602799f, 0.964840949f, 0.97200793f, 0.979105532f,
+        0.986135662f, 0.993099868f, 0.99999994f };
+    if ( value < 0.0031308f )
+        return 12.92f * value;
+    if ( !( value < 1.0f ) )
+        return table[ 288 ];
+    unsigned int bits;
+    std::memcpy( &bits, &value, sizeof( bits ) );
+    unsigned int index = ( bits >> 18 ) - ( 118u << 5 );
+    float fraction = static_cast< float >( bits & 0x3ffffu ) / 262144.0f;
+    return table[ index ] +
+        fraction * ( table[ index + 1 ] - table[ index ] ); }
+
+// Helpers for compact pixel storage
+static unsigned short half_float( float value ) {
+    unsigned int bits;
+    std::memcpy( &bits, &value, sizeof( bits ) );
+    unsigned int sign = bits >> 16 & 0x8000u;
+    bits &= 0x7fffffffu;
+    if ( bits >= 0x47800000u )
+        return static_cast< unsigned short >(
+            sign | ( bits > 0x7f800000u ? 0x7e00u : 0x7c00u ) );
+    if ( bits < 0x38800000u ) {
+        float magic = 0.5f;
+        unsigned int offset;
+        std::memcpy( &offset, &magic, sizeof( offset ) );
+        value = fabsf( value ) + magic;
+        std::memcpy( &bits, &value, sizeof( bits ) );
+        return static_cast< unsigned short >( sign | ( bits - offset ) ); }
+    bits += 0xc8000fffu + ( bits >> 13 & 1u );
+    return static_cast< unsigned short >( sign | bits >> 13 ); }
+static float full_float( unsigned short half ) {
+    unsigned int sign = ( half & 0x8000u ) << 16;
+    unsigned int exponent = half >> 10 & 0x1fu;
+    unsigned int mantissa = half & 0x3ffu;
+    float value;
+    if ( exponent == 0 ) {
+        value = static_cast< float >( mantissa ) * 5.96046448e-8f;
+        return sign ? -value : value; }
+    unsigned int bits = sign | mantissa << 13 |
+        ( exponent == 31 ? 0x7f800000u : ( exponent + 112u ) << 23 );
+    std::memcpy( &value, &bits, sizeof( value ) );
+    return value; }
+static unsigned short normalized_short( float value ) {
+    return static_cast< unsigned short >(
+        std::min( std::max( 0.0f, value ), 1.0f ) * 65535.0f + 0.5f ); }
+static float dither_threshold( int x, int y ) {
+    static float const bayer[][ 4 ] = {
+        { 0.03125f, 0.53125f, 0.15625f, 0.65625f },
+        { 0.78125f, 0.28125f, 0.90625f, 0.40625f },
+        { 0.21875f, 0.71875f, 0.09375f, 0.59375f },
+        { 0.96875f, 0.46875f, 0.84375f, 0.34375f } };
+    return bayer[ y & 3 ][ x & 3 ]; }
+static rgba const encoded_to_color( unsigned char const *pixel ) {
+    rgba color = rgba( linearized( pixel[ 0 ] ), linearized( pixel[ 1 ] ),
+                       linearized( pixel[ 2 ] ), pixel[ 3 ] / 255.0f );
+    return premultiplied( color ); }
+static unsigned char encoded_channel( float value, float threshold ) {
+    float level = threshold + 255.0f * delinearized_quickly( value );
+    float fraction = level - static_cast< float >(
+        static_cast< int >( level ) );
+    if ( fraction < 0.01f || 0.99f < fraction )
+        level = threshold + 255.0f * delinearized( value );
+    return static_cast< unsigned char >( level ); }
+static void color_to_encoded( rgba color, float threshold,
+                              unsigned char *pixel ) {
+    color = clamped( unpremultiplied( color ) );
+    pixel[ 0 ] = encoded_channel( color.r, threshold );
+    pixel[ 1 ] = encoded_channel( color.g, threshold );
+    pixel[ 2 ] = encoded_channel( color.b, threshold );
+    pixel[ 3 ] = static_cast< unsigned char >(
+        threshold + 255.0f * color.a ); }
+
+// Helpers for resampling patterns
+static float filter_weight( float distance, smoothing_style style ) {
+    if ( style == bilinear )
+        return std::max( 1.0f - distance, 0.0f );
+    return distance < 1.0f ?
+        (    1.5f * distance - 2.5f ) * distance          * distance + 1.0f :
+        ( ( -0.5f * distance + 2.5f ) * distance - 4.0f ) * distance + 2.0f; }
+static void box_weights( int count, int length, std::vector< int > &first,
+                         std::vector< float > &weights ) {
+    float ratio = static_cast< float >( count ) /
+        static_cast< float >( length );
+    first.resize( static_cast< size_t >( length ) );
+    weights.assign( static_cast< size_t >( length * 3 ), 0.0f );
+    for ( int index = 0; index < length; ++index ) {
+        float low = static_cast< float >( index ) * ratio;
+        float high = std::min( static_cast< float >( index + 1 ) * ratio,
+                               static_cast< float >( count ) );
+        int start = std::min( static_cast< int >( low ), count - 1 );
+        first[ static_cast< size_t >( index ) ] = start;
+        for ( int texel = start; static_cast< float >( texel ) < high &&
+                  texel < start + 3; ++texel ) {
+            float cover =
+                std::min( static_cast< float >( texel + 1 ), high ) -
+                std::max( static_cast< float >( texel ), low );
+            size_t tap = static_cast< size_t >( index * 3 + texel - start );
+            weights[ tap ] = cover / ( high - low ); } } }
+static bool is_blank( paint_brush const &brush ) {
+    return brush.colors.empty() && !brush.image.data; }
+static rgba const *pattern_texels( paint_brush const &brush ) {
+    return brush.image.data ? &brush.image.data->texels.front() :
+        &brush.colors.front(); }
+static rgba const *mipmap_level( paint_brush const &brush,
+                                 float scale_x, float scale_y,
+                                 int &width, int &height ) {
+    std::vector< rgba > const &mipmaps = brush.image.data ?
+        brush.image.data->mipmaps : brush.mipmaps;
+    rgba const *texels = pattern_texels( brush );
+    width = brush.width;
+    height = brush.height;
+    size_t offset = 0;
+    while ( offset < mipmaps.size() ) {
+        int next_x = ( width + 1 ) / 2;
+        int next_y = ( height + 1 ) / 2;
+        if ( scale_x * static_cast< float >( next_x ) <
+                 static_cast< float >( brush.width ) ||
+             scale_y * static_cast< float >( next_y ) <
+                 static_cast< float >( brush.height ) )
+            break;
+        texels = &mipmaps[ offset ];
+        offset += static_cast< size_t >( next_x * next_y );
+        width = next_x;
+        height = next_y; }
+    return texels; }
+
+// Helpers for counting references to fonts and images that may be shared
+// between threads.  Where the compiler has atomic intrinsics, these use
+// them so that the last one to release something is the only one to see
+// the count reach zero.  Otherwise they fall back to plain arithmetic.
+static void add_reference( long &references ) {
+#if defined( _MSC_VER )
+    _InterlockedIncrement( &references );
+#elif defined( __GNUC__ )
+    __sync_add_and_fetch( &references, 1L );
+#else
+    ++references;
+#endif
+}
+static bool drop_reference( long &references ) {
+#if defined( _MSC_VER )
+    return !_InterlockedDecrement( &references );
+#elif defined( __GNUC__ )
+    return !__sync_sub_and_fetch( &references, 1L );
+#else
+    return !--references;
+#endif
+}
+
+// Helpers for swapping state without copying
+static void swap_brushes( paint_brush &left, paint_brush &right ) {
+    std::swap( left.type, right.type );
+    left.colors.swap( right.colors );
+    left.stops.swap( right.stops );
+    std::swap( left.start, right.start );
+    std::swap( left.end, right.end );
+    std::swap( left.start_radius, right.start_radius );
+    std::swap( left.end_radius, right.end_radius );
+    std::swap( left.width, right.width );
+    std::swap( left.height, right.height );
+    std::swap( left.repetition, right.repetition );
+    left.mipmaps.swap( right.mipmaps );
+    std::swap( left.image.data, right.image.data ); }
+static void release_face( font_face *face ) {
+    if ( !face || !drop_reference( face->references ) )
+        return;
+    release_face( face->source );
+    delete face; }
+static font_face *view_face( font_face *source ) {
+    font_face *view = new font_face();
+    view->bytes = source->bytes;
+    view->cmap = source->cmap;
+    view->glyf = source->glyf;
+    view->head = source->head;
+    view->hhea = source->hhea;
+    view->hmtx = source->hmtx;
+    view->loca = source->loca;
+    view->maxp = source->maxp;
+    view->os_2 = source->os_2;
+    view->format_12 = source->format_12;
+    view->format_4 = source->format_4;
+    view->format_0 = source->format_0;
+    view->source = source;
+    view->references = 1;
+    add_reference( source->references );
+    return view; }
+
+// Convert between ints and run coordinates.  Only the compact coordinates
+// need an explicit cast; wide ones are plain ints already.
+#ifdef CANVAS_ITY_WIDE_RUNS
+static run_coordinate to_run( int value ) {
+    return value; }
+#else
+static run_coordinate to_run( int value ) {
+    return static_cast< run_coordinate >( value ); }
+#endif
+static int from_run( run_coordinate value ) {
+    return value; }
+
+// Find the number of chords for tessellating an arc of the given radius
+// and angle in untransformed space.  This works from the largest radius
+// that the transform can stretch it to, such that the sagitta of each
+// chord is within the tolerance and no chord turns more than the limit.
+// The tolerance is a quarter of the flatness tolerance for Beziers, since
+// that is roughly what subdividing the Bezier approximation of an arc by
+// halves ends up reaching.  There is always at least one chord, even for
+// an angle of zero or NaN.
+static int arc_chords( affine_matrix const &transform, float radius,
+                       float angle, float limit ) {
+    static float const tolerance = 0.03125f;
+    float sum = ( transform.a * transform.a + transform.b * transform.b +
+                  transform.c * transform.c + transform.d * transform.d );
+    float determinant = transform.a * transform.d - transform.b * transform.c;
+    float stretch = sqrtf( 0.5f * ( sum + sqrtf( std::max(
+        sum * sum - 4.0f * determinant * determinant, 0.0f ) ) ) );
+    float scaled = stretch * radius;
+    float step = scaled > tolerance ?
+        std::min( 2.0f * acosf( 1.0f - tolerance / scaled ), limit ) : limit;
+    float chords = ceilf( fabsf( angle ) / step );
+    return !( chords >= 1.0f ) ? 1 :
+        static_cast< int >( std::min( chords, 65536.0f ) ); }
+
+// Keeps count of the drawing calls in progress so that only the outermost
+// ones get recorded, and not those that they make internally.
+struct call_nesting {
+    int &level;
+    explicit call_nesting( int &count ) : level( count ) { ++level; }
+    ~call_nesting() { --level; } };
+template< typename type > static type enumerated( float value ) {
+    return static_cast< type >( static_cast< int >( value ) ); }
+
 // Helpers for TTF file parsing
-static int unsigned_8( std::vector< unsigned char > &data, int index ) {
+static int unsigned_8( unsigned char const *data, int index ) {
     return data[ static_cast< size_t >( index ) ]; }
-static int signed_8( std::vector< unsigned char > &data, int index ) {
+static int signed_8( unsigned char const *data, int index ) {
     size_t place = static_cast< size_t >( index );
     return static_cast< signed char >( data[ place ] ); }
-static int unsigned_16( std::vector< unsigned char > &data, int index ) {
+static int unsigned_16( unsigned char const *data, int index ) {
     size_t place = static_cast< size_t >( index );
     return data[ place ] << 8 | data[ place + 1 ]; }
-static int signed_16( std::vector< unsigned char > &data, int index ) {
+static int signed_16( unsigned char const *data, int index ) {
     size_t place = static_cast< size_t >( index );
     return static_cast< short >( data[ place ] << 8 | data[ place + 1 ] ); }
-static int signed_32( std::vector< unsigned char > &data, int index ) {
+static int signed_32( unsigned char const *data, int index ) {
     size_t place = static_cast< size_t >( index );
     return ( data[ place + 0 ] << 24 | data[ place + 1 ] << 16 |
              data[ place + 2 ] <<  8 | data[ place + 3 ] <<  0 ); }
 
+// Parse and validate a TTF font file into a font face.  This locates the
+// tables needed for drawing and the character map subtables that it knows
+// how to use.  Normally, it copies just the header and those tables into
+// the face's own data and records where each landed there.  When borrowing,
+// it records the tables' offsets in the original file contents instead and
+// reads from those directly.
+//
+static bool load_face(
+    font_face &face,
+    unsigned char const *font,
+    int bytes,
+    bool borrow )
+{
+    if ( !font || bytes < 6 )
+        return false;
+    int version = signed_32( font, 0 );
+    int tables = unsigned_16( font, 4 );
+    if ( ( version != 0x00010000 && version != 0x74727565 ) ||
+         bytes < tables * 16 + 12 )
+        return false;
+    if ( !borrow )
+        face.data.insert( face.data.end(), font, font + tables * 16 + 12 );
+    for ( int index = 0; index < tables; ++index )
+    {
+        int tag = signed_32( font, index * 16 + 12 );
+        int offset = signed_32( font, index * 16 + 20 );
+        int span = signed_32( font, index * 16 + 24 );
+        if ( bytes < offset + span )
+            return false;
+        int place = borrow ? offset : static_cast< int >( face.data.size() );
+        if ( tag == 0x636d6170 )
+            face.cmap = place;
+        else if ( tag == 0x676c7966 )
+            face.glyf = place;
+        else if ( tag == 0x68656164 )
+            face.head = place;
+        else if ( tag == 0x68686561 )
+            face.hhea = place;
+        else if ( tag == 0x686d7478 )
+            face.hmtx = place;
+        else if ( tag == 0x6c6f6361 )
+            face.loca = place;
+        else if ( tag == 0x6d617870 )
+            face.maxp = place;
+        else if ( tag == 0x4f532f32 )
+            face.os_2 = place;
+        else
+            continue;
+        if ( !borrow )
+            face.data.insert(
+                face.data.end(), font + offset, font + offset + span );
+    }
+    if ( !face.cmap || !face.glyf || !face.head || !face.hhea ||
+         !face.hmtx || !face.loca || !face.maxp || !face.os_2 )
+        return false;
+    face.bytes = borrow ? font : &face.data[ 0 ];
+    int subtables = unsigned_16( face.bytes, face.cmap + 2 );
+    for ( int table = 0; table < subtables; ++table )
+    {
+        int record = face.cmap + table * 8;
+        int platform = unsigned_16( face.bytes, record + 4 );
+        int encoding = unsigned_16( face.bytes, record + 6 );
+        int offset = signed_32( face.bytes, record + 8 );
+        int format = unsigned_16( face.bytes, face.cmap + offset );
+        if ( platform == 3 && encoding == 10 && format == 12 )
+            face.format_12 = face.cmap + offset;
+        else if ( platform == 3 && encoding == 1 && format == 4 )
+            face.format_4 = face.cmap + offset;
+        else if ( format == 0 )
+            face.format_0 = face.cmap + offset;
+    }
+    return true;
+}
+
 // Tessellate (at low-level) a cubic Bezier curve and add it to the polyline
 // data.  This recursively splits the curve until two criteria are met
 // (subject to a hard recursion depth limit).  First, the control points
@@ -1326,7 +2737,8 @@ static int signed_32( std::vector< unsigned char > &data, int index ) {
 // This keeps expanded strokes approximately within tolerance.  Note that
 // in the base case, it adds the control points as well as the end points.
 // This way, stroke expansion infers the correct tangents from the ends of
-// the polylines.
+// the polylines.  The tests are phrased so that NaNs, as from points at
+// infinity, pass them rather than splitting all the way to the limit.
 //
 void canvas::add_tessellation(
     xy point_1,
@@ -1363,11 +2775,14 @@ void canvas::add_tessellation(
         else if ( squared_2 * squared_3 != 0.0f )
             cosine = dot( edge_2, edge_3 ) / sqrtf( squared_2 * squared_3 );
     }
-    if ( ( dot( to_line_1, to_line_1 ) <= flatness &&
-           dot( to_line_2, to_line_2 ) <= flatness &&
-           cosine >= angular ) ||
+    if ( !( dot( to_line_1, to_line_1 ) > flatness ||
+            dot( to_line_2, to_line_2 ) > flatness ||
+            cosine < angular ) ||
          !limit )
     {
+#ifdef CANVAS_ITY_STATS
+        ++stats.bezier_segments;
+#endif
         if ( angular > -1.0f && squared_1 != 0.0f )
             lines.points.push_back( control_1 );
         if ( angular > -1.0f && squared_2 != 0.0f )
@@ -1408,6 +2823,9 @@ void canvas::add_bezier(
     if ( dot( edge_1, edge_1 ) == 0.0f &&
          dot( edge_3, edge_3 ) == 0.0f )
     {
+#ifdef CANVAS_ITY_STATS
+        ++stats.bezier_segments;
+#endif
         lines.points.push_back( point_2 );
         return;
     }
@@ -1490,18 +2908,26 @@ void canvas::add_bezier(
 // complete set of subpaths in the current path (stored as sets of cubic
 // Beziers) and converts each Bezier curve segment to a polyline while
 // preserving information about where subpaths begin and end and whether
-// they are closed or open.  This replaces the previous polyline data.
+// they are closed or open.  Runs of Beziers that came from a circular arc
+// are replaced by chords of the true arc instead, with the count found
+// directly rather than by subdividing.  When stroking, those chords are
+// also kept within the same turning limit that the Beziers must meet.
+// This replaces the previous polyline data.
 //
 void canvas::path_to_lines(
     bool stroking )
 {
+    stage_scope scope( "path_to_lines" );
     static float const tolerance = 0.125f;
     float ratio = tolerance / std::max( 0.5f * line_width, tolerance );
     float angular = stroking ? ( ratio - 2.0f ) * ratio * 2.0f + 1.0f : -1.0f;
+    float limit = stroking ? std::min( acosf( angular ), 1.57079633f ) :
+                             3.14159265f;
     lines.points.clear();
     lines.subpaths.clear();
     size_t index = 0;
     size_t ending = 0;
+    size_t arc = 0;
     for ( size_t subpath = 0; subpath < path.subpaths.size(); ++subpath )
     {
         ending += path.subpaths[ subpath ].count;
@@ -1510,6 +2936,14 @@ void canvas::path_to_lines(
         lines.points.push_back( point_1 );
         for ( ; index < ending; index += 3 )
         {
+            if ( arc < path.arcs.size() && path.arcs[ arc ].first == index )
+            {
+                arc_data const &entry = path.arcs[ arc++ ];
+                point_1 = path.points[ entry.last - 1 ];
+                add_path_arc( entry, point_1, stroking, limit );
+                index = entry.last - 3;
+                continue;
+            }
             xy control_1 = path.points[ index + 0 ];
             xy control_2 = path.points[ index + 1 ];
             xy point_2 = path.points[ index + 2 ];
@@ -1523,81 +2957,100 @@ void canvas::path_to_lines(
     }
 }
 
-// Add a text glyph directly to the polylines.  Given a glyph index, this
-// parses the data for that glyph directly from the TTF glyph data table and
-// immediately tessellates it to a set of a polyline subpaths which it adds
-// to any subpaths already present.  It uses the current transform matrix to
-// transform from the glyph's vertices in font units to the proper size and
-// position on the canvas.
+// Find the parsed outline for a glyph in the glyph cache, or parse it into
+// the cache if missing, and return its slot in the cache.  Parsing reads
+// the data for that glyph directly from the TTF glyph data table.  Simple
+// glyphs have their points decoded in font units, offset by the left side
+// bearing, along with the index of the last point in each contour.  For
+// composite glyphs, it records each component glyph along with the matrix
+// for transforming it.  Either way, the outline is marked as just used.
+// Nothing is evicted here, so slots stay valid until the cache is trimmed.
 //
-void canvas::add_glyph(
-    int glyph,
-    float angular )
+int canvas::load_glyph(
+    int glyph )
 {
-    int loc_format = unsigned_16( face.data, face.head + 50 );
-    int offset = face.glyf + ( loc_format ?
-        signed_32( face.data, face.loca + glyph * 4 ) :
-        unsigned_16( face.data, face.loca + glyph * 2 ) * 2 );
-    int next = face.glyf + ( loc_format ?
-        signed_32( face.data, face.loca + glyph * 4 + 4 ) :
-        unsigned_16( face.data, face.loca + glyph * 2 + 2 ) * 2 );
-    if ( offset == next )
-        return;
-    int contours = signed_16( face.data, offset );
+    glyph_cache &glyphs = face->glyphs;
+    if ( static_cast< size_t >( glyph ) >= glyphs.slots.size() )
+        glyphs.slots.resize( static_cast< size_t >( glyph ) + 1, -1 );
+    if ( !++glyphs.clock )
+    {
+        for ( size_t slot = 0; slot < glyphs.outlines.size(); ++slot )
+            glyphs.outlines[ slot ].used = 0;
+        glyphs.clock = 1;
+    }
+    int slot = glyphs.slots[ static_cast< size_t >( glyph ) ];
+    if ( slot >= 0 )
+    {
+        glyphs.outlines[ static_cast< size_t >( slot ) ].used = glyphs.clock;
+        return slot;
+    }
+    slot = static_cast< int >( glyphs.outlines.size() );
+    glyphs.slots[ static_cast< size_t >( glyph ) ] = slot;
+    glyphs.outlines.push_back( glyph_outline() );
+    glyph_outline &outline = glyphs.outlines.back();
+    outline.glyph = glyph;
+    outline.used = glyphs.clock;
+    int loc_format = unsigned_16( face->bytes, face->head + 50 );
+    int offset = face->glyf + ( loc_format ?
+        signed_32( face->bytes, face->loca + glyph * 4 ) :
+        unsigned_16( face->bytes, face->loca + glyph * 2 ) * 2 );
+    int next = face->glyf + ( loc_format ?
+        signed_32( face->bytes, face->loca + glyph * 4 + 4 ) :
+        unsigned_16( face->bytes, face->loca + glyph * 2 + 2 ) * 2 );
+    int contours = offset == next ? 0 : signed_16( face->bytes, offset );
     if ( contours < 0 )
     {
         offset += 10;
         for ( ; ; )
         {
-            int flags = unsigned_16( face.data, offset );
-            int component = unsigned_16( face.data, offset + 2 );
+            int flags = unsigned_16( face->bytes, offset );
+            int component = unsigned_16( face->bytes, offset + 2 );
             if ( !( flags & 2 ) )
-                return; // Matching points are not supported
+                break; // Matching points are not supported
             float e = static_cast< float >( flags & 1 ?
-                signed_16( face.data, offset + 4 ) :
-                signed_8( face.data, offset + 4 ) );
+                signed_16( face->bytes, offset + 4 ) :
+                signed_8( face->bytes, offset + 4 ) );
             float f = static_cast< float >( flags & 1 ?
-                signed_16( face.data, offset + 6 ) :
-                signed_8( face.data, offset + 5 ) );
+                signed_16( face->bytes, offset + 6 ) :
+                signed_8( face->bytes, offset + 5 ) );
             offset += flags & 1 ? 8 : 6;
             float a = flags & 200 ? static_cast< float >(
-                signed_16( face.data, offset ) ) / 16384.0f : 1.0f;
+                signed_16( face->bytes, offset ) ) / 16384.0f : 1.0f;
             float b = flags & 128 ? static_cast< float >(
-                signed_16( face.data, offset + 2 ) ) / 16384.0f : 0.0f;
+                signed_16( face->bytes, offset + 2 ) ) / 16384.0f : 0.0f;
             float c = flags & 128 ? static_cast< float >(
-                signed_16( face.data, offset + 4 ) ) / 16384.0f : 0.0f;
+                signed_16( face->bytes, offset + 4 ) ) / 16384.0f : 0.0f;
             float d = flags & 8 ? a :
                 flags & 64 ? static_cast< float >(
-                    signed_16( face.data, offset + 2 ) ) / 16384.0f :
+                    signed_16( face->bytes, offset + 2 ) ) / 16384.0f :
                 flags & 128 ? static_cast< float >(
-                    signed_16( face.data, offset + 6 ) ) / 16384.0f :
+                    signed_16( face->bytes, offset + 6 ) ) / 16384.0f :
                 1.0f;
             offset += flags & 8 ? 2 : flags & 64 ? 4 : flags & 128 ? 8 : 0;
-            affine_matrix saved_forward = forward;
-            affine_matrix saved_inverse = inverse;
-            transform( a, b, c, d, e, f );
-            add_glyph( component, angular );
-            forward = saved_forward;
-            inverse = saved_inverse;
+            glyph_part part = { component, a, b, c, d, e, f };
+            outline.parts.push_back( part );
             if ( !( flags & 32 ) )
-                return;
+                break;
         }
+        contours = 0;
     }
-    int hmetrics = unsigned_16( face.data, face.hhea + 34 );
-    int left_side_bearing = glyph < hmetrics ?
-        signed_16( face.data, face.hmtx + glyph * 4 + 2 ) :
-        signed_16( face.data, face.hmtx + hmetrics * 2 + glyph * 2 );
-    int x_min = signed_16( face.data, offset + 2 );
-    int points = unsigned_16( face.data, offset + 8 + contours * 2 ) + 1;
-    int instructions = unsigned_16( face.data, offset + 10 + contours * 2 );
+    int hmetrics = unsigned_16( face->bytes, face->hhea + 34 );
+    int left_side_bearing = !contours ? 0 : glyph < hmetrics ?
+        signed_16( face->bytes, face->hmtx + glyph * 4 + 2 ) :
+        signed_16( face->bytes, face->hmtx + hmetrics * 2 + glyph * 2 );
+    int x_min = !contours ? 0 : signed_16( face->bytes, offset + 2 );
+    int points = !contours ? 0 :
+        unsigned_16( face->bytes, offset + 8 + contours * 2 ) + 1;
+    int instructions = !contours ? 0 :
+        unsigned_16( face->bytes, offset + 10 + contours * 2 );
     int flags_array = offset + 12 + contours * 2 + instructions;
     int flags_size = 0;
     int x_size = 0;
     for ( int index = 0; index < points; )
     {
-        int flags = unsigned_8( face.data, flags_array + flags_size++ );
+        int flags = unsigned_8( face->bytes, flags_array + flags_size++ );
         int repeated = flags & 8 ?
-            unsigned_8( face.data, flags_array + flags_size++ ) + 1 : 1;
+            unsigned_8( face->bytes, flags_array + flags_size++ ) + 1 : 1;
         x_size += repeated * ( flags & 2 ? 1 : flags & 16 ? 0 : 2 );
         index += repeated;
     }
@@ -1610,47 +3063,95 @@ void canvas::add_glyph(
     int index = 0;
     for ( int contour = 0; contour < contours; ++contour )
     {
-        int beginning = index;
-        int ending = unsigned_16( face.data, offset + 10 + contour * 2 );
-        xy begin_point = xy( 0.0f, 0.0f );
-        bool begin_on = false;
-        xy end_point = xy( 0.0f, 0.0f );
-        bool end_on = false;
-        size_t first = lines.points.size();
+        int ending = unsigned_16( face->bytes, offset + 10 + contour * 2 );
         for ( ; index <= ending; ++index )
         {
             if ( repeated )
                 --repeated;
             else
             {
-                flags = unsigned_8( face.data, flags_array++ );
+                flags = unsigned_8( face->bytes, flags_array++ );
                 if ( flags & 8 )
-                    repeated = unsigned_8( face.data, flags_array++ );
+                    repeated = unsigned_8( face->bytes, flags_array++ );
             }
             if ( flags & 2 )
-                x += ( unsigned_8( face.data, x_array ) *
+                x += ( unsigned_8( face->bytes, x_array ) *
                        ( flags & 16 ? 1 : -1 ) );
             else if ( !( flags & 16 ) )
-                x += signed_16( face.data, x_array );
+                x += signed_16( face->bytes, x_array );
             if ( flags & 4 )
-                y += ( unsigned_8( face.data, y_array ) *
+                y += ( unsigned_8( face->bytes, y_array ) *
                        ( flags & 32 ? 1 : -1 ) );
             else if ( !( flags & 32 ) )
-                y += signed_16( face.data, y_array );
+                y += signed_16( face->bytes, y_array );
             x_array += flags & 2 ? 1 : flags & 16 ? 0 : 2;
             y_array += flags & 4 ? 1 : flags & 32 ? 0 : 2;
-            xy point = forward * xy( static_cast< float >( x ),
-                                     static_cast< float >( y ) );
-            int on_curve = flags & 1;
-            if ( index == beginning )
-            {
-                begin_point = point;
-                begin_on = on_curve;
-                if ( on_curve )
-                    lines.points.push_back( point );
-            }
-            else
-            {
+            glyph_point point = { static_cast< float >( x ),
+                                  static_cast< float >( y ),
+                                  ( flags & 1 ) != 0 };
+            outline.points.push_back( point );
+        }
+        outline.ends.push_back( ending );
+    }
+    glyphs.bytes += ( sizeof( glyph_outline ) +
+                      outline.points.size() * sizeof( glyph_point ) +
+                      outline.ends.size() * sizeof( int ) +
+                      outline.parts.size() * sizeof( glyph_part ) );
+    return slot;
+}
+
+// Add a text glyph directly to the polylines.  Given a glyph index, this
+// fetches its parsed outline from the glyph cache and immediately tessellates
+// it to a set of a polyline subpaths which it adds to any subpaths already
+// present.  It uses the current transform matrix to transform from the
+// glyph's vertices in font units to the proper size and position on the
+// canvas.  Composite glyphs recurse into their components, temporarily
+// applying each component's transform.
+//
+void canvas::add_glyph(
+    int glyph,
+    float angular )
+{
+    glyph_cache &glyphs = face->glyphs;
+    size_t slot = static_cast< size_t >( load_glyph( glyph ) );
+    for ( size_t part = 0; part < glyphs.outlines[ slot ].parts.size();
+          ++part )
+    {
+        glyph_part component = glyphs.outlines[ slot ].parts[ part ];
+        affine_matrix saved_forward = forward;
+        affine_matrix saved_inverse = inverse;
+        transform( component.a, component.b, component.c, component.d,
+                   component.e, component.f );
+        add_glyph( component.glyph, angular );
+        forward = saved_forward;
+        inverse = saved_inverse;
+    }
+    glyph_outline const &outline = glyphs.outlines[ slot ];
+    int index = 0;
+    for ( size_t contour = 0; contour < outline.ends.size(); ++contour )
+    {
+        int beginning = index;
+        int ending = outline.ends[ contour ];
+        xy begin_point = xy( 0.0f, 0.0f );
+        bool begin_on = false;
+        xy end_point = xy( 0.0f, 0.0f );
+        bool end_on = false;
+        size_t first = lines.points.size();
+        for ( ; index <= ending; ++index )
+        {
+            glyph_point const &vertex =
+                outline.points[ static_cast< size_t >( index ) ];
+            xy point = forward * xy( vertex.x, vertex.y );
+            bool on_curve = vertex.on_curve;
+            if ( index == beginning )
+            {
+                begin_point = point;
+                begin_on = on_curve;
+                if ( on_curve )
+                    lines.points.push_back( point );
+            }
+            else
+            {
                 xy point_2 = on_curve ? point :
                     lerp( end_point, point, 0.5f );
                 if ( lines.points.size() == first ||
@@ -1695,6 +3196,66 @@ void canvas::add_glyph(
     }
 }
 
+// Order the slots in a glyph cache from the least to the most recently used
+// outline, for sorting them by age.
+//
+struct glyph_age
+{
+    std::vector< glyph_outline > const *outlines;
+    bool operator()( size_t first, size_t second ) const {
+        return ( *outlines )[ first ].used < ( *outlines )[ second ].used; }
+};
+
+// Evict the least recently used glyph outlines from the cache until it fits
+// within the given number of bytes.  Rather than searching for the oldest
+// outline again for each eviction, it sorts the slots by age just once and
+// evicts from the oldest on until the cache fits.  A single sweep then
+// moves the remaining outlines down over the freed slots so that they stay
+// contiguous and in their original order.
+//
+void canvas::trim_glyphs(
+    size_t limit )
+{
+    glyph_cache &glyphs = face->glyphs;
+    if ( glyphs.bytes <= limit )
+        return;
+    rows.clear();
+    for ( size_t slot = 0; slot < glyphs.outlines.size(); ++slot )
+        rows.push_back( slot );
+    glyph_age age = { &glyphs.outlines };
+    std::sort( rows.begin(), rows.end(), age );
+    for ( size_t index = 0; index < rows.size() && glyphs.bytes > limit;
+          ++index )
+    {
+        glyph_outline const &evicted = glyphs.outlines[ rows[ index ] ];
+        glyphs.bytes -= ( sizeof( glyph_outline ) +
+                          evicted.points.size() * sizeof( glyph_point ) +
+                          evicted.ends.size() * sizeof( int ) +
+                          evicted.parts.size() * sizeof( glyph_part ) );
+        glyphs.slots[ static_cast< size_t >( evicted.glyph ) ] = -1;
+    }
+    size_t kept = 0;
+    for ( size_t slot = 0; slot < glyphs.outlines.size(); ++slot )
+    {
+        glyph_outline &outline = glyphs.outlines[ slot ];
+        if ( glyphs.slots[ static_cast< size_t >( outline.glyph ) ] < 0 )
+            continue;
+        if ( slot != kept )
+        {
+            glyph_outline &moved = glyphs.outlines[ kept ];
+            moved.points.swap( outline.points );
+            moved.ends.swap( outline.ends );
+            moved.parts.swap( outline.parts );
+            moved.glyph = outline.glyph;
+            moved.used = outline.used;
+            glyphs.slots[ static_cast< size_t >( moved.glyph ) ] =
+                static_cast< int >( kept );
+        }
+        ++kept;
+    }
+    glyphs.outlines.resize( kept );
+}
+
 // Decode the next codepoint from a null-terminated UTF-8 string to its glyph
 // index within the font.  The index to the next codepoint in the string
 // is advanced accordingly.  It checks for valid UTF-8 encoding, but not
@@ -1704,7 +3265,9 @@ void canvas::add_glyph(
 // whitespace characters with regular spaces.  After decoding the codepoint,
 // it looks up the corresponding glyph index from the current font's character
 // map table, returning a glyph index of 0 for the .notdef character (i.e.,
-// "tofu") if the font lacks a glyph for that codepoint.
+// "tofu") if the font lacks a glyph for that codepoint.  The map subtable
+// is chosen once when setting the font, and its segments, which the format
+// requires to be sorted, are binary searched.
 //
 int canvas::character_to_glyph(
     char const *text,
@@ -1729,57 +3292,62 @@ int canvas::character_to_glyph(
     if ( codepoint == '\t' || codepoint == '\v' || codepoint == '\f' ||
          codepoint == '\r' || codepoint == '\n' )
         codepoint = ' ';
-    int tables = unsigned_16( face.data, face.cmap + 2 );
-    int format_12 = 0;
-    int format_4 = 0;
-    int format_0 = 0;
-    for ( int table = 0; table < tables; ++table )
-    {
-        int platform = unsigned_16( face.data, face.cmap + table * 8 + 4 );
-        int encoding = unsigned_16( face.data, face.cmap + table * 8 + 6 );
-        int offset = signed_32( face.data, face.cmap + table * 8 + 8 );
-        int format = unsigned_16( face.data, face.cmap + offset );
-        if ( platform == 3 && encoding == 10 && format == 12 )
-            format_12 = face.cmap + offset;
-        else if ( platform == 3 && encoding == 1 && format == 4 )
-            format_4 = face.cmap + offset;
-        else if ( format == 0 )
-            format_0 = face.cmap + offset;
-    }
-    if ( format_12 )
+    if ( face->format_12 )
     {
-        int groups = signed_32( face.data, format_12 + 12 );
-        for ( int group = 0; group < groups; ++group )
+        int groups = signed_32( face->bytes, face->format_12 + 12 );
+        int group_array = face->format_12 + 16;
+        int low = 0;
+        int high = groups;
+        while ( low < high )
         {
-            int start = signed_32( face.data, format_12 + 16 + group * 12 );
-            int end = signed_32( face.data, format_12 + 20 + group * 12 );
-            int glyph = signed_32( face.data, format_12 + 24 + group * 12 );
-            if ( start <= codepoint && codepoint <= end )
+            int middle = ( low + high ) >> 1;
+            if ( signed_32( face->bytes, group_array + middle * 12 + 4 ) <
+                 codepoint )
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if ( low < groups )
+        {
+            int start = signed_32( face->bytes, group_array + low * 12 );
+            int glyph = signed_32( face->bytes, group_array + low * 12 + 8 );
+            if ( start <= codepoint )
                 return codepoint - start + glyph;
         }
     }
-    else if ( format_4 )
+    else if ( face->format_4 )
     {
-        int segments = unsigned_16( face.data, format_4 + 6 );
-        int end_array = format_4 + 14;
+        int segments = unsigned_16( face->bytes, face->format_4 + 6 );
+        int end_array = face->format_4 + 14;
         int start_array = end_array + 2 + segments;
         int delta_array = start_array + segments;
         int range_array = delta_array + segments;
-        for ( int segment = 0; segment < segments; segment += 2 )
+        int low = 0;
+        int high = segments >> 1;
+        while ( low < high )
+        {
+            int middle = ( low + high ) >> 1;
+            if ( unsigned_16( face->bytes, end_array + middle * 2 ) <
+                 codepoint )
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        int segment = low * 2;
+        if ( segment < segments )
         {
-            int start = unsigned_16( face.data, start_array + segment );
-            int end = unsigned_16( face.data, end_array + segment );
-            int delta = signed_16( face.data, delta_array + segment );
-            int range = unsigned_16( face.data, range_array + segment );
-            if ( start <= codepoint && codepoint <= end )
+            int start = unsigned_16( face->bytes, start_array + segment );
+            int delta = signed_16( face->bytes, delta_array + segment );
+            int range = unsigned_16( face->bytes, range_array + segment );
+            if ( start <= codepoint )
                 return range ?
-                    unsigned_16( face.data, range_array + segment +
+                    unsigned_16( face->bytes, range_array + segment +
                                  ( codepoint - start ) * 2 + range ) :
                     ( codepoint + delta ) & 0xffff;
         }
     }
-    else if ( format_0 && 0 <= codepoint && codepoint < 256 )
-        return unsigned_8( face.data, format_0 + 6 + codepoint );
+    else if ( face->format_0 && 0 <= codepoint && codepoint < 256 )
+        return unsigned_8( face->bytes, face->format_0 + 6 + codepoint );
     return 0;
 }
 
@@ -1788,7 +3356,7 @@ int canvas::character_to_glyph(
 // the string, sizing and placing each character by temporarily changing the
 // current transform matrix to map from font units to canvas pixel coordinates
 // before adding the glyph to the polylines.  This replaces the previous
-// polyline data.
+// polyline data.  Afterwards, it trims the glyph cache back to its limit.
 //
 void canvas::text_to_lines(
     char const *text,
@@ -1801,7 +3369,7 @@ void canvas::text_to_lines(
     float angular = stroking ? ( ratio - 2.0f ) * ratio * 2.0f + 1.0f : -1.0f;
     lines.points.clear();
     lines.subpaths.clear();
-    if ( face.data.empty() || !text || maximum_width <= 0.0f )
+    if ( !face || !text || maximum_width <= 0.0f )
         return;
     float width = maximum_width == 1.0e30f && text_align == leftward ? 0.0f :
         measure_text( text );
@@ -1810,14 +3378,14 @@ void canvas::text_to_lines(
         position.x -= width * reduction;
     else if ( text_align == center )
         position.x -= 0.5f * width * reduction;
-    xy scaling = face.scale * xy( reduction, 1.0f );
+    xy scaling = font_scale * xy( reduction, 1.0f );
     float units_per_em = static_cast< float >(
-        unsigned_16( face.data, face.head + 18 ) );
+        unsigned_16( face->bytes, face->head + 18 ) );
     float ascender = static_cast< float >(
-        signed_16( face.data, face.os_2 + 68 ) );
+        signed_16( face->bytes, face->os_2 + 68 ) );
     float descender = static_cast< float >(
-        signed_16( face.data, face.os_2 + 70 ) );
-    float normalize = face.scale * units_per_em / ( ascender - descender );
+        signed_16( face->bytes, face->os_2 + 70 ) );
+    float normalize = font_scale * units_per_em / ( ascender - descender );
     if ( text_baseline == top )
         position.y += ascender * normalize;
     else if ( text_baseline == middle )
@@ -1825,10 +3393,10 @@ void canvas::text_to_lines(
     else if ( text_baseline == bottom )
         position.y += descender * normalize;
     else if ( text_baseline == hanging )
-        position.y += 0.6f * face.scale * units_per_em;
+        position.y += 0.6f * font_scale * units_per_em;
     affine_matrix saved_forward = forward;
     affine_matrix saved_inverse = inverse;
-    int hmetrics = unsigned_16( face.data, face.hhea + 34 );
+    int hmetrics = unsigned_16( face->bytes, face->hhea + 34 );
     int place = 0;
     for ( int index = 0; text[ index ]; )
     {
@@ -1839,10 +3407,11 @@ void canvas::text_to_lines(
                    position.y );
         add_glyph( glyph, angular );
         int entry = std::min( glyph, hmetrics - 1 );
-        place += unsigned_16( face.data, face.hmtx + entry * 4 );
+        place += unsigned_16( face->bytes, face->hmtx + entry * 4 );
     }
     forward = saved_forward;
     inverse = saved_inverse;
+    trim_glyphs( glyph_limit );
 }
 
 // Break the polylines into smaller pieces according to the dash settings.
@@ -1857,6 +3426,7 @@ void canvas::text_to_lines(
 //
 void canvas::dash_lines()
 {
+    stage_scope scope( "dash_lines" );
     if ( line_dash.empty() )
         return;
     lines.points.swap( scratch.points );
@@ -1931,6 +3501,75 @@ void canvas::dash_lines()
             }
         }
     }
+#ifdef CANVAS_ITY_STATS
+    stats.dashed_points += lines.points.size();
+#endif
+}
+
+// Add the points of a circular arc to the polylines, for round joins and
+// caps.  The arc is given in untransformed space by its center and the
+// offsets from that to its start and end points, and it turns from the
+// start toward the direction of travel that the start offset is to the left
+// of.  Rather than approximating it with Beziers and subdividing those
+// recursively, this finds the number of chords directly, and then steps
+// through them with a fixed rotation, snapping the last point to the end
+// exactly.
+//
+void canvas::add_arc(
+    xy center,
+    xy from,
+    xy to,
+    float angle )
+{
+    int count = arc_chords( forward, length( from ), angle, 3.14159265f );
+    float cosine = cosf( angle / static_cast< float >( count ) );
+    float sine = sinf( angle / static_cast< float >( count ) );
+    xy offset = from;
+    for ( int index = 1; index < count; ++index )
+    {
+        offset = xy( offset.x * cosine + offset.y * sine,
+                     offset.y * cosine - offset.x * sine );
+        lines.points.push_back( forward * ( center + offset ) );
+    }
+    lines.points.push_back( forward * ( center + to ) );
+}
+
+// Add the points for an arc from the path to the polylines in place of the
+// Beziers that approximate it.  This works like adding the arcs for round
+// joins and caps, except for using the transform that was current when the
+// arc was added to the path.  For filling, the points lie on the arc so
+// that the polyline is inscribed within it.  For stroking, the polyline
+// circumscribes the arc instead, with the points at the corners where the
+// tangents at the chord ends would meet.  That makes the first and last
+// segments follow the tangents at the ends of the arc exactly, just as the
+// control points do for Beziers, so that caps and joins there stay square
+// to it while the turn between segments stays within the angular limit.
+//
+void canvas::add_path_arc(
+    arc_data const &arc,
+    xy ending,
+    bool stroking,
+    float limit )
+{
+    int count = arc_chords( arc.transform, length( arc.from ), arc.span,
+                            limit );
+    float step = arc.span / static_cast< float >( count );
+    float cosine = cosf( step );
+    float sine = sinf( step );
+    xy offset = arc.from;
+    if ( stroking )
+    {
+        float half = tanf( 0.5f * step );
+        offset = xy( offset.x - offset.y * half, offset.y + offset.x * half );
+        lines.points.push_back( arc.transform * ( arc.center + offset ) );
+    }
+    for ( int index = 1; index < count; ++index )
+    {
+        offset = xy( offset.x * cosine - offset.y * sine,
+                     offset.y * cosine + offset.x * sine );
+        lines.points.push_back( arc.transform * ( arc.center + offset ) );
+    }
+    lines.points.push_back( ending );
 }
 
 // Trace along a series of points from a subpath in the scratch polylines
@@ -1994,14 +3633,8 @@ void canvas::add_half_stroke(
                 float cosine = dot( in_direction, out_direction );
                 float angle = acosf(
                     std::min( std::max( cosine, -1.0f ), 1.0f ) );
-                float alpha = 4.0f / 3.0f * tanf( 0.25f * angle );
                 lines.points.push_back( forward * side_in );
-                add_bezier(
-                    forward * side_in,
-                    forward * ( side_in + alpha * half * in_direction ),
-                    forward * ( side_out - alpha * half * out_direction ),
-                    forward * side_out,
-                    -1.0f );
+                add_arc( point, side_in - point, side_out - point, angle );
             }
             else
             {
@@ -2042,18 +3675,8 @@ void canvas::add_half_stroke(
     }
     else if ( line_cap == circle )
     {
-        static float const alpha = 0.55228475f; // 4/3*tan(pi/8)
         lines.points.push_back( forward * ( point + side ) );
-        add_bezier( forward * ( point + side ),
-                    forward * ( point + side + alpha * ahead ),
-                    forward * ( point + ahead + alpha * side ),
-                    forward * ( point + ahead ),
-                    -1.0f );
-        add_bezier( forward * ( point + ahead ),
-                    forward * ( point + ahead - alpha * side ),
-                    forward * ( point - side + alpha * ahead ),
-                    forward * ( point - side ),
-                    -1.0f );
+        add_arc( point, side, xy() - side, 3.14159265f );
     }
 }
 
@@ -2069,6 +3692,7 @@ void canvas::add_half_stroke(
 //
 void canvas::stroke_lines()
 {
+    stage_scope scope( "stroke_lines" );
     if ( forward.a * forward.d - forward.b * forward.c == 0.0f )
         return;
     dash_lines();
@@ -2097,6 +3721,9 @@ void canvas::stroke_lines()
         subpath_data entry = { lines.points.size() - first, true };
         lines.subpaths.push_back( entry );
     }
+#ifdef CANVAS_ITY_STATS
+    stats.stroked_points += lines.points.size();
+#endif
 }
 
 // Scan-convert a single polyline segment.  This walks along the pixels that
@@ -2137,8 +3764,8 @@ void canvas::add_runs(
                                               0.0f ), 1.0f );
             float mid = ( next_x.x + now.x ) * 0.5f;
             float area = ( mid - pixel.x ) * strip;
-            pixel_run piece = { static_cast< unsigned short >( pixel.x ),
-                                static_cast< unsigned short >( pixel.y ),
+            pixel_run piece = { static_cast< run_coordinate >( pixel.x ),
+                                static_cast< run_coordinate >( pixel.y ),
                                 ( carry + strip - area ) * sign };
             runs.push_back( piece );
             carry = area;
@@ -2151,12 +3778,11 @@ void canvas::add_runs(
                                           0.0f ), 1.0f );
         float mid = ( next_y.x + now.x ) * 0.5f;
         float area = ( mid - pixel.x ) * strip;
-        pixel_run piece_1 = { static_cast< unsigned short >( pixel.x ),
-                              static_cast< unsigned short >( pixel.y ),
-                              ( carry + strip - area ) * sign };
-        pixel_run piece_2 = { static_cast< unsigned short >( pixel.x + 1.0f ),
-                              static_cast< unsigned short >( pixel.y ),
-                              area * sign };
+        run_coordinate column = static_cast< run_coordinate >( pixel.x );
+        run_coordinate row = static_cast< run_coordinate >( pixel.y );
+        pixel_run piece_1 = { column, row, ( carry + strip - area ) * sign };
+        pixel_run piece_2 = { to_run( column + 1 ),
+                              row, area * sign };
         runs.push_back( piece_1 );
         runs.push_back( piece_2 );
         now = next_y;
@@ -2173,11 +3799,151 @@ static bool operator<(
     pixel_run left,
     pixel_run right )
 {
+#ifndef CANVAS_ITY_WIDE_RUNS
+    unsigned int left_key = static_cast< unsigned int >( left.y ) << 16 |
+        left.x;
+    unsigned int right_key = static_cast< unsigned int >( right.y ) << 16 |
+        right.x;
+    if ( left_key != right_key )
+        return left_key < right_key;
+    return fabsf( left.delta ) < fabsf( right.delta );
+#else
     return ( left.y < right.y ? true :
              left.y > right.y ? false :
              left.x < right.x ? true :
              left.x > right.x ? false :
              fabsf( left.delta ) < fabsf( right.delta ) );
+#endif
+}
+
+// Move the pending changes in signed coverage into the dense coverage grid
+// for the rows starting at the given one, summing any changes to the same
+// pixel, and widen each row's range of touched pixels to cover them.  This
+// empties the list of changes so that it can be refilled.
+//
+void canvas::runs_to_cover(
+    int top,
+    int stride )
+{
+#ifdef CANVAS_ITY_STATS
+    stats.unmerged_runs += runs.size();
+#endif
+    for ( size_t index = 0; index < runs.size(); ++index )
+    {
+        pixel_run piece = runs[ index ];
+        size_t row = static_cast< size_t >( piece.y - top );
+        size_t column = static_cast< size_t >( piece.x );
+        cover[ row * static_cast< size_t >( stride ) + column ] +=
+            piece.delta;
+        touched[ row * 2 + 0 ] = std::min( touched[ row * 2 + 0 ],
+                                           from_run( piece.x ) );
+        touched[ row * 2 + 1 ] = std::max( touched[ row * 2 + 1 ],
+                                           from_run( piece.x ) );
+    }
+    runs.clear();
+}
+
+// Scan-convert the polylines directly when they are just a single rectangle
+// with its edges axis-aligned on whole pixels.  Every row that such a
+// rectangle crosses has the same two full-pixel steps in signed coverage,
+// so these can be produced in order without any clipping, tessellation,
+// or sorting, and (being all exact) with the same results as the general
+// scan conversion.  A trailing lone point, as left by closing the path with
+// rectangle(), has no lines and is ignored.  If the polylines are anything
+// else, this returns false.
+//
+bool canvas::rectangle_to_runs(
+    xy offset,
+    int right,
+    int bottom )
+{
+    size_t subpaths = lines.subpaths.size();
+    if ( subpaths == 2 && lines.subpaths[ 1 ].count == 1 )
+        subpaths = 1;
+    size_t count = lines.subpaths.empty() ? 0 : lines.subpaths[ 0 ].count;
+    if ( subpaths != 1 || count < 4 || count > 5 )
+        return false;
+    xy corners[ 5 ];
+    for ( size_t index = 0; index < count; ++index )
+    {
+        corners[ index ] = offset + lines.points[ index ];
+        if ( floorf( corners[ index ].x ) != corners[ index ].x ||
+             floorf( corners[ index ].y ) != corners[ index ].y )
+            return false;
+    }
+    if ( count == 5 && ( corners[ 4 ].x != corners[ 0 ].x ||
+                         corners[ 4 ].y != corners[ 0 ].y ) )
+        return false;
+    int first = corners[ 0 ].x == corners[ 1 ].x ? 0 : 1;
+    xy from = corners[ first ];
+    xy to = corners[ first + 1 ];
+    xy after = corners[ ( first + 2 ) & 3 ];
+    xy back = corners[ ( first + 3 ) & 3 ];
+    if ( from.x != to.x || to.y != after.y ||
+         after.x != back.x || back.y != from.y )
+        return false;
+    float width = static_cast< float >( right );
+    float height = static_cast< float >( bottom );
+    float low = std::min( from.y, to.y );
+    float high = std::max( from.y, to.y );
+    low = std::max( 0.0f, std::min( low, height ) );
+    high = std::max( 0.0f, std::min( high, height ) );
+    pixel_run piece_1 = {
+        static_cast< run_coordinate >(
+            std::max( 0.0f, std::min( from.x, width ) ) ),
+        0, to.y > from.y ? 1.0f : -1.0f };
+    pixel_run piece_2 = {
+        static_cast< run_coordinate >(
+            std::max( 0.0f, std::min( after.x, width ) ) ),
+        0, -piece_1.delta };
+    if ( piece_2.x < piece_1.x )
+        std::swap( piece_1, piece_2 );
+    runs.clear();
+    if ( piece_1.x == piece_2.x )
+        return true;
+    for ( int y = static_cast< int >( low ); y < static_cast< int >( high );
+          ++y )
+    {
+        piece_1.y = piece_2.y = to_run( y );
+        runs.push_back( piece_1 );
+        runs.push_back( piece_2 );
+    }
+    return true;
+}
+
+// Check whether the polylines form a single rectangle with axis-aligned
+// sides, and if so, find its lowest and highest corners.  As with the check
+// for pixel-aligned rectangles above, a trailing lone point is ignored, but
+// here the corners may be anywhere.  The shadow of such a rectangle with a
+// solid paint is separable, so it can be blurred along each axis alone.
+//
+bool canvas::rectangle_bounds(
+    xy &low,
+    xy &high )
+{
+    size_t subpaths = lines.subpaths.size();
+    if ( subpaths == 2 && lines.subpaths[ 1 ].count == 1 )
+        subpaths = 1;
+    size_t count = lines.subpaths.empty() ? 0 : lines.subpaths[ 0 ].count;
+    if ( subpaths != 1 || count < 4 || count > 5 )
+        return false;
+    xy const *corners = &lines.points[ 0 ];
+    if ( count == 5 && ( corners[ 4 ].x != corners[ 0 ].x ||
+                         corners[ 4 ].y != corners[ 0 ].y ) )
+        return false;
+    bool vertical = corners[ 0 ].x == corners[ 1 ].x;
+    for ( int index = 0; index < 4; ++index )
+    {
+        xy from = corners[ index ];
+        xy to = corners[ ( index + 1 ) & 3 ];
+        if ( ( vertical ^ ( index & 1 ) ) ? from.x != to.x : from.y != to.y )
+            return false;
+    }
+    low = xy( std::min( corners[ 0 ].x, corners[ 2 ].x ),
+              std::min( corners[ 0 ].y, corners[ 2 ].y ) );
+    high = xy( std::max( corners[ 0 ].x, corners[ 2 ].x ),
+               std::max( corners[ 0 ].y, corners[ 2 ].y ) );
+    return true;
 }
 
 // Scan-convert the polylines to prepare them for antialiased rendering.
@@ -2188,15 +3954,61 @@ static bool operator<(
 // left-to-right, top-to-bottom order.  The list of changes is then sorted
 // into that order, and multiple changes to the same pixel are coalesced
 // by summation.  The result is a sparse, run-length encoded description
-// of the coverage of each pixel to be drawn.
+// of the coverage of each pixel to be drawn.  Since the rows are bounded
+// by the clip box, the sort is done in two steps: a counting sort first
+// buckets the changes by row, and then each (short) row is sorted apart.
+// However, when the rows spanned by the polylines are small enough to
+// fit a dense grid of pixel coverage, the changes are instead summed into
+// that in small batches as they are produced.  Sweeping each row's touched
+// pixels afterwards then yields the same result already in order, without
+// sorting and with the list of changes kept short.
 //
 void canvas::lines_to_runs(
     xy offset,
-    int padding )
+    int right,
+    int bottom )
 {
+    stage_scope scope( "lines_to_runs" );
+    static size_t const most_cells = 4194304;
+    static size_t const chunk = 4096;
+    if ( rectangle_to_runs( offset, right, bottom ) )
+    {
+#ifdef CANVAS_ITY_STATS
+        stats.unmerged_runs += runs.size();
+        stats.merged_runs += runs.size();
+#endif
+        return;
+    }
     runs.clear();
-    float width = static_cast< float >( size_x + padding );
-    float height = static_cast< float >( size_y + padding );
+    float width = static_cast< float >( right );
+    float height = static_cast< float >( bottom );
+    float low_y = height;
+    float high_y = 0.0f;
+    for ( size_t index = 0; index < lines.points.size(); ++index )
+    {
+        float y = offset.y + lines.points[ index ].y;
+        y = std::max( 0.0f, std::min( y, height ) );
+        low_y = std::min( low_y, y );
+        high_y = std::max( high_y, y );
+    }
+    int top = std::max( static_cast< int >( low_y ) - 1, 0 );
+    int base = std::min( static_cast< int >( high_y ) + 1, bottom );
+    int count = base + 1 - top;
+    int stride = right + 2;
+    size_t cells = static_cast< size_t >( std::max( count, 0 ) ) *
+        static_cast< size_t >( stride );
+    bool dense = cells && cells <= most_cells;
+    if ( dense )
+    {
+        if ( cover.size() < cells )
+            cover.resize( cells, 0.0f );
+        touched.resize( static_cast< size_t >( count ) * 2 );
+        for ( int row = 0; row < count; ++row )
+        {
+            touched[ static_cast< size_t >( row ) * 2 + 0 ] = stride;
+            touched[ static_cast< size_t >( row ) * 2 + 1 ] = -1;
+        }
+    }
     size_t ending = 0;
     for ( size_t subpath = 0; subpath < lines.subpaths.size(); ++subpath )
     {
@@ -2236,11 +4048,63 @@ void canvas::lines_to_runs(
                           std::min( std::max( from.y, 0.0f ), height ) ),
                       xy( std::min( std::max( to.x, 0.0f ), width ),
                           std::min( std::max( to.y, 0.0f ), height ) ) );
+            if ( dense && runs.size() >= chunk )
+                runs_to_cover( top, stride );
+        }
+    }
+    if ( dense )
+    {
+        runs_to_cover( top, stride );
+        for ( int row = 0; row < count; ++row )
+        {
+            int low = touched[ static_cast< size_t >( row ) * 2 + 0 ];
+            int high = touched[ static_cast< size_t >( row ) * 2 + 1 ];
+            float *cell = &cover[ static_cast< size_t >( row * stride ) ];
+            for ( int x = low; x <= high; ++x )
+                if ( cell[ x ] != 0.0f )
+                {
+                    pixel_run piece = {
+                        to_run( x ),
+                        to_run( top + row ),
+                        cell[ x ] };
+                    runs.push_back( piece );
+                    cell[ x ] = 0.0f;
+                }
         }
+#ifdef CANVAS_ITY_STATS
+        stats.merged_runs += runs.size();
+#endif
+        return;
     }
     if ( runs.empty() )
         return;
-    std::sort( runs.begin(), runs.end() );
+    run_coordinate low = runs.front().y;
+    run_coordinate high = low;
+    for ( size_t index = 1; index < runs.size(); ++index )
+    {
+        low = std::min( low, runs[ index ].y );
+        high = std::max( high, runs[ index ].y );
+    }
+    rows.assign( static_cast< size_t >( high - low ) + 2, 0 );
+    for ( size_t index = 0; index < runs.size(); ++index )
+        ++rows[ static_cast< size_t >( runs[ index ].y - low ) + 1 ];
+    std::partial_sum( rows.begin(), rows.end(), rows.begin() );
+    ordered.resize( runs.size() );
+    for ( size_t index = 0; index < runs.size(); ++index )
+        ordered[ rows[ static_cast< size_t >( runs[ index ].y - low ) ]++ ] =
+            runs[ index ];
+    runs.swap( ordered );
+    for ( size_t row = 0, start = 0; row + 1 < rows.size(); ++row )
+    {
+        size_t stop = rows[ row ];
+        if ( stop - start > 1 )
+            std::sort( runs.begin() + static_cast< ptrdiff_t >( start ),
+                       runs.begin() + static_cast< ptrdiff_t >( stop ) );
+        start = stop;
+    }
+#ifdef CANVAS_ITY_STATS
+    stats.unmerged_runs += runs.size();
+#endif
     size_t to = 0;
     for ( size_t from = 1; from < runs.size(); ++from )
         if ( runs[ from ].x == runs[ to ].x &&
@@ -2250,23 +4114,78 @@ void canvas::lines_to_runs(
             runs[ ++to ] = runs[ from ];
     runs.erase( runs.begin() + static_cast< ptrdiff_t >( to ) + 1,
                 runs.end() );
+#ifdef CANVAS_ITY_STATS
+    stats.merged_runs += runs.size();
+#endif
+}
+
+// Save the polylines and their scan-converted runs to a prepared path.  The
+// runs are made relative to the top-left corner of the pixels bounding the
+// polylines and clipped only to that (unless it is too big), rather than
+// to the canvas, so that they can be shifted around for drawing later.
+//
+void canvas::prepare_lines(
+    prepared_path &prepared,
+    bool stroked )
+{
+    prepared.lines.points.clear();
+    prepared.lines.subpaths.clear();
+    prepared.runs.clear();
+    prepared.left = 0;
+    prepared.top = 0;
+    prepared.stroked = stroked;
+    if ( forward.a * forward.d - forward.b * forward.c == 0.0f ||
+         lines.points.empty() )
+        return;
+    xy lowest = lines.points.front();
+    xy highest = lines.points.front();
+    for ( size_t index = 1; index < lines.points.size(); ++index )
+    {
+        xy point = lines.points[ index ];
+        lowest = xy( std::min( lowest.x, point.x ),
+                     std::min( lowest.y, point.y ) );
+        highest = xy( std::max( highest.x, point.x ),
+                      std::max( highest.y, point.y ) );
+    }
+    float limit = static_cast< float >( largest_size );
+    float left = std::max( floorf( lowest.x ), -limit );
+    float top = std::max( floorf( lowest.y ), -limit );
+    int width = static_cast< int >(
+        std::min( ceilf( highest.x - left ), limit ) );
+    int height = static_cast< int >(
+        std::min( ceilf( highest.y - top ), limit ) );
+    lines_to_runs( xy( -left, -top ), width, height );
+    prepared.lines = lines;
+    prepared.runs = runs;
+    prepared.left = static_cast< int >( left );
+    prepared.top = static_cast< int >( top );
 }
 
 // Paint a pixel according to its point location and a paint style to produce
 // a premultiplied, linearized RGBA color.  This handles all supported paint
 // styles: solid colors, linear gradients, radial gradients, and patterns.
 // For gradients and patterns, it takes into account the current transform.
-// Patterns are resampled using a separable bicubic convolution filter,
-// with edges handled according to the wrap mode.  See "Cubic Convolution
-// Interpolation for Digital Image Processing" by Keys.  This filter is best
-// known for magnification, but also works well for antialiased minification,
-// since it's actually a Catmull-Rom spline approximation of Lanczos-2.
+// Patterns are resampled according to the image smoothing setting, with
+// edges handled according to the wrap mode.  Bicubic uses a separable
+// convolution filter; see "Cubic Convolution Interpolation for Digital
+// Image Processing" by Keys.  This filter is best known for magnification,
+// but also works well for antialiased minification, since it's actually a
+// Catmull-Rom spline approximation of Lanczos-2.  Bilinear does the same
+// but with a tent filter half as wide, and nearest just takes the texel
+// that the point lands in.  When the pattern is unscaled and the pixel
+// centers land on the texel centers, the filter weights are exactly one
+// for the nearest texel and zero for the rest, so it just fetches that
+// texel directly instead.  For heavy minification, it first switches to
+// the smallest mipmap level that is still no smaller than the pattern's
+// footprint on the canvas, which keeps the number of taps bounded.  Spans
+// of pixels under transforms without rotation or skew are usually handled
+// by sample_span() instead, and this must give the same results as that.
 //
 rgba canvas::paint_pixel(
     xy point,
     paint_brush const &brush )
 {
-    if ( brush.colors.empty() )
+    if ( is_blank( brush ) )
         return rgba( 0.0f, 0.0f, 0.0f, 0.0f );
     if ( brush.type == paint_brush::color )
         return brush.colors.front();
@@ -2280,49 +4199,82 @@ rgba canvas::paint_pixel(
              ( ( brush.repetition & 1 ) &&
                ( point.y < 0.0f || height <= point.y ) ) )
             return rgba( 0.0f, 0.0f, 0.0f, 0.0f );
+        bool clamp = &brush == &image_brush;
+        xy texel = point - xy( 0.5f, 0.5f );
+        bool exact = ( inverse.a == 1.0f && inverse.b == 0.0f &&
+                       inverse.c == 0.0f && inverse.d == 1.0f &&
+                       floorf( texel.x ) == texel.x &&
+                       floorf( texel.y ) == texel.y );
+        if ( exact || image_smoothing == nearest )
+        {
+            if ( !exact )
+                texel = xy( floorf( point.x ), floorf( point.y ) );
+            int wrapped_x = static_cast< int >( texel.x ) % brush.width;
+            int wrapped_y = static_cast< int >( texel.y ) % brush.height;
+            if ( wrapped_x < 0 )
+                wrapped_x += brush.width;
+            if ( wrapped_y < 0 )
+                wrapped_y += brush.height;
+            if ( clamp )
+            {
+                wrapped_x = std::min( std::max(
+                    static_cast< int >( texel.x ), 0 ), brush.width - 1 );
+                wrapped_y = std::min( std::max(
+                    static_cast< int >( texel.y ), 0 ), brush.height - 1 );
+            }
+            return pattern_texels( brush )[ static_cast< size_t >(
+                wrapped_y * brush.width + wrapped_x ) ];
+        }
+        float radius = image_smoothing == bilinear ? 1.0f : 2.0f;
         float scale_x = fabsf( inverse.a ) + fabsf( inverse.c );
         float scale_y = fabsf( inverse.b ) + fabsf( inverse.d );
+        int level_x, level_y;
+        rgba const *texels = mipmap_level( brush, scale_x, scale_y,
+                                           level_x, level_y );
+        float ratio_x = static_cast< float >( level_x ) / width;
+        float ratio_y = static_cast< float >( level_y ) / height;
+        point = xy( point.x * ratio_x, point.y * ratio_y );
+        width = static_cast< float >( level_x );
+        height = static_cast< float >( level_y );
+        scale_x *= ratio_x;
+        scale_y *= ratio_y;
         scale_x = std::max( 1.0f, std::min( scale_x, width * 0.25f ) );
         scale_y = std::max( 1.0f, std::min( scale_y, height * 0.25f ) );
         float reciprocal_x = 1.0f / scale_x;
         float reciprocal_y = 1.0f / scale_y;
         point -= xy( 0.5f, 0.5f );
-        int left = static_cast< int >( ceilf( point.x - scale_x * 2.0f ) );
-        int top = static_cast< int >( ceilf( point.y - scale_y * 2.0f ) );
-        int right = static_cast< int >( ceilf( point.x + scale_x * 2.0f ) );
-        int bottom = static_cast< int >( ceilf( point.y + scale_y * 2.0f ) );
+        int left = static_cast< int >( ceilf( point.x - scale_x * radius ) );
+        int top = static_cast< int >( ceilf( point.y - scale_y * radius ) );
+        int right = static_cast< int >( ceilf( point.x + scale_x * radius ) );
+        int bottom = static_cast< int >(
+            ceilf( point.y + scale_y * radius ) );
         rgba total_color = rgba( 0.0f, 0.0f, 0.0f, 0.0f );
         float total_weight = 0.0f;
         for ( int pattern_y = top; pattern_y < bottom; ++pattern_y )
         {
-            float y = fabsf( reciprocal_y *
-                ( static_cast< float >( pattern_y ) - point.y ) );
-            float weight_y = ( y < 1.0f ?
-                (    1.5f * y - 2.5f ) * y          * y + 1.0f :
-                ( ( -0.5f * y + 2.5f ) * y - 4.0f ) * y + 2.0f );
-            int wrapped_y = pattern_y % brush.height;
+            float weight_y = filter_weight( fabsf( reciprocal_y *
+                ( static_cast< float >( pattern_y ) - point.y ) ),
+                image_smoothing );
+            int wrapped_y = pattern_y % level_y;
             if ( wrapped_y < 0 )
-                wrapped_y += brush.height;
-            if ( &brush == &image_brush )
-                wrapped_y = std::min( std::max( pattern_y, 0 ),
-                                      brush.height - 1 );
+                wrapped_y += level_y;
+            if ( clamp )
+                wrapped_y = std::min( std::max( pattern_y, 0 ), level_y - 1 );
             for ( int pattern_x = left; pattern_x < right; ++pattern_x )
             {
-                float x = fabsf( reciprocal_x *
-                    ( static_cast< float >( pattern_x ) - point.x ) );
-                float weight_x = ( x < 1.0f ?
-                    (    1.5f * x - 2.5f ) * x          * x + 1.0f :
-                    ( ( -0.5f * x + 2.5f ) * x - 4.0f ) * x + 2.0f );
-                int wrapped_x = pattern_x % brush.width;
+                float weight_x = filter_weight( fabsf( reciprocal_x *
+                    ( static_cast< float >( pattern_x ) - point.x ) ),
+                    image_smoothing );
+                int wrapped_x = pattern_x % level_x;
                 if ( wrapped_x < 0 )
-                    wrapped_x += brush.width;
-                if ( &brush == &image_brush )
+                    wrapped_x += level_x;
+                if ( clamp )
                     wrapped_x = std::min( std::max( pattern_x, 0 ),
-                                          brush.width - 1 );
+                                          level_x - 1 );
                 float weight = weight_x * weight_y;
                 size_t index = static_cast< size_t >(
-                    wrapped_y * brush.width + wrapped_x );
-                total_color += weight * brush.colors[ index ];
+                    wrapped_y * level_x + wrapped_x );
+                total_color += weight * texels[ index ];
                 total_weight += weight;
             }
         }
@@ -2376,210 +4328,989 @@ rgba canvas::paint_pixel(
     return premultiplied( brush.colors[ index - 1 ] + mix * delta );
 }
 
-// Render the shadow of the polylines into the pixel buffer if needed.  After
-// computing the border as the maximum distance that one pixel can affect
-// another via the blur, it scan-converts the lines to runs with the shadow
-// offset and that extra amount of border padding.  Then it bounds the scan
-// converted shape, pads this with border, clips that to the extended canvas
-// size, and rasterizes to fill a working area with the alpha.  Next, a fast
-// approximation of a Gaussian blur is done using three passes of box blurs
-// each in the rows and columns.  Note that these box blurs have a small extra
-// weight on the tails to allow for fractional widths.  See "Theoretical
-// Foundations of Gaussian Convolution by Extended Box Filtering" by Gwosdek
-// et al. for details.  Finally, it colors the blurred alpha image with
-// the shadow color and blends this into the pixel buffer according to the
-// compositing settings and clip mask.  Note that it does not bother clearing
-// outside the area of the alpha image when the compositing settings require
-// clearing; that will be done on the subsequent main rendering pass.
+// Build the mipmap pyramid for a pattern.  Each level halves the size of
+// the one before, rounding up, until it is down to a single texel.  Since
+// the sizes are rounded up, the levels are resampled with an exact box
+// filter rather than just averaging each 2x2 block of texels, so that
+// every level covers exactly the same area as the full size pattern and
+// stays seamless when repeated.  A box less than two texels wide overlaps
+// at most three, so the weights fit in a small table per axis.  Each row
+// of a new level accumulates the horizontally filtered rows beneath it.
+// The levels are all concatenated together.
 //
-void canvas::render_shadow(
-    paint_brush const &brush )
+static void build_levels(
+    rgba const *texels,
+    int full_width,
+    int full_height,
+    std::vector< rgba > &levels )
 {
-    if ( shadow_color.a == 0.0f || ( shadow_blur == 0.0f &&
-                                     shadow_offset_x == 0.0f &&
-                                     shadow_offset_y == 0.0f ) )
-        return;
-    float sigma_squared = 0.25f * shadow_blur * shadow_blur;
-    size_t radius = static_cast< size_t >(
-        0.5f * sqrtf( 4.0f * sigma_squared + 1.0f ) - 0.5f );
-    int border = 3 * ( static_cast< int >( radius ) + 1 );
-    xy offset = xy( static_cast< float >( border ) + shadow_offset_x,
-                    static_cast< float >( border ) + shadow_offset_y );
-    lines_to_runs( offset, 2 * border );
-    int left = size_x + 2 * border;
-    int right = 0;
-    int top = size_y + 2 * border;
-    int bottom = 0;
-    for ( size_t index = 0; index < runs.size(); ++index )
+    size_t total = 0;
+    for ( int width = full_width, height = full_height;
+          width > 1 || height > 1; )
     {
-        left = std::min( left, static_cast< int >( runs[ index ].x ) );
-        right = std::max( right, static_cast< int >( runs[ index ].x ) );
-        top = std::min( top, static_cast< int >( runs[ index ].y ) );
-        bottom = std::max( bottom, static_cast< int >( runs[ index ].y ) );
+        width = ( width + 1 ) / 2;
+        height = ( height + 1 ) / 2;
+        total += static_cast< size_t >( width * height );
     }
-    left = std::max( left - border, 0 );
-    right = std::min( right + border, size_x + 2 * border ) + 1;
-    top = std::max( top - border, 0 );
-    bottom = std::min( bottom + border, size_y + 2 * border );
-    size_t width = static_cast< size_t >( std::max( right - left, 0 ) );
-    size_t height = static_cast< size_t >( std::max( bottom - top, 0 ) );
-    size_t working = width * height;
-    shadow.clear();
-    shadow.resize( working + std::max( width, height ) );
-    static float const threshold = 1.0f / 8160.0f;
+    if ( !total )
+        return;
+    levels.resize( total );
+    std::vector< int > first_x, first_y;
+    std::vector< float > weights_x, weights_y;
+    rgba const *from = texels;
+    rgba *to = &levels.front();
+    for ( int width = full_width, height = full_height;
+          width > 1 || height > 1; )
     {
-        int x = -1;
-        int y = -1;
-        float sum = 0.0f;
-        for ( size_t index = 0; index < runs.size(); ++index )
-        {
-            pixel_run next = runs[ index ];
-            float coverage = std::min( fabsf( sum ), 1.0f );
-            int to = next.y == y ? next.x : x + 1;
-            if ( coverage >= threshold )
-                for ( ; x < to; ++x )
-                    shadow[ static_cast< size_t >( y - top ) * width +
-                            static_cast< size_t >( x - left ) ] = coverage *
-                        paint_pixel( xy( static_cast< float >( x ) + 0.5f,
-                                         static_cast< float >( y ) + 0.5f ) -
-                                     offset, brush ).a;
-            if ( next.y != y )
-                sum = 0.0f;
-            x = next.x;
-            y = next.y;
-            sum += next.delta;
-        }
-    }
-    float alpha = static_cast< float >( 2 * radius + 1 ) *
-        ( static_cast< float >( radius * ( radius + 1 ) ) - sigma_squared ) /
-        ( 2.0f * sigma_squared -
-          static_cast< float >( 6 * ( radius + 1 ) * ( radius + 1 ) ) );
-    float divisor = 2.0f * ( alpha + static_cast< float >( radius ) ) + 1.0f;
-    float weight_1 = alpha / divisor;
-    float weight_2 = ( 1.0f - alpha ) / divisor;
-    for ( size_t y = 0; y < height; ++y )
-        for ( int pass = 0; pass < 3; ++pass )
-        {
-            for ( size_t x = 0; x < width; ++x )
-                shadow[ working + x ] = shadow[ y * width + x ];
-            float running = weight_1 * shadow[ working + radius + 1 ];
-            for ( size_t x = 0; x <= radius; ++x )
-                running += ( weight_1 + weight_2 ) * shadow[ working + x ];
-            shadow[ y * width ] = running;
-            for ( size_t x = 1; x < width; ++x )
-            {
-                if ( x >= radius + 1 )
-                    running -= weight_2 * shadow[ working + x - radius - 1 ];
-                if ( x >= radius + 2 )
-                    running -= weight_1 * shadow[ working + x - radius - 2 ];
-                if ( x + radius < width )
-                    running += weight_2 * shadow[ working + x + radius ];
-                if ( x + radius + 1 < width )
-                    running += weight_1 * shadow[ working + x + radius + 1 ];
-                shadow[ y * width + x ] = running;
-            }
-        }
-    for ( size_t x = 0; x < width; ++x )
-        for ( int pass = 0; pass < 3; ++pass )
+        int next_x = ( width + 1 ) / 2;
+        int next_y = ( height + 1 ) / 2;
+        box_weights( width, next_x, first_x, weights_x );
+        box_weights( height, next_y, first_y, weights_y );
+        for ( int y = 0; y < next_y; ++y )
         {
-            for ( size_t y = 0; y < height; ++y )
-                shadow[ working + y ] = shadow[ y * width + x ];
-            float running = weight_1 * shadow[ working + radius + 1 ];
-            for ( size_t y = 0; y <= radius; ++y )
-                running += ( weight_1 + weight_2 ) * shadow[ working + y ];
-            shadow[ x ] = running;
-            for ( size_t y = 1; y < height; ++y )
+            rgba *row = to + y * next_x;
+            std::fill( row, row + next_x, rgba( 0.0f, 0.0f, 0.0f, 0.0f ) );
+            int texel_y = first_y[ static_cast< size_t >( y ) ];
+            for ( int step_y = 0; step_y < 3 && texel_y + step_y < height;
+                  ++step_y )
             {
-                if ( y >= radius + 1 )
-                    running -= weight_2 * shadow[ working + y - radius - 1 ];
-                if ( y >= radius + 2 )
-                    running -= weight_1 * shadow[ working + y - radius - 2 ];
-                if ( y + radius < height )
-                    running += weight_2 * shadow[ working + y + radius ];
-                if ( y + radius + 1 < height )
-                    running += weight_1 * shadow[ working + y + radius + 1 ];
-                shadow[ y * width + x ] = running;
+                float weight_y =
+                    weights_y[ static_cast< size_t >( y * 3 + step_y ) ];
+                if ( weight_y == 0.0f )
+                    continue;
+                rgba const *source = from + ( texel_y + step_y ) * width;
+                for ( int x = 0; x < next_x; ++x )
+                {
+                    int texel_x = first_x[ static_cast< size_t >( x ) ];
+                    float const *weight_x =
+                        &weights_x[ static_cast< size_t >( x * 3 ) ];
+                    rgba sum = weight_x[ 0 ] * source[ texel_x ];
+                    if ( texel_x + 1 < width )
+                        sum += weight_x[ 1 ] * source[ texel_x + 1 ];
+                    if ( texel_x + 2 < width )
+                        sum += weight_x[ 2 ] * source[ texel_x + 2 ];
+                    row[ x ] += weight_y * sum;
+                }
             }
         }
-    int operation = global_composite_operation;
-    int x = -1;
-    int y = -1;
-    float sum = 0.0f;
-    for ( size_t index = 0; index < mask.size(); ++index )
-    {
-        pixel_run next = mask[ index ];
-        float visibility = std::min( fabsf( sum ), 1.0f );
-        int to = std::min( next.y == y ? next.x : x + 1, right - border );
-        if ( visibility >= threshold &&
-             top <= y + border && y + border < bottom )
-            for ( ; x < to; ++x )
-            {
-                rgba &back = bitmap[ y * size_x + x ];
-                rgba fore = global_alpha *
-                    shadow[
-                        static_cast< size_t >( y + border - top ) * width +
-                        static_cast< size_t >( x + border - left ) ] *
-                    shadow_color;
-                float mix_fore = operation & 1 ? back.a : 0.0f;
-                if ( operation & 2 )
-                    mix_fore = 1.0f - mix_fore;
-                float mix_back = operation & 4 ? fore.a : 0.0f;
-                if ( operation & 8 )
-                    mix_back = 1.0f - mix_back;
-                rgba blend = mix_fore * fore + mix_back * back;
-                blend.a = std::min( blend.a, 1.0f );
-                back = visibility * blend + ( 1.0f - visibility ) * back;
-            }
-        if ( next.y != y )
-            sum = 0.0f;
-        x = std::max( static_cast< int >( next.x ), left - border );
-        y = next.y;
-        sum += next.delta;
+        from = to;
+        to += next_x * next_y;
+        width = next_x;
+        height = next_y;
     }
 }
 
-// Render the polylines into the pixel buffer.  It scan-converts the lines
-// to runs which represent changes to the signed fractional coverage when
-// read from left-to-right, top-to-bottom.  It scans through these to
-// determine spans of pixels that need to be drawn, paints those pixels
-// according to the brush, and then blends them into the buffer according
-// to the current compositing settings.  This is slightly more complicated
-// because it interleaves this with a simultaneous scan through a similar
-// set of runs representing the current clip mask to determine which pixels
-// it can composite into.  Note that shadows are always drawn first.
+// Build the mipmaps for a pattern brush if drawing with the current
+// transform will need them and they haven't been built already.  This is
+// done lazily since it is wasted work when a pattern is never shrunk by at
+// least half, as with most uses of draw_image().  Shared images come with
+// theirs already built, since they must never change once loaded.
 //
-void canvas::render_main(
-    paint_brush const &brush )
+void canvas::build_mipmaps(
+    paint_brush &brush )
 {
-    if ( forward.a * forward.d - forward.b * forward.c == 0.0f )
+    if ( brush.type != paint_brush::pattern || brush.colors.empty() ||
+         !brush.mipmaps.empty() || image_smoothing == nearest )
         return;
-    render_shadow( brush );
-    lines_to_runs( xy( 0.0f, 0.0f ), 0 );
+    float scale_x = fabsf( inverse.a ) + fabsf( inverse.c );
+    float scale_y = fabsf( inverse.b ) + fabsf( inverse.d );
+    if ( scale_x * static_cast< float >( ( brush.width + 1 ) / 2 ) <
+             static_cast< float >( brush.width ) ||
+         scale_y * static_cast< float >( ( brush.height + 1 ) / 2 ) <
+             static_cast< float >( brush.height ) )
+        return;
+    build_levels( &brush.colors.front(), brush.width, brush.height,
+                  brush.mipmaps );
+}
+
+// Precompute the filter taps along one axis of a pattern for every pixel
+// column or row of the canvas.  This is only valid when the inverse
+// transform has no rotation or skew, so that the texel coordinates along
+// this axis depend only on the pixel position along the same axis.  Each
+// pixel gets the index of its first texel, unwrapped, and a fixed number
+// of normalized weights from there with any unneeded trailing taps left at
+// zero.  These match the weights from paint_pixel() along this axis, so
+// that their products give the same result after normalization.  The
+// pixel positions count from the start given, which is the origin of a
+// tile for tiles replaying a display list and otherwise zero.  Pixels
+// beyond an unrepeated pattern get all zero weights so that they come out
+// transparent black.  When the scale is exactly one and the pixel centers
+// land on texel centers, it only needs the single exact tap.  This returns
+// false if the tables would be too large to be worth it.
+//
+bool canvas::prepare_taps(
+    filter_taps &axis,
+    float scale,
+    float offset,
+    int start,
+    int count,
+    int size,
+    bool bounded )
+{
+    float extent = static_cast< float >( size );
+    float step = std::max( 1.0f, std::min( fabsf( scale ), extent * 0.25f ) );
+    float radius = image_smoothing == bilinear ? 1.0f : 2.0f;
+    bool exact = fabsf( scale ) == 1.0f && floorf( offset ) == offset;
+    int taps = 1;
+    if ( !exact && image_smoothing != nearest )
+        taps = static_cast< int >( ceilf( 2.0f * radius * step ) ) + 1;
+    if ( static_cast< float >( count ) * static_cast< float >( taps ) >
+         4194304.0f )
+        return false;
+    axis.taps = taps;
+    axis.first.assign( static_cast< size_t >( count ), 0 );
+    axis.weights.assign( static_cast< size_t >( count * taps ), 0.0f );
+    float reciprocal = 1.0f / step;
+    for ( int index = 0; index < count; ++index )
+    {
+        float point = scale *
+            ( static_cast< float >( start + index ) + 0.5f ) + offset;
+        float *weights = &axis.weights[ static_cast< size_t >(
+            index * taps ) ];
+        int &first = axis.first[ static_cast< size_t >( index ) ];
+        if ( bounded && ( point < 0.0f || extent <= point ) )
+        {
+            first = point < 0.0f ? 0 : size - 1;
+            continue;
+        }
+        if ( exact || image_smoothing == nearest )
+        {
+            first = static_cast< int >( exact ? point - 0.5f
+                                              : floorf( point ) );
+            weights[ 0 ] = 1.0f;
+            continue;
+        }
+        point -= 0.5f;
+        first = static_cast< int >( ceilf( point - step * radius ) );
+        int last = static_cast< int >( ceilf( point + step * radius ) );
+        last = std::min( last, first + taps );
+        float total = 0.0f;
+        for ( int texel = first; texel < last; ++texel )
+        {
+            float weight = filter_weight( fabsf( reciprocal *
+                ( static_cast< float >( texel ) - point ) ),
+                image_smoothing );
+            weights[ texel - first ] = weight;
+            total += weight;
+        }
+        for ( int tap = 0; tap < taps; ++tap )
+            weights[ tap ] *= 1.0f / total;
+    }
+    return true;
+}
+
+// Set up for sampling spans of a pattern separably, if possible.  That
+// needs a pattern brush and an inverse transform without rotation or skew
+// so that the filter weights for each pixel column and row can be computed
+// once up front instead of for every pixel.  Otherwise, the number of taps
+// is left at zero and compositing falls back to paint_pixel().  This picks
+// the mipmap level the same way that paint_pixel() does.  Each band
+// gets its own slice of the buffers for the vertically filtered texel
+// columns and for the finished samples of its current span.
+//
+void canvas::prepare_sampling(
+    paint_brush const &brush,
+    int bands )
+{
+    sample_x.taps = 0;
+    if ( brush.type == paint_brush::color || is_blank( brush ) )
+        return;
+    sampled.resize( static_cast< size_t >( bands * size_x ) );
+    if ( brush.type != paint_brush::pattern ||
+         inverse.b != 0.0f || inverse.c != 0.0f )
+        return;
+    float scale_x = image_smoothing == nearest ? 0.0f : fabsf( inverse.a );
+    float scale_y = image_smoothing == nearest ? 0.0f : fabsf( inverse.d );
+    sample_texels = mipmap_level( brush, scale_x, scale_y,
+                                  sample_width, sample_height );
+    float ratio_x = static_cast< float >( sample_width ) /
+        static_cast< float >( brush.width );
+    float ratio_y = static_cast< float >( sample_height ) /
+        static_cast< float >( brush.height );
+    if ( !prepare_taps( sample_x, inverse.a * ratio_x, inverse.e * ratio_x,
+                        static_cast< int >( origin.x ), size_x,
+                        sample_width, brush.repetition & 2 ) ||
+         !prepare_taps( sample_y, inverse.d * ratio_y, inverse.f * ratio_y,
+                        static_cast< int >( origin.y ), size_y,
+                        sample_height, brush.repetition & 1 ) )
+    {
+        sample_x.taps = 0;
+        return;
+    }
+    int low = *std::min_element( sample_x.first.begin(),
+                                 sample_x.first.end() );
+    int high = *std::max_element( sample_x.first.begin(),
+                                  sample_x.first.end() );
+    filtered_stride = high - low + sample_x.taps;
+    if ( static_cast< float >( filtered_stride ) *
+         static_cast< float >( bands ) > 4194304.0f )
+    {
+        sample_x.taps = 0;
+        return;
+    }
+    filtered.resize( static_cast< size_t >( bands * filtered_stride ) );
+}
+
+// Sample a span of a pattern into the band's slice of the sample buffer,
+// using the precomputed filter taps.  This first filters vertically to get
+// each texel column that the span's horizontal taps reach, and then filters
+// those horizontally for each pixel.  The unwrapped texel columns are
+// consecutive, so stepping through them to wrap or clamp them to the
+// pattern is simple.  Rows with zero weight are skipped entirely.  Pixels
+// off the edge of an unrepeated pattern have their taps pinned to its edge
+// rather than continuing the others, so the texel columns are bounded by
+// the extremes over the whole span, not just by its two ends.
+//
+void canvas::sample_span(
+    paint_brush const &brush,
+    int band,
+    int x,
+    int y,
+    int count )
+{
+    bool clamp = &brush == &image_brush;
+    int taps_x = sample_x.taps;
+    int taps_y = sample_y.taps;
+    std::vector< int >::const_iterator span_begin =
+        sample_x.first.begin() + x;
+    int low = *std::min_element( span_begin, span_begin + count );
+    int high = *std::max_element( span_begin, span_begin + count ) + taps_x;
+    rgba *columns = &filtered[ static_cast< size_t >(
+        band * filtered_stride ) ];
+    std::fill( columns, columns + ( high - low ),
+               rgba( 0.0f, 0.0f, 0.0f, 0.0f ) );
+    int first_y = sample_y.first[ static_cast< size_t >( y ) ];
+    float const *weights_y = &sample_y.weights[ static_cast< size_t >(
+        y * taps_y ) ];
+    for ( int tap = 0; tap < taps_y; ++tap )
+    {
+        float weight = weights_y[ tap ];
+        if ( weight == 0.0f )
+            continue;
+        int row = ( first_y + tap ) % sample_height;
+        if ( row < 0 )
+            row += sample_height;
+        if ( clamp )
+            row = std::min( std::max( first_y + tap, 0 ), sample_height - 1 );
+        rgba const *texels = sample_texels + row * sample_width;
+        int texel = low % sample_width;
+        if ( texel < 0 )
+            texel += sample_width;
+        for ( int column = low; column < high; ++column )
+        {
+            if ( clamp )
+                texel = std::min( std::max( column, 0 ), sample_width - 1 );
+            columns[ column - low ] += weight * texels[ texel ];
+            if ( ++texel == sample_width )
+                texel = 0;
+        }
+    }
+    rgba *samples = &sampled[ static_cast< size_t >( band * size_x ) ];
+    for ( int index = 0; index < count; ++index )
+    {
+        size_t pixel = static_cast< size_t >( x + index );
+        float const *weights_x = &sample_x.weights[ pixel *
+            static_cast< size_t >( taps_x ) ];
+        rgba const *from = &columns[ sample_x.first[ pixel ] - low ];
+        rgba total = rgba( 0.0f, 0.0f, 0.0f, 0.0f );
+        for ( int tap = 0; tap < taps_x; ++tap )
+            total += weights_x[ tap ] * from[ tap ];
+        samples[ index ] = total;
+    }
+}
+
+// Sample a span of a gradient into the band's slice of the sample buffer.
+// This is the same math as in paint_pixel(), but the point in gradient
+// space steps incrementally along the span since the inverse transform is
+// affine, and the parts of the radial quadratic that don't depend on the
+// point are only computed once.  Successive pixels usually land between
+// the same pair of color stops, or one over, so rather than a binary
+// search for each it walks the index up or down from the last one.  For
+// linear gradients this is just a monotonic walk.
+//
+void canvas::sample_gradient(
+    paint_brush const &brush,
+    int band,
+    int x,
+    int y,
+    int count )
+{
+    rgba *samples = &sampled[ static_cast< size_t >( band * size_x ) ];
+    xy point = inverse * ( xy( static_cast< float >( x ) + 0.5f,
+                               static_cast< float >( y ) + 0.5f ) + origin );
+    xy step = xy( inverse.a, inverse.b );
+    xy start = point - brush.start;
+    xy line = brush.end - brush.start;
+    float span = dot( line, line );
+    float initial = brush.start_radius;
+    float change = brush.end_radius - initial;
+    float a = span - change * change;
+    float reciprocal = 1.0f / ( 2.0f * a );
+    bool linear = brush.type == paint_brush::linear;
+    bool empty = linear ? span == 0.0f : span == 0.0f && change == 0.0f;
+    size_t stops = brush.stops.size();
+    size_t index = 0;
+    for ( int pixel = 0; pixel < count; ++pixel )
+    {
+        if ( empty )
+        {
+            samples[ pixel ] = rgba( 0.0f, 0.0f, 0.0f, 0.0f );
+            continue;
+        }
+        xy relative = start + static_cast< float >( pixel ) * step;
+        float gradient = dot( relative, line );
+        float offset = gradient / span;
+        if ( !linear )
+        {
+            float b = -2.0f * ( gradient + initial * change );
+            float c = dot( relative, relative ) - initial * initial;
+            float discriminant = b * b - 4.0f * a * c;
+            float root = sqrtf( std::max( discriminant, 0.0f ) );
+            float offset_1 = ( -b - root ) * reciprocal;
+            float offset_2 = ( -b + root ) * reciprocal;
+            float radius_1 = initial + change * offset_1;
+            float radius_2 = initial + change * offset_2;
+            if ( discriminant < 0.0f ||
+                 !( radius_2 >= 0.0f || radius_1 >= 0.0f ) )
+            {
+                samples[ pixel ] = rgba( 0.0f, 0.0f, 0.0f, 0.0f );
+                continue;
+            }
+            offset = radius_2 >= 0.0f ? offset_2 : offset_1;
+        }
+        while ( index < stops && brush.stops[ index ] <= offset )
+            ++index;
+        while ( index > 0 && offset < brush.stops[ index - 1 ] )
+            --index;
+        if ( offset != offset )
+            index = stops;
+        if ( index == 0 )
+            samples[ pixel ] = premultiplied( brush.colors.front() );
+        else if ( index == stops )
+            samples[ pixel ] = premultiplied( brush.colors.back() );
+        else
+        {
+            float below = brush.stops[ index - 1 ];
+            float above = brush.stops[ index ];
+            float mix = ( offset - below ) / ( above - below );
+            rgba delta = brush.colors[ index ] - brush.colors[ index - 1 ];
+            samples[ pixel ] = premultiplied(
+                brush.colors[ index - 1 ] + mix * delta );
+        }
+    }
+}
+
+// Read a single pixel from the buffer as a linear premultiplied color, or
+// write one back.  These convert between the float values that all of the
+// compositing works with and the compact representations in the buffer
+// for the other storage formats.  Storing to 8-bit sRGB uses the same
+// ordered dithering as for retrieving the image, placed by the origin so
+// that tiles line up with the pattern of the whole canvas.
+//
+rgba canvas::load_pixel(
+    int x,
+    int y ) const
+{
+    if ( storage == linear_float )
+        return bitmap[ y * size_x + x ];
+    if ( storage == srgb_byte )
+        return encoded_to_color(
+            &encoded[ static_cast< std::ptrdiff_t >( y ) * byte_stride +
+                    x * 4 ] );
+    size_t place = static_cast< size_t >( y * size_x + x ) * 4;
+    if ( storage == linear_half )
+        return rgba( full_float( packed[ place + 0 ] ),
+                     full_float( packed[ place + 1 ] ),
+                     full_float( packed[ place + 2 ] ),
+                     full_float( packed[ place + 3 ] ) );
+    return rgba( packed[ place + 0 ] / 65535.0f,
+                 packed[ place + 1 ] / 65535.0f,
+                 packed[ place + 2 ] / 65535.0f,
+                 packed[ place + 3 ] / 65535.0f );
+}
+
+void canvas::store_pixel(
+    int x,
+    int y,
+    rgba color )
+{
+    if ( storage == linear_float )
+    {
+        bitmap[ y * size_x + x ] = color;
+        return;
+    }
+    if ( storage == srgb_byte )
+    {
+        color_to_encoded(
+            color, dither_threshold( x + static_cast< int >( origin.x ),
+                                     y + static_cast< int >( origin.y ) ),
+            &encoded[ static_cast< std::ptrdiff_t >( y ) * byte_stride +
+                    x * 4 ] );
+        return;
+    }
+    size_t place = static_cast< size_t >( y * size_x + x ) * 4;
+    bool half = storage == linear_half;
+    packed[ place + 0 ] = half ? half_float( color.r ) :
+        normalized_short( color.r );
+    packed[ place + 1 ] = half ? half_float( color.g ) :
+        normalized_short( color.g );
+    packed[ place + 2 ] = half ? half_float( color.b ) :
+        normalized_short( color.b );
+    packed[ place + 3 ] = half ? half_float( color.a ) :
+        normalized_short( color.a );
+}
+
+// Get a span of pixels from the buffer for compositing, starting at the
+// given position.  With the float storage format, this just points directly
+// into the buffer.  Otherwise, it unpacks the pixels into the band's own row
+// of working space and points to that, so that the loops for compositing
+// can treat all formats alike.  Afterwards, they must put the span back
+// with the same arguments to pack any changes into place.
+//
+rgba *canvas::load_span(
+    int band,
+    int x,
+    int y,
+    int count )
+{
+    if ( storage == linear_float )
+        return &bitmap[ y * size_x + x ];
+    size_t start = static_cast< size_t >( band * size_x );
+    for ( int offset = 0; offset < count; ++offset )
+        spans[ start + static_cast< size_t >( offset ) ] =
+            load_pixel( x + offset, y );
+    return &spans[ start ];
+}
+
+void canvas::store_span(
+    int band,
+    int x,
+    int y,
+    int count )
+{
+    if ( storage == linear_float )
+        return;
+    size_t start = static_cast< size_t >( band * size_x );
+    for ( int offset = 0; offset < count; ++offset )
+        store_pixel( x + offset, y,
+                     spans[ start + static_cast< size_t >( offset ) ] );
+}
+
+// Blur a number of lanes of values in place with three passes of a box blur
+// with the given radius and weights for the box's body and tails.  Each step
+// along the lanes holds one value for every lane, and successive steps are
+// the stride apart.  Each pass first copies the values to a padded buffer
+// with zeros beyond both ends so that the sliding sums need no checks at
+// the ends; sliding over a zero leaves a sum unchanged.  The inner loops
+// then run across the lanes, which lets them be vectorized even though
+// each lane's sums are serial along it.
+//
+static void blur_lanes(
+    float *values,
+    size_t stride,
+    size_t lanes,
+    size_t length,
+    size_t radius,
+    float weight_1,
+    float weight_2,
+    float *padded,
+    float *running )
+{
+    size_t pad = radius + 2;
+    std::fill( padded, padded + pad * lanes, 0.0f );
+    std::fill( padded + ( pad + length ) * lanes,
+               padded + ( 2 * pad + length ) * lanes, 0.0f );
+    float const *start = padded + pad * lanes;
+    for ( int pass = 0; pass < 3; ++pass )
+    {
+        for ( size_t step = 0; step < length; ++step )
+            std::copy( values + step * stride, values + step * stride + lanes,
+                       padded + ( pad + step ) * lanes );
+        for ( size_t lane = 0; lane < lanes; ++lane )
+            running[ lane ] =
+                weight_1 * start[ ( radius + 1 ) * lanes + lane ];
+        for ( size_t step = 0; step <= radius; ++step )
+            for ( size_t lane = 0; lane < lanes; ++lane )
+                running[ lane ] += ( weight_1 + weight_2 ) *
+                    start[ step * lanes + lane ];
+        std::copy( running, running + lanes, values );
+        for ( size_t step = 1; step < length; ++step )
+        {
+            float const *leaving_2 = padded + ( step + 1 ) * lanes;
+            float const *leaving_1 = padded + step * lanes;
+            float const *entering_2 = start + ( step + radius ) * lanes;
+            float const *entering_1 = entering_2 + lanes;
+            float *out = values + step * stride;
+            for ( size_t lane = 0; lane < lanes; ++lane )
+            {
+                float sum = running[ lane ];
+                sum -= weight_2 * leaving_2[ lane ];
+                sum -= weight_1 * leaving_1[ lane ];
+                sum += weight_2 * entering_2[ lane ];
+                sum += weight_1 * entering_1[ lane ];
+                running[ lane ] = sum;
+                out[ lane ] = sum;
+            }
+        }
+    }
+}
+
+// Render the shadow of the polylines into the pixel buffer if needed.  After
+// computing the border as the maximum distance that one pixel can affect
+// another via the blur, it scan-converts the lines to runs with the shadow
+// offset and that extra amount of border padding.  Then it bounds the scan
+// converted shape, pads this with border, clips that to the extended canvas
+// size, and rasterizes to fill a working area with the alpha.  Next, a fast
+// approximation of a Gaussian blur is done using three passes of box blurs
+// each in the rows and columns.  Note that these box blurs have a small extra
+// weight on the tails to allow for fractional widths.  See "Theoretical
+// Foundations of Gaussian Convolution by Extended Box Filtering" by Gwosdek
+// et al. for details.  The columns are blurred in strips of adjacent lanes
+// directly, while the rows are transposed a strip at a time into lanes and
+// back.  The shadow of an axis-aligned rectangle with a solid paint is the
+// product of its blurred profiles along each axis, so in that case, it
+// skips rasterizing and blurring the area and just blurs the two profiles.
+// Finally, it colors the blurred alpha image with the shadow color and
+// blends this into the pixel buffer according to the compositing settings
+// and clip mask.  Note that it does not bother clearing outside the area of
+// the alpha image when the compositing settings require clearing; that will
+// be done on the subsequent main rendering pass.
+//
+void canvas::render_shadow(
+    paint_brush const &brush )
+{
+    stage_scope scope( "render_shadow" );
+    if ( shadow_color.a == 0.0f || ( shadow_blur == 0.0f &&
+                                     shadow_offset_x == 0.0f &&
+                                     shadow_offset_y == 0.0f ) )
+        return;
+    float sigma_squared = 0.25f * shadow_blur * shadow_blur;
+    size_t radius = static_cast< size_t >(
+        0.5f * sqrtf( 4.0f * sigma_squared + 1.0f ) - 0.5f );
+    int border = 3 * ( static_cast< int >( radius ) + 1 );
+    xy offset = xy( static_cast< float >( border ) + shadow_offset_x,
+                    static_cast< float >( border ) + shadow_offset_y ) -
+        origin;
+    lines_to_runs( offset, size_x + 2 * border, size_y + 2 * border );
+    if ( storage != linear_float )
+        spans.resize( std::max( spans.size(),
+                                static_cast< size_t >( size_x ) ) );
+    int left = size_x + 2 * border;
+    int right = 0;
+    int top = size_y + 2 * border;
+    int bottom = 0;
+    for ( size_t index = 0; index < runs.size(); ++index )
+    {
+        left = std::min( left, from_run( runs[ index ].x ) );
+        right = std::max( right, from_run( runs[ index ].x ) );
+        top = std::min( top, from_run( runs[ index ].y ) );
+        bottom = std::max( bottom, from_run( runs[ index ].y ) );
+    }
+    left = std::max( left - border, 0 );
+    right = std::min( right + border, size_x + 2 * border ) + 1;
+    top = std::max( top - border, 0 );
+    bottom = std::min( bottom + border, size_y + 2 * border );
+    size_t width = static_cast< size_t >( std::max( right - left, 0 ) );
+    size_t height = static_cast< size_t >( std::max( bottom - top, 0 ) );
+    size_t working = width * height;
+    if ( !working )
+        return;
+    static size_t const strip = 16;
+    xy low, high;
+    bool separable = brush.type == paint_brush::color &&
+        rectangle_bounds( low, high );
+    size_t longest = std::max( width, height ) + 2 * radius + 4;
+    shadow.clear();
+    shadow.resize( working + strip * ( width + longest + 1 ) + height );
+#ifdef CANVAS_ITY_STATS
+    stats.shadow_floats += shadow.size();
+    stats.largest_shadow = std::max( stats.largest_shadow, shadow.size() );
+#endif
+    float *lanes = &shadow[ working ];
+    float *padded = lanes + strip * width;
+    float *running = padded + strip * longest;
+    static float const threshold = 1.0f / 8160.0f;
+    float alpha = static_cast< float >( 2 * radius + 1 ) *
+        ( static_cast< float >( radius * ( radius + 1 ) ) - sigma_squared ) /
+        ( 2.0f * sigma_squared -
+          static_cast< float >( 6 * ( radius + 1 ) * ( radius + 1 ) ) );
+    float divisor = 2.0f * ( alpha + static_cast< float >( radius ) ) + 1.0f;
+    float weight_1 = alpha / divisor;
+    float weight_2 = ( 1.0f - alpha ) / divisor;
+    if ( separable )
+    {
+        float *profile_x = lanes;
+        float *profile_y = running + strip;
+        low = low + offset;
+        high = high + offset;
+        float limit_x = static_cast< float >( size_x + 2 * border );
+        float limit_y = static_cast< float >( size_y + 2 * border );
+        for ( size_t x = 0; x < width; ++x )
+        {
+            float place = static_cast< float >( left ) +
+                static_cast< float >( x );
+            profile_x[ x ] = std::max( 0.0f,
+                std::min( place + 1.0f, std::min( high.x, limit_x ) ) -
+                std::max( place, std::max( low.x, 0.0f ) ) );
+        }
+        for ( size_t y = 0; y < height; ++y )
+        {
+            float place = static_cast< float >( top ) +
+                static_cast< float >( y );
+            profile_y[ y ] = std::max( 0.0f,
+                std::min( place + 1.0f, std::min( high.y, limit_y ) ) -
+                std::max( place, std::max( low.y, 0.0f ) ) );
+        }
+        blur_lanes( profile_x, 1, 1, width, radius, weight_1, weight_2,
+                    padded, running );
+        blur_lanes( profile_y, 1, 1, height, radius, weight_1, weight_2,
+                    padded, running );
+        float level = paint_pixel( xy( 0.0f, 0.0f ), brush ).a;
+        for ( size_t y = 0; y < height; ++y )
+            for ( size_t x = 0; x < width; ++x )
+                shadow[ y * width + x ] =
+                    level * profile_y[ y ] * profile_x[ x ];
+    }
+    else
+    {
+        int x = -1;
+        int y = -1;
+        float sum = 0.0f;
+        for ( size_t index = 0; index < runs.size(); ++index )
+        {
+            pixel_run next = runs[ index ];
+            float coverage = std::min( fabsf( sum ), 1.0f );
+            int to = next.y == y ? next.x : x + 1;
+            if ( coverage >= threshold )
+                for ( ; x < to; ++x )
+                    shadow[ static_cast< size_t >( y - top ) * width +
+                            static_cast< size_t >( x - left ) ] = coverage *
+                        paint_pixel( xy( static_cast< float >( x ) + 0.5f,
+                                         static_cast< float >( y ) + 0.5f ) -
+                                     offset, brush ).a;
+            if ( next.y != y )
+                sum = 0.0f;
+            x = next.x;
+            y = next.y;
+            sum += next.delta;
+        }
+        for ( size_t first = 0; first < height; first += strip )
+        {
+            size_t count = std::min( strip, height - first );
+            for ( size_t row = 0; row < count; ++row )
+                for ( size_t column = 0; column < width; ++column )
+                    lanes[ column * count + row ] =
+                        shadow[ ( first + row ) * width + column ];
+            blur_lanes( lanes, count, count, width, radius,
+                        weight_1, weight_2, padded, running );
+            for ( size_t row = 0; row < count; ++row )
+                for ( size_t column = 0; column < width; ++column )
+                    shadow[ ( first + row ) * width + column ] =
+                        lanes[ column * count + row ];
+        }
+        for ( size_t first = 0; first < width; first += strip )
+            blur_lanes( &shadow[ first ], width,
+                        std::min( strip, width - first ), height, radius,
+                        weight_1, weight_2, padded, running );
+    }
+    mark_dirty( left - border, top - border,
+                right - border, bottom - border );
+    int operation = global_composite_operation;
+    pixel_runs const &mask = clipping->runs;
+    int x = -1;
+    int y = -1;
+    float sum = 0.0f;
+    for ( size_t index = 0; index < mask.size(); ++index )
+    {
+        pixel_run next = mask[ index ];
+        float visibility = std::min( fabsf( sum ), 1.0f );
+        int to = std::min( next.y == y ? next.x : x + 1, right - border );
+        if ( visibility >= threshold && x < to &&
+             top <= y + border && y + border < bottom )
+        {
+            int start = x;
+            int count = to - x;
+            rgba *span = load_span( 0, start, y, count );
+            for ( ; x < to; ++x )
+            {
+                rgba &back = span[ x - start ];
+                rgba fore = global_alpha *
+                    shadow[
+                        static_cast< size_t >( y + border - top ) * width +
+                        static_cast< size_t >( x + border - left ) ] *
+                    shadow_color;
+                float mix_fore = operation & 1 ? back.a : 0.0f;
+                if ( operation & 2 )
+                    mix_fore = 1.0f - mix_fore;
+                float mix_back = operation & 4 ? fore.a : 0.0f;
+                if ( operation & 8 )
+                    mix_back = 1.0f - mix_back;
+                rgba blend = mix_fore * fore + mix_back * back;
+                blend.a = std::min( blend.a, 1.0f );
+                back = visibility * blend + ( 1.0f - visibility ) * back;
+            }
+            store_span( 0, start, y, count );
+        }
+        if ( next.y != y )
+            sum = 0.0f;
+        x = std::max( from_run( next.x ), left - border );
+        y = next.y;
+        sum += next.delta;
+    }
+}
+
+// Blend a span of pixels in the buffer with a constant premultiplied color,
+// as for drawing with a color brush at constant coverage.  This is the same
+// compositing arithmetic as in the general case, just with everything that
+// doesn't depend on the old pixel hoisted out of the loop.  The blend for
+// the foreground is factored as base + scale * old alpha, which covers all
+// of the compositing operation bit patterns without branching per pixel
+// and still rounds identically.  Where available it uses SSE or NEON to
+// do a whole pixel at a time; define CANVAS_ITY_NO_SIMD to disable this.
+// An opaque color drawn over unclipped pixels just replaces them, so that
+// case skips the arithmetic and simply fills the span.
+//
+static void blend_span(
+    rgba *bitmap,
+    int index,
+    int count,
+    rgba fore,
+    float visibility,
+    int operation )
+{
+    if ( operation == source_over && fore.a == 1.0f && visibility == 1.0f )
+    {
+        std::fill( bitmap + index, bitmap + index + count, fore );
+        return;
+    }
+    float base = operation & 2 ? 1.0f : 0.0f;
+    float scale = ~operation & 1 ? 0.0f : operation & 2 ? -1.0f : 1.0f;
+    float mix_back = operation & 4 ? fore.a : 0.0f;
+    if ( operation & 8 )
+        mix_back = 1.0f - mix_back;
+    float keep = 1.0f - visibility;
+#if defined( CANVAS_ITY_SSE )
+    __m128 fore_4 = _mm_setr_ps( fore.r, fore.g, fore.b, fore.a );
+    __m128 base_4 = _mm_set1_ps( base );
+    __m128 scale_4 = _mm_set1_ps( scale );
+    __m128 back_mix_4 = _mm_set1_ps( mix_back );
+    __m128 visibility_4 = _mm_set1_ps( visibility );
+    __m128 keep_4 = _mm_set1_ps( keep );
+    __m128 one_4 = _mm_set1_ps( 1.0f );
+    for ( int end = index + count; index < end; ++index )
+    {
+        float *pixel = &bitmap[ index ].r;
+        __m128 back = _mm_loadu_ps( pixel );
+        __m128 alpha = _mm_shuffle_ps( back, back,
+                                       _MM_SHUFFLE( 3, 3, 3, 3 ) );
+        __m128 fore_mix = _mm_add_ps( base_4, _mm_mul_ps( scale_4, alpha ) );
+        __m128 blend = _mm_add_ps( _mm_mul_ps( fore_mix, fore_4 ),
+                                   _mm_mul_ps( back_mix_4, back ) );
+        __m128 clamped = _mm_min_ps( one_4, blend );
+        __m128 upper = _mm_shuffle_ps( blend, clamped,
+                                       _MM_SHUFFLE( 3, 3, 2, 2 ) );
+        blend = _mm_shuffle_ps( blend, upper, _MM_SHUFFLE( 2, 0, 1, 0 ) );
+        _mm_storeu_ps( pixel, _mm_add_ps( _mm_mul_ps( visibility_4, blend ),
+                                          _mm_mul_ps( keep_4, back ) ) );
+    }
+#elif defined( CANVAS_ITY_NEON )
+    float const fore_1[] = { fore.r, fore.g, fore.b, fore.a };
+    float32x4_t fore_4 = vld1q_f32( fore_1 );
+    float32x4_t base_4 = vdupq_n_f32( base );
+    float32x4_t scale_4 = vdupq_n_f32( scale );
+    float32x4_t back_mix_4 = vdupq_n_f32( mix_back );
+    float32x4_t visibility_4 = vdupq_n_f32( visibility );
+    float32x4_t keep_4 = vdupq_n_f32( keep );
+    for ( int end = index + count; index < end; ++index )
+    {
+        float *pixel = &bitmap[ index ].r;
+        float32x4_t back = vld1q_f32( pixel );
+        float32x4_t alpha = vdupq_n_f32( vgetq_lane_f32( back, 3 ) );
+        float32x4_t fore_mix = vaddq_f32( base_4,
+                                          vmulq_f32( scale_4, alpha ) );
+        float32x4_t blend = vaddq_f32( vmulq_f32( fore_mix, fore_4 ),
+                                       vmulq_f32( back_mix_4, back ) );
+        blend = vsetq_lane_f32(
+            std::min( vgetq_lane_f32( blend, 3 ), 1.0f ), blend, 3 );
+        vst1q_f32( pixel, vaddq_f32( vmulq_f32( visibility_4, blend ),
+                                     vmulq_f32( keep_4, back ) ) );
+    }
+#else
+    for ( int end = index + count; index < end; ++index )
+    {
+        rgba &back = bitmap[ index ];
+        float mix_fore = base + scale * back.a;
+        rgba blend = mix_fore * fore + mix_back * back;
+        blend.a = std::min( blend.a, 1.0f );
+        back = visibility * blend + keep * back;
+    }
+#endif
+}
+
+// Blend a span of pixels in the buffer with a span of painted colors from
+// a gradient or pattern, at constant coverage.  This is the same as the
+// compositing arithmetic in the general case, but instantiated for each
+// compositing operation so that its bit tests fold away at compile time
+// and leave a short branch-free loop that the compiler can unroll or
+// vectorize.  Drawing over unclipped pixels also gets its own version
+// that skips mixing with the visibility, since that leaves the blend as
+// is.  The table below picks the version once per span.
+//
+template< int operation, bool clipped >
+static void blend_samples(
+    rgba *bitmap,
+    rgba const *samples,
+    int count,
+    float scale,
+    float visibility )
+{
+    for ( int index = 0; index < count; ++index )
+    {
+        rgba &back = bitmap[ index ];
+        rgba fore = scale * samples[ index ];
+        float mix_fore = operation & 1 ? back.a : 0.0f;
+        if ( operation & 2 )
+            mix_fore = 1.0f - mix_fore;
+        float mix_back = operation & 4 ? fore.a : 0.0f;
+        if ( operation & 8 )
+            mix_back = 1.0f - mix_back;
+        rgba blend = mix_fore * fore + mix_back * back;
+        blend.a = std::min( blend.a, 1.0f );
+        back = clipped ? visibility * blend + ( 1.0f - visibility ) * back :
+            blend;
+    }
+}
+
+static void blend_samples(
+    rgba *bitmap,
+    rgba const *samples,
+    int count,
+    float scale,
+    float visibility,
+    int operation )
+{
+    typedef void ( *kernel )( rgba *, rgba const *, int, float, float );
+    static kernel const kernels[] = {
+        0, blend_samples< source_in, true >,
+        blend_samples< source_copy, true >, blend_samples< source_out, true >,
+        blend_samples< destination_in, true >, 0, 0,
+        blend_samples< destination_atop, true >, 0, 0,
+        blend_samples< lighter, true >,
+        blend_samples< destination_over, true >,
+        blend_samples< destination_out, true >,
+        blend_samples< source_atop, true >,
+        blend_samples< source_over, true >,
+        blend_samples< exclusive_or, true > };
+    if ( operation == source_over && visibility == 1.0f )
+        blend_samples< source_over, false >(
+            bitmap, samples, count, scale, visibility );
+    else
+        kernels[ operation ]( bitmap, samples, count, scale, visibility );
+}
+
+// Composite a horizontal band of the runs into the pixel buffer, from the
+// top row up to but not including the bottom row.  It scans through the
+// runs to determine spans of pixels that need to be drawn, paints those
+// pixels according to the brush, and then blends them into the buffer
+// according to the current compositing settings.  This is slightly more
+// complicated because it interleaves this with a simultaneous scan through
+// a similar set of runs representing the current clip mask to determine
+// which pixels it can composite into.  Where the compositing operation
+// leaves the old pixels alone outside the new drawing, it narrows the band
+// to just the rows with any runs.  Rows with no clip mask runs are fully
+// clipped, so it jumps past any path runs on those without visiting them.
+// Each band begins its scan from the first runs on its top row and ends
+// right after finishing its bottom row, so different bands never touch the
+// same pixels or any shared state other than the pixel buffer.  Scanning
+// the bands separately in any order thus gives exactly the same result as
+// scanning the whole canvas in one go.
+//
+void canvas::render_band(
+    paint_brush const &brush,
+    int band,
+    int top,
+    int bottom )
+{
     int operation = global_composite_operation;
+    if ( operation & 8 )
+    {
+        if ( runs.empty() )
+            return;
+        top = std::max( top, from_run( runs.front().y ) );
+        bottom = std::min( bottom, runs.back().y + 1 );
+        if ( top >= bottom )
+            return;
+    }
+    pixel_runs const &mask = clipping->runs;
     int x = -1;
     int y = -1;
     float path_sum = 0.0f;
     float clip_sum = 0.0f;
-    size_t path_index = 0;
-    size_t clip_index = 0;
+    pixel_run first = { 0, to_run( top ), 0.0f };
+    size_t path_index = static_cast< size_t >(
+        std::lower_bound( runs.begin(), runs.end(), first ) - runs.begin() );
+    size_t clip_index = static_cast< size_t >(
+        std::lower_bound( mask.begin(), mask.end(), first ) - mask.begin() );
     while ( clip_index < mask.size() )
     {
         bool which = ( path_index < runs.size() &&
                        runs[ path_index ] < mask[ clip_index ] );
+        if ( which && y < runs[ path_index ].y &&
+             runs[ path_index ].y < mask[ clip_index ].y )
+        {
+            pixel_run clipped = { 0, mask[ clip_index ].y, 0.0f };
+            path_index = static_cast< size_t >(
+                std::lower_bound( runs.begin() +
+                                      static_cast< std::ptrdiff_t >(
+                                          path_index ),
+                                  runs.end(), clipped ) - runs.begin() );
+            which = ( path_index < runs.size() &&
+                      runs[ path_index ] < mask[ clip_index ] );
+        }
         pixel_run next = which ? runs[ path_index ] : mask[ clip_index ];
         float coverage = std::min( fabsf( path_sum ), 1.0f );
         float visibility = std::min( fabsf( clip_sum ), 1.0f );
         int to = next.y == y ? next.x : x + 1;
         static float const threshold = 1.0f / 8160.0f;
         if ( ( coverage >= threshold || ~operation & 8 ) &&
-             visibility >= threshold )
+             visibility >= threshold && x < to )
+        {
+            int start = x;
+            int count = to - x;
+#ifdef CANVAS_ITY_STATS
+            band_pixels[ static_cast< size_t >( band ) ] +=
+                static_cast< size_t >( count );
+#endif
+            rgba *span = load_span( band, start, y, count );
+            if ( brush.type == paint_brush::color )
+            {
+                blend_span( span, 0, count,
+                            coverage * global_alpha *
+                                paint_pixel( xy( 0.0f, 0.0f ), brush ),
+                            visibility, operation );
+                x = to;
+            }
+            if ( x < to && !is_blank( brush ) &&
+                 ( brush.type != paint_brush::pattern || sample_x.taps ) )
+            {
+                if ( brush.type == paint_brush::pattern )
+                    sample_span( brush, band, x, y, count );
+                else
+                    sample_gradient( brush, band, x, y, count );
+                blend_samples( span,
+                               &sampled[ static_cast< size_t >(
+                                   band * size_x ) ],
+                               count, coverage * global_alpha, visibility,
+                               operation );
+                x = to;
+            }
             for ( ; x < to; ++x )
             {
-                rgba &back = bitmap[ y * size_x + x ];
+                rgba &back = span[ x - start ];
                 rgba fore = coverage * global_alpha *
                     paint_pixel( xy( static_cast< float >( x ) + 0.5f,
-                                     static_cast< float >( y ) + 0.5f ),
-                                 brush );
+                                     static_cast< float >( y ) + 0.5f ) +
+                                 origin, brush );
                 float mix_fore = operation & 1 ? back.a : 0.0f;
                 if ( operation & 2 )
                     mix_fore = 1.0f - mix_fore;
@@ -2590,6 +5321,10 @@ void canvas::render_main(
                 blend.a = std::min( blend.a, 1.0f );
                 back = visibility * blend + ( 1.0f - visibility ) * back;
             }
+            store_span( band, start, y, count );
+        }
+        if ( next.y >= bottom )
+            break;
         x = next.x;
         if ( next.y != y )
         {
@@ -2604,9 +5339,390 @@ void canvas::render_main(
     }
 }
 
+// Task details for compositing the bands via a task runner.  The canvas
+// passes one of these through to a static function that then forwards to
+// the member function for rendering the band with that index.
+//
+struct band_task_data { canvas *that; paint_brush const *brush; int count; };
+void canvas::render_band_task(
+    void *data,
+    int index )
+{
+    band_task_data const &task = *static_cast< band_task_data * >( data );
+    int rows = task.that->size_y;
+    task.that->render_band( *task.brush, index,
+                            rows * index / task.count,
+                            rows * ( index + 1 ) / task.count );
+}
+
+// Composite the runs into the pixel buffer.  This does it either as a
+// single band covering the whole canvas, or else as a number of bands
+// shared out through the task runner.  Beforehand, it notes the bounds of
+// the runs as changed, or of the clip mask for operations that affect the
+// whole clip region.
+//
+void canvas::render_runs(
+    paint_brush const &brush )
+{
+    pixel_runs const &changed = global_composite_operation & 8 ?
+        runs : clipping->runs;
+    if ( !changed.empty() )
+    {
+        int low = size_x;
+        int high = 0;
+        for ( size_t index = 0; index < changed.size(); ++index )
+        {
+            low = std::min( low, static_cast< int >( changed[ index ].x ) );
+            high = std::max( high, static_cast< int >( changed[ index ].x ) );
+        }
+        mark_dirty( low, changed.front().y, high + 1,
+                    changed.back().y + 1 );
+    }
+    int count = runner ? std::min( band_count, size_y ) : 1;
+    if ( storage != linear_float )
+        spans.resize( static_cast< size_t >( count * size_x ) );
+    prepare_sampling( brush, count );
+#ifdef CANVAS_ITY_STATS
+    band_pixels.assign( static_cast< size_t >( count ), 0 );
+#endif
+    if ( count < 2 )
+        render_band( brush, 0, 0, size_y );
+    else
+    {
+        band_task_data task = { this, &brush, count };
+        runner->run( render_band_task, &task, count );
+    }
+#ifdef CANVAS_ITY_STATS
+    size_t painted = std::accumulate( band_pixels.begin(), band_pixels.end(),
+                                      static_cast< size_t >( 0 ) );
+    size_t &total = ( brush.type == paint_brush::color ? stats.color_pixels :
+                      brush.type == paint_brush::linear ?
+                          stats.linear_pixels :
+                      brush.type == paint_brush::radial ?
+                          stats.radial_pixels : stats.pattern_pixels );
+    total += painted;
+#endif
+}
+
+// Grow the dirty region to include a rectangle of changed pixels, given by
+// its exclusive bounds.  The rectangle is clamped to the canvas first.
+//
+void canvas::mark_dirty(
+    int left,
+    int top,
+    int right,
+    int bottom )
+{
+    left = std::max( left, 0 );
+    top = std::max( top, 0 );
+    right = std::min( right, size_x );
+    bottom = std::min( bottom, size_y );
+    if ( left >= right || top >= bottom )
+        return;
+    if ( dirty_left < dirty_right )
+    {
+        left = std::min( left, dirty_left );
+        top = std::min( top, dirty_top );
+        right = std::max( right, dirty_right );
+        bottom = std::max( bottom, dirty_bottom );
+    }
+    dirty_left = left;
+    dirty_top = top;
+    dirty_right = right;
+    dirty_bottom = bottom;
+}
+
+// Check whether rendering the polylines could change any pixels on this
+// canvas.  Most composite operations only affect pixels under the path, in
+// which case nothing will change if the bounding box of the polylines lies
+// completely outside the canvas, and the same for the shadow when there is
+// one.  The shadow's box is offset and then padded by a generous bound on
+// the reach of its blur.  Replaying a display list in tiles relies on this
+// to cull the drawing that misses each tile.
+//
+bool canvas::lines_visible()
+{
+    if ( ~global_composite_operation & 8 )
+        return true;
+    if ( lines.points.empty() )
+        return false;
+    xy low = lines.points.front();
+    xy high = low;
+    for ( size_t index = 1; index < lines.points.size(); ++index )
+    {
+        low = xy( std::min( low.x, lines.points[ index ].x ),
+                  std::min( low.y, lines.points[ index ].y ) );
+        high = xy( std::max( high.x, lines.points[ index ].x ),
+                   std::max( high.y, lines.points[ index ].y ) );
+    }
+    low -= origin;
+    high -= origin;
+    float width = static_cast< float >( size_x );
+    float height = static_cast< float >( size_y );
+    if ( !( high.x < 0.0f || width < low.x ||
+            high.y < 0.0f || height < low.y ) )
+        return true;
+    if ( shadow_color.a == 0.0f || ( shadow_blur == 0.0f &&
+                                     shadow_offset_x == 0.0f &&
+                                     shadow_offset_y == 0.0f ) )
+        return false;
+    float reach = 1.5f * shadow_blur + 6.0f;
+    xy offset( shadow_offset_x, shadow_offset_y );
+    low = low + offset - xy( reach, reach );
+    high = high + offset + xy( reach, reach );
+    return !( high.x < 0.0f || width < low.x ||
+              high.y < 0.0f || height < low.y );
+}
+
+// Render the polylines into the pixel buffer.  It scan-converts the lines
+// to runs which represent changes to the signed fractional coverage when
+// read from left-to-right, top-to-bottom, and then composites those.  Note
+// that shadows are always drawn first, and always serially.
+//
+void canvas::render_main(
+    paint_brush &brush )
+{
+    stage_scope scope( "render_main" );
+    if ( forward.a * forward.d - forward.b * forward.c == 0.0f ||
+         !lines_visible() )
+        return;
+    build_mipmaps( brush );
+    render_shadow( brush );
+    lines_to_runs( xy() - origin, size_x, size_y );
+    render_runs( brush );
+    trim_scratch();
+}
+
+task_runner::~task_runner()
+{
+}
+
+#ifdef CANVAS_ITY_STATS
+canvas_stats::canvas_stats()
+    : bezier_segments( 0 ),
+      dashed_points( 0 ),
+      stroked_points( 0 ),
+      unmerged_runs( 0 ),
+      merged_runs( 0 ),
+      color_pixels( 0 ),
+      linear_pixels( 0 ),
+      radial_pixels( 0 ),
+      pattern_pixels( 0 ),
+      shadow_floats( 0 ),
+      largest_shadow( 0 )
+{
+}
+#endif
+
+prepared_path::prepared_path()
+    : left( 0 ),
+      top( 0 ),
+      stroked( false )
+{
+}
+
+hit_test_path::hit_test_path()
+    : scale( 0.0f )
+{
+}
+
+typeface::typeface()
+    : face( 0 )
+{
+}
+
+typeface::typeface(
+    typeface const &that )
+    : face( that.face )
+{
+    if ( face )
+        add_reference( face->references );
+}
+
+typeface &typeface::operator=(
+    typeface const &that )
+{
+    if ( that.face )
+        add_reference( that.face->references );
+    release_face( face );
+    face = that.face;
+    return *this;
+}
+
+typeface::~typeface()
+{
+    release_face( face );
+}
+
+bool typeface::load(
+    unsigned char const *font,
+    int bytes,
+    bool borrow )
+{
+    release_face( face );
+    face = new font_face();
+    face->references = 1;
+    if ( load_face( *face, font, bytes, borrow ) )
+        return true;
+    release_face( face );
+    face = 0;
+    return false;
+}
+
+bool typeface::view(
+    typeface const &that )
+{
+    font_face *viewed = that.face ? view_face( that.face ) : 0;
+    release_face( face );
+    face = viewed;
+    return face != 0;
+}
+
+image_ref::image_ref()
+    : data( 0 )
+{
+}
+
+image_ref::image_ref(
+    image_ref const &that )
+    : data( that.data )
+{
+    if ( data )
+        add_reference( data->references );
+}
+
+image_ref &image_ref::operator=(
+    image_ref const &that )
+{
+    if ( that.data )
+        add_reference( that.data->references );
+    if ( data && drop_reference( data->references ) )
+        delete data;
+    data = that.data;
+    return *this;
+}
+
+image_ref::~image_ref()
+{
+    if ( data && drop_reference( data->references ) )
+        delete data;
+}
+
+shared_image::shared_image()
+    : shared()
+{
+}
+
+// Loading a shared image converts it the same way as loading a pattern,
+// but builds all of its mipmaps right away since they can't be added later
+// without racing with other threads drawing it.
+//
+bool shared_image::load(
+    unsigned char const *image,
+    int width,
+    int height,
+    int stride )
+{
+    shared = image_ref();
+    if ( !image || width <= 0 || height <= 0 )
+        return false;
+    image_data *loaded = new image_data();
+    loaded->texels.reserve( static_cast< size_t >( width ) *
+                            static_cast< size_t >( height ) );
+    for ( int y = 0; y < height; ++y )
+        for ( int x = 0; x < width; ++x )
+            loaded->texels.push_back(
+                encoded_to_color( &image[
+                    static_cast< std::ptrdiff_t >( y ) * stride + x * 4 ] ) );
+    build_levels( &loaded->texels.front(), width, height, loaded->mipmaps );
+    loaded->width = width;
+    loaded->height = height;
+    loaded->references = 1;
+    shared.data = loaded;
+    return true;
+}
+
+display_list::display_list()
+    : calls(),
+      values(),
+      bytes(),
+      fonts(),
+      images(),
+      fields()
+{
+}
+
+void display_list::clear()
+{
+    calls.clear();
+    values.clear();
+    bytes.clear();
+    fonts.clear();
+    images.clear();
+    fields.clear();
+}
+
+canvas::canvas(
+    int width,
+    int height,
+    pixel_format format )
+    : global_composite_operation( source_over ),
+      shadow_offset_x( 0.0f ),
+      shadow_offset_y( 0.0f ),
+      line_cap( butt ),
+      line_join( miter ),
+      line_dash_offset( 0.0f ),
+      text_align( start ),
+      text_baseline( alphabetic ),
+      image_smoothing( bicubic ),
+      size_x( width ),
+      size_y( height ),
+      global_alpha( 1.0f ),
+      shadow_blur( 0.0f ),
+      line_width( 1.0f ),
+      miter_limit( 10.0f ),
+      fill_brush(),
+      stroke_brush(),
+      image_brush(),
+      batch_brush(),
+      clipping( 0 ),
+      face( 0 ),
+      font_scale( 0.0f ),
+      glyph_limit( 1048576 ),
+      bitmap( 0 ),
+      saves(),
+      depth( 0 ),
+      runner( 0 ),
+      band_count( 1 ),
+      storage( format ),
+      packed( 0 ),
+      encoded( 0 ),
+      byte_stride( width * 4 ),
+      external( false ),
+      sample_x(),
+      sample_y(),
+      filtered_stride( 0 ),
+      sample_texels( 0 ),
+      sample_width( 0 ),
+      sample_height( 0 ),
+      recording( 0 ),
+      nesting( 0 ),
+      origin( 0.0f, 0.0f ),
+      dirty_left( 0 ),
+      dirty_top( 0 ),
+      dirty_right( 0 ),
+      dirty_bottom( 0 ),
+      scratch_limit( static_cast< size_t >( -1 ) ),
+      scratch_peak( 0 )
+{
+    initialize();
+}
+
 canvas::canvas(
     int width,
-    int height )
+    int height,
+    unsigned char *image,
+    int stride )
     : global_composite_operation( source_over ),
       shadow_offset_x( 0.0f ),
       shadow_offset_y( 0.0f ),
@@ -2615,6 +5731,7 @@ canvas::canvas(
       line_dash_offset( 0.0f ),
       text_align( start ),
       text_baseline( alphabetic ),
+      image_smoothing( bicubic ),
       size_x( width ),
       size_y( height ),
       global_alpha( 1.0f ),
@@ -2624,33 +5741,85 @@ canvas::canvas(
       fill_brush(),
       stroke_brush(),
       image_brush(),
-      face(),
-      bitmap( new rgba[ width * height ] ),
-      saves( 0 )
+      batch_brush(),
+      clipping( 0 ),
+      face( 0 ),
+      font_scale( 0.0f ),
+      glyph_limit( 1048576 ),
+      bitmap( 0 ),
+      saves(),
+      depth( 0 ),
+      runner( 0 ),
+      band_count( 1 ),
+      storage( srgb_byte ),
+      packed( 0 ),
+      encoded( image ),
+      byte_stride( image ? stride : width * 4 ),
+      external( image != 0 ),
+      sample_x(),
+      sample_y(),
+      filtered_stride( 0 ),
+      sample_texels( 0 ),
+      sample_width( 0 ),
+      sample_height( 0 ),
+      recording( 0 ),
+      nesting( 0 ),
+      origin( 0.0f, 0.0f ),
+      dirty_left( 0 ),
+      dirty_top( 0 ),
+      dirty_right( 0 ),
+      dirty_bottom( 0 ),
+      scratch_limit( static_cast< size_t >( -1 ) ),
+      scratch_peak( 0 )
+{
+    initialize();
+}
+
+// Finish constructing a canvas.  This allocates the pixel buffer for the
+// storage format unless drawing into an external image, and then sets up
+// the initial state that is not in the constructors' initializer lists.
+//
+void canvas::initialize()
 {
+    size_t count = static_cast< size_t >( size_x ) *
+        static_cast< size_t >( size_y );
+    if ( storage == linear_float )
+        bitmap = new rgba[ count ];
+    else if ( storage != srgb_byte )
+        packed = new unsigned short[ count * 4 ]();
+    else if ( !external )
+        encoded = new unsigned char[ count * 4 ]();
     affine_matrix identity = { 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f };
     forward = identity;
     inverse = identity;
     set_color( fill_style, 0.0f, 0.0f, 0.0f, 1.0f );
     set_color( stroke_style, 0.0f, 0.0f, 0.0f, 1.0f );
-    for ( unsigned short y = 0; y < size_y; ++y )
+    clipping = new clip_mask();
+    clipping->references = 1;
+    for ( run_coordinate y = 0; y < size_y; ++y )
     {
         pixel_run piece_1 = { 0, y, 1.0f };
-        pixel_run piece_2 = { static_cast< unsigned short >( size_x ), y,
+        pixel_run piece_2 = { to_run( size_x ), y,
                               -1.0f };
-        mask.push_back( piece_1 );
-        mask.push_back( piece_2 );
+        clipping->runs.push_back( piece_1 );
+        clipping->runs.push_back( piece_2 );
     }
 }
 
 canvas::~canvas()
 {
     delete[] bitmap;
-    while ( canvas *head = saves )
+    delete[] packed;
+    if ( !external )
+        delete[] encoded;
+    if ( !--clipping->references )
+        delete clipping;
+    release_face( face );
+    for ( size_t index = 0; index < depth; ++index )
     {
-        saves = head->saves;
-        head->saves = 0;
-        delete head;
+        if ( !--saves[ index ].clipping->references )
+            delete saves[ index ].clipping;
+        release_face( saves[ index ].face );
     }
 }
 
@@ -2658,12 +5827,18 @@ void canvas::scale(
     float x,
     float y )
 {
+    if ( recording )
+        note( scale_call, 2, x, y );
+    call_nesting nested( nesting );
     transform( x, 0.0f, 0.0f, y, 0.0f, 0.0f );
 }
 
 void canvas::rotate(
     float angle )
 {
+    if ( recording )
+        note( rotate_call, 1, angle );
+    call_nesting nested( nesting );
     float cosine = cosf( angle );
     float sine = sinf( angle );
     transform( cosine, sine, -sine, cosine, 0.0f, 0.0f );
@@ -2673,6 +5848,9 @@ void canvas::translate(
     float x,
     float y )
 {
+    if ( recording )
+        note( translate_call, 2, x, y );
+    call_nesting nested( nesting );
     transform( 1.0f, 0.0f, 0.0f, 1.0f, x, y );
 }
 
@@ -2684,6 +5862,9 @@ void canvas::transform(
     float e,
     float f )
 {
+    if ( recording )
+        note( transform_call, 6, a, b, c, d, e, f );
+    call_nesting nested( nesting );
     set_transform( forward.a * a + forward.c * b,
                    forward.b * a + forward.d * b,
                    forward.a * c + forward.c * d,
@@ -2700,6 +5881,8 @@ void canvas::set_transform(
     float e,
     float f )
 {
+    if ( recording )
+        note( set_transform_call, 6, a, b, c, d, e, f );
     float determinant = a * d - b * c;
     float scaling = determinant != 0.0f ? 1.0f / determinant : 0.0f;
     affine_matrix new_forward = { a, b, c, d, e, f };
@@ -2713,6 +5896,8 @@ void canvas::set_transform(
 void canvas::set_global_alpha(
     float alpha )
 {
+    if ( recording )
+        note( set_global_alpha_call, 1, alpha );
     if ( 0.0f <= alpha && alpha <= 1.0f )
         global_alpha = alpha;
 }
@@ -2723,6 +5908,8 @@ void canvas::set_shadow_color(
     float blue,
     float alpha )
 {
+    if ( recording )
+        note( set_shadow_color_call, 4, red, green, blue, alpha );
     shadow_color = premultiplied( linearized( clamped(
         rgba( red, green, blue, alpha ) ) ) );
 }
@@ -2730,6 +5917,8 @@ void canvas::set_shadow_color(
 void canvas::set_shadow_blur(
     float level )
 {
+    if ( recording )
+        note( set_shadow_blur_call, 1, level );
     if ( 0.0f <= level )
         shadow_blur = level;
 }
@@ -2737,6 +5926,8 @@ void canvas::set_shadow_blur(
 void canvas::set_line_width(
     float width )
 {
+    if ( recording )
+        note( set_line_width_call, 1, width );
     if ( 0.0f < width )
         line_width = width;
 }
@@ -2744,6 +5935,8 @@ void canvas::set_line_width(
 void canvas::set_miter_limit(
     float limit )
 {
+    if ( recording )
+        note( set_miter_limit_call, 1, limit );
     if ( 0.0f < limit )
         miter_limit = limit;
 }
@@ -2755,6 +5948,17 @@ void canvas::set_line_dash(
     for ( int index = 0; index < count; ++index )
         if ( segments && segments[ index ] < 0.0f )
             return;
+    if ( recording )
+    {
+        int noted = segments ? std::max( count, 0 ) : 0;
+        note( set_line_dash_call, 1, static_cast< float >( noted ) );
+        note_values( segments, noted );
+    }
+    if ( depth && !saves[ depth - 1 ].dash_owned )
+    {
+        line_dash.swap( saves[ depth - 1 ].line_dash );
+        saves[ depth - 1 ].dash_owned = true;
+    }
     line_dash.clear();
     if ( !segments )
         return;
@@ -2772,9 +5976,14 @@ void canvas::set_color(
     float blue,
     float alpha )
 {
-    paint_brush &brush = type == fill_style ? fill_brush : stroke_brush;
+    if ( recording )
+        note( set_color_call, 5, static_cast< float >( type ),
+              red, green, blue, alpha );
+    paint_brush &brush = changing_brush( type, true );
     brush.type = paint_brush::color;
     brush.colors.clear();
+    brush.mipmaps.clear();
+    brush.image = image_ref();
     brush.colors.push_back( premultiplied( linearized( clamped(
         rgba( red, green, blue, alpha ) ) ) ) );
 }
@@ -2786,10 +5995,15 @@ void canvas::set_linear_gradient(
     float end_x,
     float end_y )
 {
-    paint_brush &brush = type == fill_style ? fill_brush : stroke_brush;
+    if ( recording )
+        note( set_linear_gradient_call, 5, static_cast< float >( type ),
+              start_x, start_y, end_x, end_y );
+    paint_brush &brush = changing_brush( type, true );
     brush.type = paint_brush::linear;
     brush.colors.clear();
     brush.stops.clear();
+    brush.mipmaps.clear();
+    brush.image = image_ref();
     brush.start = xy( start_x, start_y );
     brush.end = xy( end_x, end_y );
 }
@@ -2803,12 +6017,17 @@ void canvas::set_radial_gradient(
     float end_y,
     float end_radius )
 {
+    if ( recording )
+        note( set_radial_gradient_call, 7, static_cast< float >( type ),
+              start_x, start_y, start_radius, end_x, end_y, end_radius );
     if ( start_radius < 0.0f || end_radius < 0.0f )
         return;
-    paint_brush &brush = type == fill_style ? fill_brush : stroke_brush;
+    paint_brush &brush = changing_brush( type, true );
     brush.type = paint_brush::radial;
     brush.colors.clear();
     brush.stops.clear();
+    brush.mipmaps.clear();
+    brush.image = image_ref();
     brush.start = xy( start_x, start_y );
     brush.end = xy( end_x, end_y );
     brush.start_radius = start_radius;
@@ -2823,11 +6042,16 @@ void canvas::add_color_stop(
     float blue,
     float alpha )
 {
-    paint_brush &brush = type == fill_style ? fill_brush : stroke_brush;
-    if ( ( brush.type != paint_brush::linear &&
-           brush.type != paint_brush::radial ) ||
+    if ( recording )
+        note( add_color_stop_call, 6, static_cast< float >( type ),
+              offset, red, green, blue, alpha );
+    paint_brush const &current = type == fill_style ? fill_brush :
+        stroke_brush;
+    if ( ( current.type != paint_brush::linear &&
+           current.type != paint_brush::radial ) ||
          offset < 0.0f || 1.0f < offset )
         return;
+    paint_brush &brush = changing_brush( type, false );
     ptrdiff_t index = std::upper_bound(
         brush.stops.begin(), brush.stops.end(), offset ) -
         brush.stops.begin();
@@ -2846,33 +6070,93 @@ void canvas::set_pattern(
 {
     if ( !image || width <= 0 || height <= 0 )
         return;
-    paint_brush &brush = type == fill_style ? fill_brush : stroke_brush;
+    if ( recording )
+    {
+        note( set_pattern_call, 4, static_cast< float >( type ),
+              static_cast< float >( width ), static_cast< float >( height ),
+              static_cast< float >( repetition ) );
+        note_image( image, width, height, stride );
+    }
+    load_pattern( changing_brush( type, true ),
+                  image, width, height, stride, repetition );
+}
+
+void canvas::set_pattern(
+    brush_type type,
+    shared_image const &image,
+    repetition_style repetition )
+{
+    if ( !image.shared.data )
+        return;
+    if ( recording )
+    {
+        note( set_shared_pattern_call, 2, static_cast< float >( type ),
+              static_cast< float >( repetition ) );
+        note_shared( image );
+    }
+    share_pattern( changing_brush( type, true ), image.shared, repetition );
+}
+
+// Set up a brush with the pattern from an image.  This is shared between
+// setting a pattern as the fill or stroke style and drawing an image, where
+// the latter uses a separate brush that it keeps aside from the others.
+//
+void canvas::load_pattern(
+    paint_brush &brush,
+    unsigned char const *image,
+    int width,
+    int height,
+    int stride,
+    repetition_style repetition )
+{
     brush.type = paint_brush::pattern;
     brush.colors.clear();
+    brush.colors.reserve( static_cast< size_t >( width ) *
+                          static_cast< size_t >( height ) );
     for ( int y = 0; y < height; ++y )
         for ( int x = 0; x < width; ++x )
-        {
-            int index = y * stride + x * 4;
-            rgba color = rgba(
-                image[ index + 0 ] / 255.0f, image[ index + 1 ] / 255.0f,
-                image[ index + 2 ] / 255.0f, image[ index + 3 ] / 255.0f );
-            brush.colors.push_back( premultiplied( linearized( color ) ) );
-        }
+            brush.colors.push_back(
+                encoded_to_color( &image[
+                    static_cast< std::ptrdiff_t >( y ) * stride + x * 4 ] ) );
     brush.width = width;
     brush.height = height;
     brush.repetition = repetition;
+    brush.mipmaps.clear();
+    brush.image = image_ref();
+}
+
+// Set up a brush to refer to a shared image rather than its own copy.  The
+// brush's own texels and mipmaps are emptied so that it reads the image's.
+//
+void canvas::share_pattern(
+    paint_brush &brush,
+    image_ref const &image,
+    repetition_style repetition )
+{
+    brush.type = paint_brush::pattern;
+    brush.colors.clear();
+    brush.width = image.data->width;
+    brush.height = image.data->height;
+    brush.repetition = repetition;
+    brush.mipmaps.clear();
+    brush.image = image;
 }
 
 void canvas::begin_path()
 {
+    if ( recording )
+        note( begin_path_call );
     path.points.clear();
     path.subpaths.clear();
+    path.arcs.clear();
 }
 
 void canvas::move_to(
     float x,
     float y )
 {
+    if ( recording )
+        note( move_to_call, 2, x, y );
     if ( !path.subpaths.empty() && path.subpaths.back().count == 1 )
     {
         path.points.back() = forward * xy( x, y );
@@ -2885,6 +6169,9 @@ void canvas::move_to(
 
 void canvas::close_path()
 {
+    if ( recording )
+        note( close_path_call );
+    call_nesting nested( nesting );
     if ( path.subpaths.empty() )
         return;
     xy first = path.points[ path.points.size() - path.subpaths.back().count ];
@@ -2901,6 +6188,9 @@ void canvas::line_to(
     float x,
     float y )
 {
+    if ( recording )
+        note( line_to_call, 2, x, y );
+    call_nesting nested( nesting );
     if ( path.subpaths.empty() )
     {
         move_to( x, y );
@@ -2922,6 +6212,9 @@ void canvas::quadratic_curve_to(
     float x,
     float y )
 {
+    if ( recording )
+        note( quadratic_curve_to_call, 4, control_x, control_y, x, y );
+    call_nesting nested( nesting );
     if ( path.subpaths.empty() )
         move_to( control_x, control_y );
     xy point_1 = path.points.back();
@@ -2943,6 +6236,10 @@ void canvas::bezier_curve_to(
     float x,
     float y )
 {
+    if ( recording )
+        note( bezier_curve_to_call, 6, control_1_x, control_1_y,
+              control_2_x, control_2_y, x, y );
+    call_nesting nested( nesting );
     if ( path.subpaths.empty() )
         move_to( control_1_x, control_1_y );
     xy control_1 = forward * xy( control_1_x, control_1_y );
@@ -2961,6 +6258,9 @@ void canvas::arc_to(
     float y,
     float radius )
 {
+    if ( recording )
+        note( arc_to_call, 5, vertex_x, vertex_y, x, y, radius );
+    call_nesting nested( nesting );
     if ( radius < 0.0f ||
          forward.a * forward.d - forward.b * forward.c == 0.0f )
         return;
@@ -2995,6 +6295,10 @@ void canvas::arc(
     float end_angle,
     bool counter_clockwise )
 {
+    if ( recording )
+        note( arc_call, 6, x, y, radius, start_angle, end_angle,
+              counter_clockwise ? 1.0f : 0.0f );
+    call_nesting nested( nesting );
     if ( radius < 0.0f )
         return;
     static float const tau = 6.28318531f;
@@ -3013,6 +6317,8 @@ void canvas::arc(
         std::max( 1.0f, roundf( 16.0f / tau * span * winding ) ) );
     float segment = span / static_cast< float >( steps );
     float alpha = 4.0f / 3.0f * tanf( 0.25f * segment );
+    arc_data entry = { path.points.size(), 0, forward,
+                       xy( x, y ), centered_1, span };
     for ( int step = 0; step < steps; ++step )
     {
         float angle = from + static_cast< float >( step + 1 ) * segment;
@@ -3026,6 +6332,8 @@ void canvas::arc(
                          point_2.x, point_2.y );
         centered_1 = centered_2;
     }
+    entry.last = path.points.size();
+    path.arcs.push_back( entry );
 }
 
 void canvas::rectangle(
@@ -3034,6 +6342,9 @@ void canvas::rectangle(
     float width,
     float height )
 {
+    if ( recording )
+        note( rectangle_call, 4, x, y, width, height );
+    call_nesting nested( nesting );
     move_to( x, y );
     line_to( x + width, y );
     line_to( x + width, y + height );
@@ -3043,12 +6354,16 @@ void canvas::rectangle(
 
 void canvas::fill()
 {
+    if ( recording )
+        note( fill_call );
     path_to_lines( false );
     render_main( fill_brush );
 }
 
 void canvas::stroke()
 {
+    if ( recording )
+        note( stroke_call );
     path_to_lines( true );
     stroke_lines();
     render_main( stroke_brush );
@@ -3056,10 +6371,19 @@ void canvas::stroke()
 
 void canvas::clip()
 {
+    if ( recording )
+        note( clip_call );
     path_to_lines( false );
-    lines_to_runs( xy( 0.0f, 0.0f ), 0 );
+    lines_to_runs( xy() - origin, size_x, size_y );
     size_t part = runs.size();
-    runs.insert( runs.end(), mask.begin(), mask.end() );
+    runs.insert( runs.end(), clipping->runs.begin(), clipping->runs.end() );
+    if ( clipping->references > 1 )
+    {
+        --clipping->references;
+        clipping = new clip_mask();
+        clipping->references = 1;
+    }
+    pixel_runs &mask = clipping->runs;
     mask.clear();
     int y = -1;
     float last = 0.0f;
@@ -3096,39 +6420,287 @@ void canvas::clip()
         }
         last = visibility;
     }
+    trim_scratch();
+}
+
+// Find the band of a hit test edge index that holds a vertical offset from
+// the top of the bounds.  This clamps in floating point before converting,
+// so that the offsets from points at infinity or that are NaN still land
+// in a valid band rather than overflowing the conversion.
+//
+static size_t hit_band(
+    float offset,
+    float scale,
+    size_t bands )
+{
+    return static_cast< size_t >( std::max( 0.0f, std::min(
+        offset * scale, static_cast< float >( bands - 1 ) ) ) );
+}
+
+// Accumulate the winding of one edge around a point, using a half-open
+// test on the vertical extent so that each crossing counts exactly once
+// where edges meet.  This reports whether the point lies exactly on the
+// edge, in which case the point counts as inside regardless of winding.
+//
+static bool edge_winding(
+    xy from,
+    xy to,
+    float x,
+    float y,
+    int &winding )
+{
+    if ( ( from.y < y && y <= to.y ) || ( to.y < y && y <= from.y ) )
+    {
+        float side = dot( perpendicular( to - from ), xy( x, y ) - from );
+        if ( side == 0.0f )
+            return true;
+        winding += side > 0.0f ? 1 : -1;
+    }
+    else if ( from.y == y && y == to.y &&
+              ( ( from.x <= x && x <= to.x ) ||
+                ( to.x <= x && x <= from.x ) ) )
+        return true;
+    return false;
+}
+
+bool canvas::is_point_in_path(
+    float x,
+    float y )
+{
+    path_to_lines( false );
+    int winding = 0;
+    size_t subpath = 0;
+    size_t beginning = 0;
+    size_t ending = 0;
+    for ( size_t index = 0; index < lines.points.size(); ++index )
+    {
+        while ( index >= ending )
+        {
+            beginning = ending;
+            ending += lines.subpaths[ subpath++ ].count;
+        }
+        xy from = lines.points[ index ];
+        xy to = lines.points[ index + 1 < ending ? index + 1 : beginning ];
+        if ( edge_winding( from, to, x, y, winding ) )
+            return true;
+    }
+    return winding;
+}
+
+// The edges are bucketed into horizontal bands spanning the bounding box,
+// with each edge listed in every band that its vertical extent touches,
+// as a counting sort.  Since a point can only be affected by an edge whose
+// extent includes it, testing needs only the edges in its own band.  There
+// is about one band per edge, unless the edges are so tall that listing
+// them would take more than a few entries per edge on average, in which
+// case it uses fewer bands.
+//
+void canvas::prepare_hit_test(
+    hit_test_path &prepared )
+{
+    path_to_lines( false );
+    prepared.edges.clear();
+    prepared.starts.clear();
+    prepared.entries.clear();
+    prepared.scale = 0.0f;
+    if ( lines.points.empty() )
+        return;
+    xy low = lines.points.front();
+    xy high = low;
+    size_t ending = 0;
+    for ( size_t subpath = 0; subpath < lines.subpaths.size(); ++subpath )
+    {
+        size_t beginning = ending;
+        ending += lines.subpaths[ subpath ].count;
+        for ( size_t index = beginning; index < ending; ++index )
+        {
+            xy point = lines.points[ index ];
+            low = xy( std::min( low.x, point.x ),
+                      std::min( low.y, point.y ) );
+            high = xy( std::max( high.x, point.x ),
+                       std::max( high.y, point.y ) );
+            prepared.edges.push_back( point );
+            prepared.edges.push_back(
+                lines.points[ index + 1 < ending ? index + 1 : beginning ] );
+        }
+    }
+    size_t count = prepared.edges.size() / 2;
+    float height = high.y - low.y;
+    float extent = 0.0f;
+    for ( size_t edge = 0; edge < count; ++edge )
+        extent += fabsf( prepared.edges[ edge * 2 + 1 ].y -
+                        prepared.edges[ edge * 2 + 0 ].y );
+    float limit = std::min( static_cast< float >( count ), 65536.0f );
+    if ( !( height > 0.0f ) )
+        limit = 1.0f;
+    else if ( extent > 4.0f * height )
+        limit = std::min( limit, 4.0f * height *
+                                     static_cast< float >( count ) / extent );
+    size_t bands = static_cast< size_t >( std::max( limit, 1.0f ) );
+    prepared.low = low;
+    prepared.high = high;
+    prepared.scale = height > 0.0f ?
+        static_cast< float >( bands ) / height : 0.0f;
+    prepared.starts.assign( bands + 1, 0 );
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        for ( size_t edge = 0; edge < count; ++edge )
+        {
+            xy from = prepared.edges[ edge * 2 + 0 ];
+            xy to = prepared.edges[ edge * 2 + 1 ];
+            size_t first = hit_band( std::min( from.y, to.y ) - low.y,
+                                     prepared.scale, bands );
+            size_t last = hit_band( std::max( from.y, to.y ) - low.y,
+                                    prepared.scale, bands );
+            for ( size_t band = first; band <= last; ++band )
+                if ( pass )
+                    prepared.entries[ rows[ band ]++ ] = edge;
+                else
+                    ++prepared.starts[ band + 1 ];
+        }
+        if ( pass )
+            break;
+        std::partial_sum( prepared.starts.begin(), prepared.starts.end(),
+                          prepared.starts.begin() );
+        prepared.entries.resize( prepared.starts.back() );
+        rows.assign( prepared.starts.begin(), prepared.starts.end() - 1 );
+    }
+}
+
+bool canvas::is_point_in_prepared(
+    hit_test_path const &prepared,
+    float x,
+    float y )
+{
+    if ( prepared.starts.empty() ||
+         !( prepared.low.x <= x && x <= prepared.high.x &&
+            prepared.low.y <= y && y <= prepared.high.y ) )
+        return false;
+    size_t bands = prepared.starts.size() - 1;
+    size_t band = hit_band( y - prepared.low.y, prepared.scale, bands );
+    int winding = 0;
+    for ( size_t index = prepared.starts[ band ];
+          index < prepared.starts[ band + 1 ]; ++index )
+    {
+        size_t edge = prepared.entries[ index ];
+        if ( edge_winding( prepared.edges[ edge * 2 + 0 ],
+                           prepared.edges[ edge * 2 + 1 ],
+                           x, y, winding ) )
+            return true;
+    }
+    return winding;
+}
+
+void canvas::are_points_in_prepared(
+    hit_test_path const &prepared,
+    float const *points,
+    int count,
+    bool *inside )
+{
+    for ( int index = 0; index < count; ++index )
+        inside[ index ] = is_point_in_prepared(
+            prepared, points[ index * 2 + 0 ], points[ index * 2 + 1 ] );
+}
+
+void canvas::prepare_fill(
+    prepared_path &prepared )
+{
+    path_to_lines( false );
+    prepare_lines( prepared, false );
+}
+
+void canvas::prepare_stroke(
+    prepared_path &prepared )
+{
+    path_to_lines( true );
+    stroke_lines();
+    prepare_lines( prepared, true );
+}
+
+void canvas::draw_prepared(
+    prepared_path const &prepared,
+    int x,
+    int y )
+{
+    if ( forward.a * forward.d - forward.b * forward.c == 0.0f )
+        return;
+    paint_brush &brush = prepared.stroked ? stroke_brush : fill_brush;
+    xy shift = xy( static_cast< float >( x ), static_cast< float >( y ) );
+    lines.subpaths = prepared.lines.subpaths;
+    lines.points.clear();
+    for ( size_t index = 0; index < prepared.lines.points.size(); ++index )
+        lines.points.push_back( prepared.lines.points[ index ] + shift );
+    build_mipmaps( brush );
+    render_shadow( brush );
+    runs.clear();
+    int left = prepared.left + x;
+    int top = prepared.top + y;
+    for ( size_t index = 0; index < prepared.runs.size(); ++index )
+    {
+        pixel_run run = prepared.runs[ index ];
+        int run_y = run.y + top;
+        if ( run_y < 0 || size_y <= run_y )
+            continue;
+        int run_x = std::min( std::max( run.x + left, 0 ), size_x );
+        run.x = to_run( run_x );
+        run.y = to_run( run_y );
+        runs.push_back( run );
+    }
+    render_runs( brush );
+    trim_scratch();
 }
 
-bool canvas::is_point_in_path(
-    float x,
-    float y )
+// Each copy is shifted from a saved copy of the tessellated polylines, so
+// the shifts never accumulate rounding error.  Copies whose bounds miss the
+// canvas (or the tile when replaying) are culled before scan conversion.
+// The rest still go through the shadow, scan conversion, and compositing
+// one at a time so that they overlap each other in order, as separate
+// fills would.  Each copy is bracketed as a render_main stage, just like
+// the rendering for a fill, so the stage hooks see the same calls.
+//
+void canvas::fill_batch(
+    float const *offsets,
+    float const *colors,
+    int count )
 {
+    if ( !offsets || count <= 0 )
+        return;
+    if ( recording )
+    {
+        note( fill_batch_call, 2, static_cast< float >( count ),
+              colors ? 1.0f : 0.0f );
+        note_values( offsets, count * 2 );
+        if ( colors )
+            note_values( colors, count * 4 );
+    }
+    if ( forward.a * forward.d - forward.b * forward.c == 0.0f )
+        return;
     path_to_lines( false );
-    int winding = 0;
-    size_t subpath = 0;
-    size_t beginning = 0;
-    size_t ending = 0;
-    for ( size_t index = 0; index < lines.points.size(); ++index )
+    batch_brush.type = paint_brush::color;
+    batch_brush.colors.resize( 1 );
+    paint_brush &brush = colors ? batch_brush : fill_brush;
+    build_mipmaps( brush );
+    batch_points = lines.points;
+    for ( int copy = 0; copy < count; ++copy )
     {
-        while ( index >= ending )
-        {
-            beginning = ending;
-            ending += lines.subpaths[ subpath++ ].count;
-        }
-        xy from = lines.points[ index ];
-        xy to = lines.points[ index + 1 < ending ? index + 1 : beginning ];
-        if ( ( from.y < y && y <= to.y ) || ( to.y < y && y <= from.y ) )
-        {
-            float side = dot( perpendicular( to - from ), xy( x, y ) - from );
-            if ( side == 0.0f )
-                return true;
-            winding += side > 0.0f ? 1 : -1;
-        }
-        else if ( from.y == y && y == to.y &&
-                  ( ( from.x <= x && x <= to.x ) ||
-                    ( to.x <= x && x <= from.x ) ) )
-            return true;
+        float x = offsets[ copy * 2 + 0 ];
+        float y = offsets[ copy * 2 + 1 ];
+        xy shift = xy( forward.a * x + forward.c * y,
+                       forward.b * x + forward.d * y );
+        for ( size_t index = 0; index < batch_points.size(); ++index )
+            lines.points[ index ] = batch_points[ index ] + shift;
+        stage_scope scope( "render_main" );
+        if ( !lines_visible() )
+            continue;
+        if ( colors )
+            batch_brush.colors.front() = premultiplied( linearized( clamped(
+                rgba( colors[ copy * 4 + 0 ], colors[ copy * 4 + 1 ],
+                      colors[ copy * 4 + 2 ], colors[ copy * 4 + 3 ] ) ) ) );
+        render_shadow( brush );
+        lines_to_runs( xy() - origin, size_x, size_y );
+        render_runs( brush );
     }
-    return winding;
+    trim_scratch();
 }
 
 void canvas::clear_rectangle(
@@ -3137,6 +6709,9 @@ void canvas::clear_rectangle(
     float width,
     float height )
 {
+    if ( recording )
+        note( clear_rectangle_call, 4, x, y, width, height );
+    call_nesting nested( nesting );
     composite_operation saved_operation = global_composite_operation;
     float saved_global_alpha = global_alpha;
     float saved_alpha = shadow_color.a;
@@ -3158,6 +6733,8 @@ void canvas::fill_rectangle(
     float width,
     float height )
 {
+    if ( recording )
+        note( fill_rectangle_call, 4, x, y, width, height );
     if ( width == 0.0f || height == 0.0f )
         return;
     lines.points.clear();
@@ -3177,6 +6754,8 @@ void canvas::stroke_rectangle(
     float width,
     float height )
 {
+    if ( recording )
+        note( stroke_rectangle_call, 4, x, y, width, height );
     if ( width == 0.0f && height == 0.0f )
         return;
     lines.points.clear();
@@ -3209,76 +6788,61 @@ bool canvas::set_font(
 {
     if ( font && bytes )
     {
-        face.data.clear();
-        face.cmap = 0;
-        face.glyf = 0;
-        face.head = 0;
-        face.hhea = 0;
-        face.hmtx = 0;
-        face.loca = 0;
-        face.maxp = 0;
-        face.os_2 = 0;
-        if ( bytes < 6 )
-            return false;
-        int version = ( font[ 0 ] << 24 | font[ 1 ] << 16 |
-                        font[ 2 ] <<  8 | font[ 3 ] <<  0 );
-        int tables = font[ 4 ] << 8 | font[ 5 ];
-        if ( ( version != 0x00010000 && version != 0x74727565 ) ||
-             bytes < tables * 16 + 12 )
-            return false;
-        face.data.insert( face.data.end(), font, font + tables * 16 + 12 );
-        for ( int index = 0; index < tables; ++index )
-        {
-            int tag = signed_32( face.data, index * 16 + 12 );
-            int offset = signed_32( face.data, index * 16 + 20 );
-            int span = signed_32( face.data, index * 16 + 24 );
-            if ( bytes < offset + span )
-            {
-                face.data.clear();
-                return false;
-            }
-            int place = static_cast< int >( face.data.size() );
-            if ( tag == 0x636d6170 )
-                face.cmap = place;
-            else if ( tag == 0x676c7966 )
-                face.glyf = place;
-            else if ( tag == 0x68656164 )
-                face.head = place;
-            else if ( tag == 0x68686561 )
-                face.hhea = place;
-            else if ( tag == 0x686d7478 )
-                face.hmtx = place;
-            else if ( tag == 0x6c6f6361 )
-                face.loca = place;
-            else if ( tag == 0x6d617870 )
-                face.maxp = place;
-            else if ( tag == 0x4f532f32 )
-                face.os_2 = place;
-            else
-                continue;
-            face.data.insert(
-                face.data.end(), font + offset, font + offset + span );
-        }
-        if ( !face.cmap || !face.glyf || !face.head || !face.hhea ||
-             !face.hmtx || !face.loca || !face.maxp || !face.os_2 )
-        {
-            face.data.clear();
-            return false;
-        }
+        typeface loaded;
+        loaded.load( font, bytes );
+        return set_font( loaded, size );
+    }
+    if ( recording )
+        note( set_font_size_call, 1, size );
+    if ( !face )
+        return false;
+    int units_per_em = unsigned_16( face->bytes, face->head + 18 );
+    font_scale = size / static_cast< float >( units_per_em );
+    return true;
+}
+
+bool canvas::set_font(
+    typeface const &font,
+    float size )
+{
+    if ( recording )
+    {
+        note( set_font_call, 1, size );
+        note_font( font );
     }
-    if ( face.data.empty() )
+    if ( font.face )
+        add_reference( font.face->references );
+    release_face( face );
+    face = font.face;
+    if ( !face )
         return false;
-    int units_per_em = unsigned_16( face.data, face.head + 18 );
-    face.scale = size / static_cast< float >( units_per_em );
+    int units_per_em = unsigned_16( face->bytes, face->head + 18 );
+    font_scale = size / static_cast< float >( units_per_em );
     return true;
 }
 
+void canvas::set_glyph_cache(
+    int bytes )
+{
+    if ( bytes < 0 )
+        return;
+    glyph_limit = static_cast< size_t >( bytes );
+    if ( face )
+        trim_glyphs( glyph_limit );
+}
+
 void canvas::fill_text(
     char const *text,
     float x,
     float y,
     float maximum_width )
 {
+    if ( recording )
+    {
+        note( fill_text_call, 4, x, y, maximum_width, text ? 1.0f : 0.0f );
+        note_text( text );
+    }
+    call_nesting nested( nesting );
     text_to_lines( text, xy( x, y ), maximum_width, false );
     render_main( fill_brush );
 }
@@ -3289,6 +6853,12 @@ void canvas::stroke_text(
     float y,
     float maximum_width )
 {
+    if ( recording )
+    {
+        note( stroke_text_call, 4, x, y, maximum_width, text ? 1.0f : 0.0f );
+        note_text( text );
+    }
+    call_nesting nested( nesting );
     text_to_lines( text, xy( x, y ), maximum_width, true );
     stroke_lines();
     render_main( stroke_brush );
@@ -3297,17 +6867,17 @@ void canvas::stroke_text(
 float canvas::measure_text(
     char const *text )
 {
-    if ( face.data.empty() || !text )
+    if ( !face || !text )
         return 0.0f;
-    int hmetrics = unsigned_16( face.data, face.hhea + 34 );
+    int hmetrics = unsigned_16( face->bytes, face->hhea + 34 );
     int width = 0;
     for ( int index = 0; text[ index ]; )
     {
         int glyph = character_to_glyph( text, index );
         int entry = std::min( glyph, hmetrics - 1 );
-        width += unsigned_16( face.data, face.hmtx + entry * 4 );
+        width += unsigned_16( face->bytes, face->hmtx + entry * 4 );
     }
-    return static_cast< float >( width ) * face.scale;
+    return static_cast< float >( width ) * font_scale;
 }
 
 void canvas::draw_image(
@@ -3323,9 +6893,47 @@ void canvas::draw_image(
     if ( !image || width <= 0 || height <= 0 ||
          to_width == 0.0f || to_height == 0.0f )
         return;
-    std::swap( fill_brush, image_brush );
-    set_pattern( fill_style, image, width, height, stride, repeat );
-    std::swap( fill_brush, image_brush );
+    if ( recording )
+    {
+        note( draw_image_call, 6, static_cast< float >( width ),
+              static_cast< float >( height ), x, y, to_width, to_height );
+        note_image( image, width, height, stride );
+    }
+    load_pattern( image_brush, image, width, height, stride, repeat );
+    draw_pattern( x, y, to_width, to_height );
+}
+
+void canvas::draw_image(
+    shared_image const &image,
+    float x,
+    float y,
+    float to_width,
+    float to_height )
+{
+    if ( !image.shared.data || to_width == 0.0f || to_height == 0.0f )
+        return;
+    if ( recording )
+    {
+        note( draw_shared_image_call, 4, x, y, to_width, to_height );
+        note_shared( image );
+    }
+    share_pattern( image_brush, image.shared, repeat );
+    draw_pattern( x, y, to_width, to_height );
+    image_brush.image = image_ref();
+}
+
+// Draw the image brush's pattern scaled to fill a rectangle.  This is the
+// common part of drawing images, whether copied or shared.
+//
+void canvas::draw_pattern(
+    float x,
+    float y,
+    float to_width,
+    float to_height )
+{
+    call_nesting nested( nesting );
+    int width = image_brush.width;
+    int height = image_brush.height;
     lines.points.clear();
     lines.subpaths.clear();
     lines.points.push_back( forward * xy( x, y ) );
@@ -3355,29 +6963,37 @@ void canvas::get_image_data(
 {
     if ( !image )
         return;
-    static float const bayer[][ 4 ] = {
-        { 0.03125f, 0.53125f, 0.15625f, 0.65625f },
-        { 0.78125f, 0.28125f, 0.90625f, 0.40625f },
-        { 0.21875f, 0.71875f, 0.09375f, 0.59375f },
-        { 0.96875f, 0.46875f, 0.84375f, 0.34375f } };
     for ( int image_y = 0; image_y < height; ++image_y )
+    {
+        int row = image_y * stride;
+        int canvas_y = y + image_y;
+        bool inside = 0 <= canvas_y && canvas_y < size_y;
+        int begin = inside ? std::min( std::max( -x, 0 ), width ) : width;
+        int end = inside ? std::max( std::min( size_x - x, width ), begin ) :
+            width;
         for ( int image_x = 0; image_x < width; ++image_x )
-        {
-            int index = image_y * stride + image_x * 4;
-            int canvas_x = x + image_x;
-            int canvas_y = y + image_y;
-            rgba color = rgba( 0.0f, 0.0f, 0.0f, 0.0f );
-            if ( 0 <= canvas_x && canvas_x < size_x &&
-                 0 <= canvas_y && canvas_y < size_y )
-                color = bitmap[ canvas_y * size_x + canvas_x ];
-            float threshold = bayer[ canvas_y & 3 ][ canvas_x & 3 ];
-            color = rgba( threshold, threshold, threshold, threshold ) +
-                255.0f * delinearized( clamped( unpremultiplied( color ) ) );
-            image[ index + 0 ] = static_cast< unsigned char >( color.r );
-            image[ index + 1 ] = static_cast< unsigned char >( color.g );
-            image[ index + 2 ] = static_cast< unsigned char >( color.b );
-            image[ index + 3 ] = static_cast< unsigned char >( color.a );
-        }
+            if ( image_x < begin || end <= image_x )
+                for ( int channel = 0; channel < 4; ++channel )
+                    image[ row + image_x * 4 + channel ] = 0;
+        if ( begin == end )
+            continue;
+        if ( storage == srgb_byte )
+            std::memmove( &image[ row + begin * 4 ],
+                          &encoded[ static_cast< std::ptrdiff_t >(
+                                        canvas_y ) * byte_stride +
+                                    ( x + begin ) * 4 ],
+                          static_cast< size_t >( end - begin ) * 4 );
+        else
+            for ( int image_x = begin; image_x < end; ++image_x )
+            {
+                int canvas_x = x + image_x;
+                float threshold = dither_threshold(
+                    canvas_x + static_cast< int >( origin.x ),
+                    canvas_y + static_cast< int >( origin.y ) );
+                color_to_encoded( load_pixel( canvas_x, canvas_y ),
+                                  threshold, &image[ row + image_x * 4 ] );
+            }
+    }
 }
 
 void canvas::put_image_data(
@@ -3390,78 +7006,725 @@ void canvas::put_image_data(
 {
     if ( !image )
         return;
+    if ( recording && 0 < width && 0 < height )
+    {
+        note( put_image_data_call, 4, static_cast< float >( width ),
+              static_cast< float >( height ), static_cast< float >( x ),
+              static_cast< float >( y ) );
+        note_image( image, width, height, stride );
+    }
+    if ( 0 < width && 0 < height )
+        mark_dirty( x, y, x + width, y + height );
     for ( int image_y = 0; image_y < height; ++image_y )
-        for ( int image_x = 0; image_x < width; ++image_x )
-        {
-            int index = image_y * stride + image_x * 4;
-            int canvas_x = x + image_x;
-            int canvas_y = y + image_y;
-            if ( canvas_x < 0 || size_x <= canvas_x ||
-                 canvas_y < 0 || size_y <= canvas_y )
-                continue;
-            rgba color = rgba(
-                image[ index + 0 ] / 255.0f, image[ index + 1 ] / 255.0f,
-                image[ index + 2 ] / 255.0f, image[ index + 3 ] / 255.0f );
-            bitmap[ canvas_y * size_x + canvas_x ] =
-                premultiplied( linearized( color ) );
-        }
+    {
+        int row = image_y * stride;
+        int canvas_y = y + image_y;
+        if ( canvas_y < 0 || size_y <= canvas_y )
+            continue;
+        int begin = std::min( std::max( -x, 0 ), width );
+        int end = std::max( std::min( size_x - x, width ), begin );
+        if ( begin == end )
+            continue;
+        if ( storage == srgb_byte )
+            std::memmove( &encoded[ static_cast< std::ptrdiff_t >(
+                                        canvas_y ) * byte_stride +
+                                    ( x + begin ) * 4 ],
+                          &image[ row + begin * 4 ],
+                          static_cast< size_t >( end - begin ) * 4 );
+        else
+            for ( int image_x = begin; image_x < end; ++image_x )
+                store_pixel(
+                    x + image_x, canvas_y,
+                    encoded_to_color( &image[ row + image_x * 4 ] ) );
+    }
+}
+
+bool canvas::take_dirty_region(
+    int &x,
+    int &y,
+    int &width,
+    int &height )
+{
+    x = dirty_left;
+    y = dirty_top;
+    width = dirty_right - dirty_left;
+    height = dirty_bottom - dirty_top;
+    dirty_left = dirty_top = dirty_right = dirty_bottom = 0;
+    return width > 0;
 }
 
+// Saving the state copies all of the simple values to the next entry in the
+// stack.  The stack only grows, so its entries and the storage in their
+// vectors get reused by later saves instead of being reallocated.  The line
+// dash and brushes are not copied here, though.  Instead, the
+// entry just notes that it doesn't have its own copy of them and that they
+// are the same as in the next entry up, or the current state if this is the
+// top.  Before changing any of those, the canvas first gives the top entry
+// its own copy, as with changing_brush() below.  For the common case where
+// the value is about to be replaced outright, it can just swap it over with
+// no copying at all.  The clip mask and font are already shared by
+// reference count.
+//
 void canvas::save()
 {
-    canvas *state = new canvas( 0, 0 );
-    state->global_composite_operation = global_composite_operation;
-    state->shadow_offset_x = shadow_offset_x;
-    state->shadow_offset_y = shadow_offset_y;
-    state->line_cap = line_cap;
-    state->line_join = line_join;
-    state->line_dash_offset = line_dash_offset;
-    state->text_align = text_align;
-    state->text_baseline = text_baseline;
-    state->forward = forward;
-    state->inverse = inverse;
-    state->global_alpha = global_alpha;
-    state->shadow_color = shadow_color;
-    state->shadow_blur = shadow_blur;
-    state->line_width = line_width;
-    state->miter_limit = miter_limit;
-    state->line_dash = line_dash;
-    state->fill_brush = fill_brush;
-    state->stroke_brush = stroke_brush;
-    state->mask = mask;
-    state->face = face;
-    state->saves = saves;
-    saves = state;
+    if ( recording )
+        note( save_call );
+    if ( depth == saves.size() )
+        saves.push_back( canvas_state() );
+    canvas_state &state = saves[ depth++ ];
+    state.global_composite_operation = global_composite_operation;
+    state.shadow_offset_x = shadow_offset_x;
+    state.shadow_offset_y = shadow_offset_y;
+    state.line_cap = line_cap;
+    state.line_join = line_join;
+    state.line_dash_offset = line_dash_offset;
+    state.text_align = text_align;
+    state.text_baseline = text_baseline;
+    state.image_smoothing = image_smoothing;
+    state.forward = forward;
+    state.inverse = inverse;
+    state.global_alpha = global_alpha;
+    state.shadow_color = shadow_color;
+    state.shadow_blur = shadow_blur;
+    state.line_width = line_width;
+    state.miter_limit = miter_limit;
+    state.font_scale = font_scale;
+    state.dash_owned = false;
+    state.fill_owned = false;
+    state.stroke_owned = false;
+    state.clipping = clipping;
+    ++clipping->references;
+    state.face = face;
+    if ( face )
+        add_reference( face->references );
 }
 
 void canvas::restore()
 {
-    if ( !saves )
+    if ( recording )
+        note( restore_call );
+    if ( !depth )
+        return;
+    canvas_state &state = saves[ --depth ];
+    global_composite_operation = state.global_composite_operation;
+    shadow_offset_x = state.shadow_offset_x;
+    shadow_offset_y = state.shadow_offset_y;
+    line_cap = state.line_cap;
+    line_join = state.line_join;
+    line_dash_offset = state.line_dash_offset;
+    text_align = state.text_align;
+    text_baseline = state.text_baseline;
+    image_smoothing = state.image_smoothing;
+    forward = state.forward;
+    inverse = state.inverse;
+    global_alpha = state.global_alpha;
+    shadow_color = state.shadow_color;
+    shadow_blur = state.shadow_blur;
+    line_width = state.line_width;
+    miter_limit = state.miter_limit;
+    font_scale = state.font_scale;
+    if ( state.dash_owned )
+        line_dash.swap( state.line_dash );
+    if ( state.fill_owned )
+        swap_brushes( fill_brush, state.fill_brush );
+    if ( state.stroke_owned )
+        swap_brushes( stroke_brush, state.stroke_brush );
+    if ( !--clipping->references )
+        delete clipping;
+    clipping = state.clipping;
+    state.clipping = 0;
+    release_face( face );
+    face = state.face;
+    state.face = 0;
+}
+
+// Get a brush ready to be changed.  If the top entry on the state stack is
+// still sharing it, this gives that entry its own copy first.  When the
+// brush is about to be replaced outright, the current one just gets swapped
+// over, leaving behind whatever the entry had before for its storage.
+//
+paint_brush &canvas::changing_brush(
+    brush_type type,
+    bool replacing )
+{
+    paint_brush &brush = type == fill_style ? fill_brush : stroke_brush;
+    if ( !depth )
+        return brush;
+    canvas_state &state = saves[ depth - 1 ];
+    bool &owned = type == fill_style ? state.fill_owned : state.stroke_owned;
+    paint_brush &saved = type == fill_style ? state.fill_brush :
+        state.stroke_brush;
+    if ( !owned )
+    {
+        if ( replacing )
+            swap_brushes( brush, saved );
+        else
+            saved = brush;
+        owned = true;
+    }
+    return brush;
+}
+
+// Record a call into the display list, unless it is being made internally
+// by another call that is already being recorded.  The call's arguments go
+// into the list's values, while any arrays, text, images, and fonts that
+// it takes are added after by the other functions here.  If any of the
+// public settings have changed since the last call noted in the list,
+// that first gets its own entry with all of their new values.
+//
+void canvas::note(
+    display_call call,
+    int count,
+    float value_1,
+    float value_2,
+    float value_3,
+    float value_4,
+    float value_5,
+    float value_6,
+    float value_7 )
+{
+    if ( nesting )
+        return;
+    float settings[] = {
+        static_cast< float >( global_composite_operation ),
+        shadow_offset_x, shadow_offset_y,
+        static_cast< float >( line_cap ), static_cast< float >( line_join ),
+        line_dash_offset, static_cast< float >( text_align ),
+        static_cast< float >( text_baseline ),
+        static_cast< float >( image_smoothing ) };
+    std::vector< float > &fields = recording->fields;
+    if ( fields.empty() || !std::equal( settings, settings + 9,
+                                        fields.begin() ) )
+    {
+        fields.assign( settings, settings + 9 );
+        recording->calls.push_back( fields_call );
+        recording->values.insert(
+            recording->values.end(), settings, settings + 9 );
+    }
+    float arguments[] = {
+        value_1, value_2, value_3, value_4, value_5, value_6, value_7 };
+    recording->calls.push_back( call );
+    recording->values.insert(
+        recording->values.end(), arguments, arguments + count );
+}
+
+void canvas::note_values(
+    float const *values,
+    int count )
+{
+    if ( !nesting )
+        recording->values.insert(
+            recording->values.end(), values, values + count );
+}
+
+void canvas::note_text(
+    char const *text )
+{
+    if ( !nesting && text )
+        recording->bytes.insert(
+            recording->bytes.end(), text, text + std::strlen( text ) + 1 );
+}
+
+void canvas::note_font(
+    typeface const &font )
+{
+    if ( !nesting )
+        recording->fonts.push_back( font );
+}
+
+void canvas::note_shared(
+    shared_image const &image )
+{
+    if ( !nesting )
+        recording->images.push_back( image );
+}
+
+// Copy an image into the display list with its rows packed together.
+//
+void canvas::note_image(
+    unsigned char const *image,
+    int width,
+    int height,
+    int stride )
+{
+    if ( nesting )
+        return;
+    for ( int y = 0; y < height; ++y )
+    {
+        unsigned char const *row = image + static_cast< std::ptrdiff_t >(
+            y ) * stride;
+        recording->bytes.insert(
+            recording->bytes.end(), row, row + width * 4 );
+    }
+}
+
+void canvas::set_recording(
+    display_list *list )
+{
+    recording = list;
+}
+
+void canvas::replay(
+    display_list const &list )
+{
+    replay_calls( list, list.fonts.empty() ? 0 : &list.fonts[ 0 ] );
+}
+
+// Replaying walks the calls in the list, consuming the values and any data
+// that each call recorded in the same order that they were noted.  Images
+// recorded with their rows packed together are passed with a matching
+// stride.  Fonts come from the given array rather than the list itself so
+// that tiles can substitute their own views of them.  Putting image data
+// works in the pixels of the whole canvas, so it is shifted by the origin.
+//
+void canvas::replay_calls(
+    display_list const &list,
+    typeface const *fonts )
+{
+    static int const call_values[] = {
+        2, 1, 2, 6, 6, 1, 4, 1, 1, 1, 1, 5, 5, 7, 6, 4, 2, 0, 2, 0, 2,
+        4, 6, 5, 6, 4, 0, 0, 0, 2, 4, 4, 4, 1, 1, 4, 4, 6, 4, 4, 0, 0, 9 };
+    float const *value = list.values.empty() ? 0 : &list.values[ 0 ];
+    unsigned char const *data = list.bytes.empty() ? 0 : &list.bytes[ 0 ];
+    int font = 0;
+    size_t image = 0;
+    for ( size_t index = 0; index < list.calls.size(); ++index )
+    {
+        int call = list.calls[ index ];
+        if ( call == scale_call )
+            scale( value[ 0 ], value[ 1 ] );
+        else if ( call == rotate_call )
+            rotate( value[ 0 ] );
+        else if ( call == translate_call )
+            translate( value[ 0 ], value[ 1 ] );
+        else if ( call == transform_call )
+            transform( value[ 0 ], value[ 1 ], value[ 2 ],
+                       value[ 3 ], value[ 4 ], value[ 5 ] );
+        else if ( call == set_transform_call )
+            set_transform( value[ 0 ], value[ 1 ], value[ 2 ], value[ 3 ],
+                           value[ 4 ], value[ 5 ] );
+        else if ( call == set_global_alpha_call )
+            set_global_alpha( value[ 0 ] );
+        else if ( call == set_shadow_color_call )
+            set_shadow_color( value[ 0 ], value[ 1 ],
+                              value[ 2 ], value[ 3 ] );
+        else if ( call == set_shadow_blur_call )
+            set_shadow_blur( value[ 0 ] );
+        else if ( call == set_line_width_call )
+            set_line_width( value[ 0 ] );
+        else if ( call == set_miter_limit_call )
+            set_miter_limit( value[ 0 ] );
+        else if ( call == set_line_dash_call )
+        {
+            int count = static_cast< int >( value[ 0 ] );
+            set_line_dash( count ? value + 1 : 0, count );
+            value += count;
+        }
+        else if ( call == set_color_call )
+            set_color( enumerated< brush_type >( value[ 0 ] ),
+                       value[ 1 ], value[ 2 ], value[ 3 ], value[ 4 ] );
+        else if ( call == set_linear_gradient_call )
+            set_linear_gradient( enumerated< brush_type >( value[ 0 ] ),
+                                 value[ 1 ], value[ 2 ],
+                                 value[ 3 ], value[ 4 ] );
+        else if ( call == set_radial_gradient_call )
+            set_radial_gradient( enumerated< brush_type >( value[ 0 ] ),
+                                 value[ 1 ], value[ 2 ], value[ 3 ],
+                                 value[ 4 ], value[ 5 ], value[ 6 ] );
+        else if ( call == add_color_stop_call )
+            add_color_stop( enumerated< brush_type >( value[ 0 ] ),
+                            value[ 1 ], value[ 2 ], value[ 3 ],
+                            value[ 4 ], value[ 5 ] );
+        else if ( call == set_pattern_call )
+        {
+            int width = static_cast< int >( value[ 1 ] );
+            int height = static_cast< int >( value[ 2 ] );
+            set_pattern( enumerated< brush_type >( value[ 0 ] ),
+                         data, width, height, width * 4,
+                         enumerated< repetition_style >( value[ 3 ] ) );
+            data += static_cast< std::ptrdiff_t >( width * height ) * 4;
+        }
+        else if ( call == set_shared_pattern_call )
+            set_pattern( enumerated< brush_type >( value[ 0 ] ),
+                         list.images[ image++ ],
+                         enumerated< repetition_style >( value[ 1 ] ) );
+        else if ( call == begin_path_call )
+            begin_path();
+        else if ( call == move_to_call )
+            move_to( value[ 0 ], value[ 1 ] );
+        else if ( call == close_path_call )
+            close_path();
+        else if ( call == line_to_call )
+            line_to( value[ 0 ], value[ 1 ] );
+        else if ( call == quadratic_curve_to_call )
+            quadratic_curve_to( value[ 0 ], value[ 1 ],
+                                value[ 2 ], value[ 3 ] );
+        else if ( call == bezier_curve_to_call )
+            bezier_curve_to( value[ 0 ], value[ 1 ], value[ 2 ],
+                             value[ 3 ], value[ 4 ], value[ 5 ] );
+        else if ( call == arc_to_call )
+            arc_to( value[ 0 ], value[ 1 ], value[ 2 ], value[ 3 ],
+                    value[ 4 ] );
+        else if ( call == arc_call )
+            arc( value[ 0 ], value[ 1 ], value[ 2 ], value[ 3 ], value[ 4 ],
+                 value[ 5 ] != 0.0f );
+        else if ( call == rectangle_call )
+            rectangle( value[ 0 ], value[ 1 ], value[ 2 ], value[ 3 ] );
+        else if ( call == fill_call )
+            fill();
+        else if ( call == stroke_call )
+            stroke();
+        else if ( call == clip_call )
+            clip();
+        else if ( call == fill_batch_call )
+        {
+            int count = static_cast< int >( value[ 0 ] );
+            bool colored = value[ 1 ] != 0.0f;
+            fill_batch( value + 2, colored ? value + 2 + count * 2 : 0,
+                        count );
+            value += count * ( colored ? 6 : 2 );
+        }
+        else if ( call == clear_rectangle_call )
+            clear_rectangle( value[ 0 ], value[ 1 ], value[ 2 ], value[ 3 ] );
+        else if ( call == fill_rectangle_call )
+            fill_rectangle( value[ 0 ], value[ 1 ], value[ 2 ], value[ 3 ] );
+        else if ( call == stroke_rectangle_call )
+            stroke_rectangle( value[ 0 ], value[ 1 ],
+                              value[ 2 ], value[ 3 ] );
+        else if ( call == set_font_call )
+            set_font( fonts[ font++ ], value[ 0 ] );
+        else if ( call == set_font_size_call )
+            set_font( 0, 0, value[ 0 ] );
+        else if ( call == fill_text_call || call == stroke_text_call )
+        {
+            char const *text = value[ 3 ] != 0.0f ?
+                reinterpret_cast< char const * >( data ) : 0;
+            if ( call == fill_text_call )
+                fill_text( text, value[ 0 ], value[ 1 ], value[ 2 ] );
+            else
+                stroke_text( text, value[ 0 ], value[ 1 ], value[ 2 ] );
+            if ( text )
+                data += std::strlen( text ) + 1;
+        }
+        else if ( call == draw_image_call )
+        {
+            int width = static_cast< int >( value[ 0 ] );
+            int height = static_cast< int >( value[ 1 ] );
+            draw_image( data, width, height, width * 4,
+                        value[ 2 ], value[ 3 ], value[ 4 ], value[ 5 ] );
+            data += static_cast< std::ptrdiff_t >( width * height ) * 4;
+        }
+        else if ( call == draw_shared_image_call )
+            draw_image( list.images[ image++ ], value[ 0 ], value[ 1 ],
+                        value[ 2 ], value[ 3 ] );
+        else if ( call == put_image_data_call )
+        {
+            int width = static_cast< int >( value[ 0 ] );
+            int height = static_cast< int >( value[ 1 ] );
+            put_image_data( data, width, height, width * 4,
+                            static_cast< int >( value[ 2 ] - origin.x ),
+                            static_cast< int >( value[ 3 ] - origin.y ) );
+            data += static_cast< std::ptrdiff_t >( width * height ) * 4;
+        }
+        else if ( call == save_call )
+            save();
+        else if ( call == restore_call )
+            restore();
+        else if ( call == fields_call )
+        {
+            global_composite_operation =
+                enumerated< composite_operation >( value[ 0 ] );
+            shadow_offset_x = value[ 1 ];
+            shadow_offset_y = value[ 2 ];
+            line_cap = enumerated< cap_style >( value[ 3 ] );
+            line_join = enumerated< join_style >( value[ 4 ] );
+            line_dash_offset = value[ 5 ];
+            text_align = enumerated< align_style >( value[ 6 ] );
+            text_baseline = enumerated< baseline_style >( value[ 7 ] );
+            image_smoothing = enumerated< smoothing_style >( value[ 8 ] );
+        }
+        value += call_values[ call ];
+    }
+}
+
+// Task details for replaying a display list in tiles via a task runner.
+// Every tile gets its own small canvas in the same format, which starts
+// with a copy of its part of the pixel buffer and gets copied back after
+// drawing, and its own views of the fonts.  The tile keeps the transform
+// of the whole canvas and instead shifts by its origin only when it scan
+// converts polylines and locates pixels for painting.  Since the shift is
+// by whole pixels, the geometry and so the pixels come out the same as if
+// drawn to the whole canvas at once.  A view shares the font
+// data of the original but has a separate glyph cache, so that the tiles
+// do not share anything that they would change.  The views are made and
+// released on the calling thread, so the reference counts are never
+// touched concurrently.
+//
+struct tile_task_data { canvas *that; display_list const *list;
+                        typeface const *views; affine_matrix forward;
+                        int x, y, width, height, size, columns; };
+void canvas::replay_tile_task(
+    void *data,
+    int index )
+{
+    tile_task_data const &task = *static_cast< tile_task_data * >( data );
+    int left = task.x + index % task.columns * task.size;
+    int top = task.y + index / task.columns * task.size;
+    int width = std::min( task.size, task.x + task.width - left );
+    int height = std::min( task.size, task.y + task.height - top );
+    canvas &that = *task.that;
+    canvas tile( width, height, that.storage );
+    that.copy_tile( tile, left, top, false );
+    affine_matrix const &matrix = task.forward;
+    tile.set_transform( matrix.a, matrix.b, matrix.c, matrix.d,
+                        matrix.e, matrix.f );
+    tile.origin = xy( static_cast< float >( left ),
+                      static_cast< float >( top ) );
+    size_t fonts = task.list->fonts.size();
+    tile.replay_calls( *task.list, fonts ? task.views +
+                       static_cast< size_t >( index ) * fonts : 0 );
+    that.copy_tile( tile, left, top, true );
+}
+
+// Copy pixels between the buffer of a tile canvas in the same format and
+// the part of this canvas's buffer that it covers, in either direction.
+//
+void canvas::copy_tile(
+    canvas &tile,
+    int left,
+    int top,
+    bool storing )
+{
+    for ( int y = 0; y < tile.size_y; ++y )
+    {
+        size_t row = static_cast< size_t >( ( top + y ) * size_x + left );
+        size_t part = static_cast< size_t >( y * tile.size_x );
+        size_t count = static_cast< size_t >( tile.size_x );
+        unsigned char *canvas_row = 0;
+        unsigned char *tile_row = 0;
+        if ( storage == linear_float )
+        {
+            canvas_row = reinterpret_cast< unsigned char * >( bitmap + row );
+            tile_row = reinterpret_cast< unsigned char * >(
+                tile.bitmap + part );
+            count *= sizeof( rgba );
+        }
+        else if ( storage != srgb_byte )
+        {
+            canvas_row = reinterpret_cast< unsigned char * >(
+                packed + row * 4 );
+            tile_row = reinterpret_cast< unsigned char * >(
+                tile.packed + part * 4 );
+            count *= 4 * sizeof( unsigned short );
+        }
+        else
+        {
+            canvas_row = encoded + static_cast< std::ptrdiff_t >( top + y ) *
+                byte_stride + left * 4;
+            tile_row = tile.encoded + static_cast< std::ptrdiff_t >( y ) *
+                tile.byte_stride;
+            count *= 4;
+        }
+        if ( storing )
+            std::memcpy( canvas_row, tile_row, count );
+        else
+            std::memcpy( tile_row, canvas_row, count );
+    }
+}
+
+void canvas::replay_tiles(
+    display_list const &list,
+    int x,
+    int y,
+    int width,
+    int height,
+    int tile_size )
+{
+    int left = std::max( x, 0 );
+    int top = std::max( y, 0 );
+    int right = std::min( x + width, size_x );
+    int bottom = std::min( y + height, size_y );
+    if ( left >= right || top >= bottom || tile_size < 1 )
+        return;
+    int columns = ( right - left + tile_size - 1 ) / tile_size;
+    int count = columns * ( ( bottom - top + tile_size - 1 ) / tile_size );
+    std::vector< typeface > views(
+        static_cast< size_t >( count ) * list.fonts.size() );
+    for ( size_t index = 0; index < views.size(); ++index )
+    {
+        font_face *source = list.fonts[ index % list.fonts.size() ].face;
+        if ( !source )
+            continue;
+        views[ index ].face = view_face( source );
+    }
+    mark_dirty( left, top, right, bottom );
+    tile_task_data task = { this, &list, views.empty() ? 0 : &views[ 0 ],
+                            forward, left, top, right - left, bottom - top,
+                            tile_size, columns };
+    if ( runner )
+        runner->run( replay_tile_task, &task, count );
+    else
+        for ( int index = 0; index < count; ++index )
+            replay_tile_task( &task, index );
+}
+
+// Replaying in bands reuses the canvas's own pixels for each band, with
+// the origin shifted down to the band's top row so that the geometry and
+// dithering come out as for the whole image, as with the tiles above.  A
+// save before the first band and a restore after each one puts the state
+// and path back the way that it started, whatever the list leaves open.
+// For formats other than srgb_byte, the band is converted to bytes in a
+// separate buffer before handing it off.
+//
+void canvas::replay_bands(
+    display_list const &list,
+    int height,
+    void ( *write )( void *, unsigned char const *, int, int, int, int ),
+    void *data )
+{
+    if ( height < 1 || !write )
+        return;
+    display_list *was_recording = recording;
+    recording = 0;
+    size_t was_depth = depth;
+    bezier_path was_path = path;
+    size_t count = static_cast< size_t >( size_x ) *
+        static_cast< size_t >( size_y );
+    std::vector< unsigned char > bytes( storage == srgb_byte ? 0 :
+                                        count * 4 );
+    mark_dirty( 0, 0, size_x, size_y );
+    for ( int top = 0; top < height; top += size_y )
+    {
+        int band = std::min( size_y, height - top );
+        clear_pixels();
+        save();
+        origin = xy( 0.0f, static_cast< float >( top ) );
+        replay_calls( list, list.fonts.empty() ? 0 : &list.fonts[ 0 ] );
+        while ( depth > was_depth )
+            restore();
+        path = was_path;
+        if ( storage == srgb_byte )
+            write( data, encoded, size_x, band, byte_stride, top );
+        else
+        {
+            get_image_data( &bytes[ 0 ], size_x, band, size_x * 4, 0, 0 );
+            write( data, &bytes[ 0 ], size_x, band, size_x * 4, top );
+        }
+    }
+    origin = xy( 0.0f, 0.0f );
+    recording = was_recording;
+}
+
+// Set every pixel in the buffer to transparent black, whatever the format.
+//
+void canvas::clear_pixels()
+{
+    size_t count = static_cast< size_t >( size_x ) *
+        static_cast< size_t >( size_y );
+    if ( storage == linear_float )
+        std::fill( bitmap, bitmap + count, rgba( 0.0f, 0.0f, 0.0f, 0.0f ) );
+    else if ( storage != srgb_byte )
+        std::fill( packed, packed + count * 4,
+                   static_cast< unsigned short >( 0 ) );
+    else
+        for ( int y = 0; y < size_y; ++y )
+            std::memset( encoded + static_cast< std::ptrdiff_t >( y ) *
+                         byte_stride, 0,
+                         static_cast< size_t >( size_x ) * 4 );
+}
+
+void canvas::set_task_runner(
+    task_runner *tasks,
+    int bands )
+{
+    if ( bands < 1 )
+        return;
+    runner = tasks;
+    band_count = bands;
+}
+
+
+void canvas::set_scratch_limit(
+    int bytes )
+{
+    if ( bytes < 0 )
+        return;
+    scratch_limit = static_cast< size_t >( bytes );
+    trim_scratch();
+}
+
+int canvas::take_scratch_peak()
+{
+    size_t peak = std::min( scratch_peak,
+                            static_cast< size_t >( 2147483647 ) );
+    scratch_peak = scratch_bytes();
+    return static_cast< int >( peak );
+}
+
+// Measure and release the scratch buffers.  These only count the storage
+// that the buffers have reserved, since that is what stays resident, and
+// releasing swaps each one with an empty buffer since clearing or resizing
+// a vector never gives its storage back.
+//
+template< typename type >
+static size_t reserved_bytes(
+    std::vector< type > const &buffer )
+{
+    return buffer.capacity() * sizeof( type );
+}
+
+template< typename type >
+static void release(
+    std::vector< type > &buffer )
+{
+    std::vector< type >().swap( buffer );
+}
+
+size_t canvas::scratch_bytes() const
+{
+    return ( reserved_bytes( lines.points ) +
+             reserved_bytes( lines.subpaths ) +
+             reserved_bytes( scratch.points ) +
+             reserved_bytes( scratch.subpaths ) +
+             reserved_bytes( runs ) + reserved_bytes( ordered ) +
+             reserved_bytes( rows ) + reserved_bytes( cover ) +
+             reserved_bytes( touched ) + reserved_bytes( batch_points ) +
+             reserved_bytes( shadow ) + reserved_bytes( spans ) +
+             reserved_bytes( filtered ) + reserved_bytes( sampled ) +
+             reserved_bytes( sample_x.first ) +
+             reserved_bytes( sample_x.weights ) +
+             reserved_bytes( sample_y.first ) +
+             reserved_bytes( sample_y.weights ) );
+}
+
+// Note the high-water mark after an operation and then release all of the
+// scratch buffers if they hold more than the limit.  The next operation
+// just reallocates whatever it needs.
+//
+void canvas::trim_scratch()
+{
+    size_t bytes = scratch_bytes();
+    scratch_peak = std::max( scratch_peak, bytes );
+    if ( bytes <= scratch_limit )
         return;
-    canvas *state = saves;
-    global_composite_operation = state->global_composite_operation;
-    shadow_offset_x = state->shadow_offset_x;
-    shadow_offset_y = state->shadow_offset_y;
-    line_cap = state->line_cap;
-    line_join = state->line_join;
-    line_dash_offset = state->line_dash_offset;
-    text_align = state->text_align;
-    text_baseline = state->text_baseline;
-    forward = state->forward;
-    inverse = state->inverse;
-    global_alpha = state->global_alpha;
-    shadow_color = state->shadow_color;
-    shadow_blur = state->shadow_blur;
-    line_width = state->line_width;
-    miter_limit = state->miter_limit;
-    line_dash = state->line_dash;
-    fill_brush = state->fill_brush;
-    stroke_brush = state->stroke_brush;
-    mask = state->mask;
-    face = state->face;
-    saves = state->saves;
-    state->saves = 0;
-    delete state;
+    release( lines.points );
+    release( lines.subpaths );
+    release( scratch.points );
+    release( scratch.subpaths );
+    release( runs );
+    release( ordered );
+    release( rows );
+    release( cover );
+    release( touched );
+    release( batch_points );
+    release( shadow );
+    release( spans );
+    release( filtered );
+    release( sampled );
+    release( sample_x.first );
+    release( sample_x.weights );
+    release( sample_y.first );
+    release( sample_y.weights );
 }
 
 }
@@ -69,12 +69,16 @@
 #include <sys/time.h>
 #include <unistd.h>
 #endif
+#if defined( TEST_WITH_THREADS ) && !defined( _WIN32 )
+#include <pthread.h>
+#endif
 
 #include <algorithm>
 #include <cstdlib>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <string>
 #include <vector>
 
@@ -323,6 +327,117 @@ char const font_g_base64[] =
 namespace
 {
 
+// Many tests check themselves by drawing the same thing in more than one
+// way and then comparing the results before marking the outcome on the
+// image.  This reads back a pair of same-sized canvases and returns the
+// largest difference between them in any 8-bit channel, so that tests can
+// demand an exact match or allow an off-by-one for differences in rounding.
+int image_error( canvas &first, canvas &second, int width, int height )
+{
+    vector< unsigned char > one( static_cast< size_t >( width * height * 4 ) );
+    vector< unsigned char > two( one.size() );
+    first.get_image_data( &one[ 0 ], width, height, width * 4, 0, 0 );
+    second.get_image_data( &two[ 0 ], width, height, width * 4, 0, 0 );
+    int error = 0;
+    for ( size_t index = 0; index < one.size(); ++index )
+        error = max( error, abs( one[ index ] - two[ index ] ) );
+    return error;
+}
+
+void pixel_formats(canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width * 0.2f );
+    int size_y = static_cast< int >( height );
+    float part = static_cast< float >( size_x );
+    vector< unsigned char > image( static_cast< size_t >( size_x * size_y * 4 ) );
+    vector< unsigned char > again( image.size() );
+    for ( int format = 0; format < 4; ++format )
+    {
+        canvas target( size_x, size_y, static_cast< pixel_format >( format ) );
+        target.set_linear_gradient( fill_style, 0.0f, 0.0f, 0.0f, height );
+        target.add_color_stop( fill_style, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f );
+        target.add_color_stop( fill_style, 1.0f, 1.0f, 0.9f, 0.8f, 1.0f );
+        target.fill_rectangle( 0.0f, 0.0f, part, height );
+        target.set_color( fill_style, 0.2f, 0.4f, 0.9f, 0.05f );
+        for ( int step = 0; step < 40; ++step )
+            target.fill_rectangle( 0.0f, 0.1f * height, 0.5f * part,
+                                   0.2f * height );
+        target.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.8f );
+        target.set_shadow_blur( 6.0f );
+        target.set_color( fill_style, 1.0f, 0.0f, 0.0f, 0.5f );
+        target.arc( 0.5f * part, 0.5f * height, 0.3f * part,
+                    0.0f, 6.28318531f );
+        target.fill();
+        target.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.0f );
+        target.set_color( fill_style, 0.0f, 0.8f, 0.0f, 1.0f );
+        target.global_composite_operation = lighter;
+        target.fill_rectangle( 0.2f * part, 0.7f * height,
+                               0.4f * part, 0.2f * height );
+        target.global_composite_operation = destination_out;
+        target.set_global_alpha( 0.5f );
+        target.fill_rectangle( 0.0f, 0.8f * height, part, 0.05f * height );
+        target.get_image_data( &image[ 0 ], size_x, size_y, size_x * 4,
+                               0, 0 );
+        that.put_image_data( &image[ 0 ], size_x, size_y, size_x * 4,
+                             format * ( size_x + 8 ), 0 );
+        target.put_image_data( &image[ 0 ], size_x, size_y, size_x * 4,
+                               0, 0 );
+        target.get_image_data( &again[ 0 ], size_x, size_y, size_x * 4,
+                               0, 0 );
+        int error = 0;
+        for ( size_t index = 0; index < image.size(); ++index )
+            error = max( error, abs( image[ index ] - again[ index ] ) );
+        that.set_color( fill_style, error > 1, error <= 1, 0.0f, 1.0f );
+        that.fill_rectangle( static_cast< float >( format * ( size_x + 8 ) ),
+                             0.0f, part, 8.0f );
+    }
+}
+
+void external_image( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    int stride = size_x * 4 + 12;
+    vector< unsigned char > image( static_cast< size_t >( stride * size_y ) );
+    for ( size_t index = 0; index < image.size(); ++index )
+        image[ index ] = static_cast< unsigned char >(
+            ( index % 4 == 3 ) * 255 | ( index / 4 * 7 % 256 ) );
+    canvas owned( size_x, size_y, srgb_byte );
+    owned.put_image_data( &image[ 0 ], size_x, size_y, stride, 0, 0 );
+    canvas attached( size_x, size_y, &image[ 0 ], stride );
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        canvas &target = pass ? attached : owned;
+        target.set_radial_gradient( fill_style,
+                                    0.5f * width, 0.5f * height, 0.0f,
+                                    0.5f * width, 0.5f * height,
+                                    0.5f * width );
+        target.add_color_stop( fill_style, 0.0f, 1.0f, 1.0f, 1.0f, 1.0f );
+        target.add_color_stop( fill_style, 1.0f, 0.0f, 0.2f, 0.6f, 0.0f );
+        target.fill_rectangle( 0.0f, 0.0f, width, height );
+        target.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.5f );
+        target.shadow_offset_x = 4.0f;
+        target.shadow_offset_y = 4.0f;
+        target.set_color( stroke_style, 0.9f, 0.3f, 0.0f, 0.75f );
+        target.set_line_width( 10.0f );
+        target.stroke_rectangle( 0.25f * width, 0.25f * height,
+                                 0.5f * width, 0.5f * height );
+        target.global_composite_operation = destination_out;
+        target.set_color( fill_style, 0.0f, 0.0f, 0.0f, 0.5f );
+        target.fill_rectangle( 0.0f, 0.0f, width, 0.1f * height );
+    }
+    vector< unsigned char > copy( image.size() );
+    owned.get_image_data( &copy[ 0 ], size_x, size_y, stride, 0, 0 );
+    bool same = true;
+    for ( int y = 0; y < size_y; ++y )
+        for ( int x = 0; x < size_x * 4; ++x )
+            same = same && copy[ static_cast< size_t >( y * stride + x ) ] ==
+                image[ static_cast< size_t >( y * stride + x ) ];
+    that.put_image_data( &image[ 0 ], size_x, size_y, stride, 0, 0 );
+    that.set_color( fill_style, !same, same, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.9f * height, width, 0.1f * height );
+}
+
 void scale_uniform( canvas &that, float width, float height )
 {
     that.set_color( stroke_style, 0.0f, 0.0f, 0.0f, 1.0f );
@@ -467,6 +582,56 @@ void global_composite_operation( canvas &that, float width, float height )
     }
 }
 
+void global_composite_sampled( canvas &that, float width, float height )
+{
+    composite_operation const operations[] = {
+        source_in, source_copy, source_out, destination_in,
+        destination_atop, lighter, destination_over, destination_out,
+        source_atop, source_over, exclusive_or };
+    unsigned char checker[ 64 ];
+    for ( int index = 0; index < 64; ++index )
+        checker[ index ] = static_cast< unsigned char >(
+            ( index & 3 ) == 3 ? ( index >> 2 & 1 ? 255 : 128 ) :
+            ( index & 3 ) == 1 ? 0 :
+            ( ( index >> 2 & 1 ) ^ ( index >> 4 & 1 ) ) * 255 );
+    float size_x = 0.125f * width;
+    float size_y = 0.125f * height;
+    for ( int index = 0; index < 11; ++index )
+        for ( int cell = 0; cell < 4; ++cell )
+        {
+            float x = static_cast< float >( operations[ index ] % 4 * 2 +
+                                            ( cell & 1 ) ) * size_x;
+            float y = static_cast< float >( operations[ index ] / 4 * 2 +
+                                            ( cell >> 1 ) ) * size_y;
+            that.save();
+            that.begin_path();
+            if ( cell < 2 )
+                that.rectangle( x, y, size_x, size_y );
+            else
+                that.arc( x + 0.5f * size_x, y + 0.5f * size_y,
+                          0.45f * min( size_x, size_y ), 0.0f, 6.28318531f );
+            that.clip();
+            that.set_color( fill_style, 0.0f, 0.0f, 1.0f, 1.0f );
+            that.fill_rectangle( x + 0.4f * size_x, y + 0.4f * size_y,
+                                 0.5f * size_x, 0.5f * size_y );
+            that.global_composite_operation = operations[ index ];
+            if ( cell & 1 )
+                that.set_pattern( fill_style, checker, 4, 4, 16, repeat );
+            else
+            {
+                that.set_linear_gradient( fill_style, x, y,
+                                          x + size_x, y + size_y );
+                that.add_color_stop( fill_style, 0.0f,
+                                     1.0f, 0.0f, 0.0f, 0.5f );
+                that.add_color_stop( fill_style, 1.0f,
+                                     1.0f, 0.9f, 0.0f, 1.0f );
+            }
+            that.fill_rectangle( x + 0.1f * size_x, y + 0.1f * size_y,
+                                 0.5f * size_x, 0.5f * size_y );
+            that.restore();
+        }
+}
+
 void shadow_color( canvas &that, float width, float height )
 {
     that.shadow_offset_x = 5.0f;
@@ -576,6 +741,53 @@ void shadow_blur_composite( canvas &that, float width, float height )
     that.stroke();
 }
 
+void shadow_blur_rectangle( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    canvas reference( size_x, size_y );
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        canvas &target = pass ? reference : that;
+        target.set_color( fill_style, 0.9f, 0.6f, 0.2f, 0.8f );
+        target.set_shadow_color( 0.1f, 0.0f, 0.3f, 0.7f );
+        static float const boxes[][ 6 ] = {
+            { 0.05f, 0.05f, 0.2f, 0.3f, 2.0f, 3.5f },
+            { 0.35f, 0.05f, 0.21f, 0.28f, 7.0f, 3.5f },
+            { 0.7f, 0.05f, 0.5f, 0.26f, 12.0f, 3.5f },
+            { 0.05f, 0.5f, 0.23f, 0.24f, 17.0f, -40.0f },
+            { 0.35f, 0.5f, 0.24f, 0.22f, 22.0f, 3.5f },
+            { 0.7f, 0.75f, 0.25f, -0.25f, 27.0f, 3.5f } };
+        for ( int index = 0; index < 6; ++index )
+        {
+            float const *box = boxes[ index ];
+            float x = box[ 0 ] * width;
+            float y = box[ 1 ] * height;
+            float size_w = box[ 2 ] * width;
+            float size_h = box[ 3 ] * height;
+            target.set_shadow_blur( box[ 4 ] );
+            target.shadow_offset_x = box[ 5 ];
+            target.shadow_offset_y = 4.25f;
+            if ( pass )
+            {
+                target.begin_path();
+                target.move_to( x, y );
+                target.line_to( x + 0.5f * size_w, y );
+                target.line_to( x + size_w, y );
+                target.line_to( x + size_w, y + size_h );
+                target.line_to( x, y + size_h );
+                target.fill();
+            }
+            else
+                target.fill_rectangle( x, y, size_w, size_h );
+        }
+    }
+    int error = image_error( that, reference, size_x, size_y );
+    that.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.0f );
+    that.set_color( fill_style, error > 1, error <= 1, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.95f * height, width, 0.05f * height );
+}
+
 void line_width( canvas &that, float width, float height )
 {
     that.set_color( stroke_style, 0.0f, 0.0f, 0.0f, 1.0f );
@@ -1446,6 +1658,40 @@ void clip_winding( canvas &that, float width, float height )
     that.stroke();
 }
 
+void clip_nested( canvas &that, float width, float height )
+{
+    for ( int level = 0; level < 6; ++level )
+    {
+        float inset = static_cast< float >( level ) * 16.0f;
+        that.save();
+        that.begin_path();
+        if ( level & 1 )
+            that.arc( 0.5f * width, 0.5f * height,
+                      0.5f * width - inset, 0.0f, 6.28318531f );
+        else
+            that.rectangle( inset, inset,
+                            width - 2.0f * inset, height - 2.0f * inset );
+        that.clip();
+        that.set_color( fill_style, static_cast< float >( level & 1 ),
+                        static_cast< float >( level ) / 5.0f, 1.0f, 1.0f );
+        that.fill_rectangle( 0.0f, 0.0f, width, height );
+    }
+    that.restore();
+    that.restore();
+    that.set_color( fill_style, 1.0f, 0.0f, 0.0f, 0.5f );
+    that.fill_rectangle( 0.0f, 0.0f, 0.5f * width, height );
+    that.save();
+    that.begin_path();
+    that.rectangle( 0.0f, 0.75f * height, width, 0.125f * height );
+    that.clip();
+    that.set_color( fill_style, 0.0f, 1.0f, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, height );
+    that.restore();
+    that.restore();
+    that.set_color( fill_style, 1.0f, 1.0f, 0.0f, 0.5f );
+    that.fill_rectangle( 0.5f * width, 0.0f, 0.5f * width, height );
+}
+
 void is_point_in_path( canvas &that, float width, float height )
 {
     that.set_color( fill_style, 0.0f, 0.0f, 1.0f, 1.0f );
@@ -1534,6 +1780,277 @@ void is_point_in_path_offscreen( canvas &that, float width, float height )
     }
 }
 
+void is_point_in_prepared( canvas &that, float width, float height )
+{
+    hit_test_path empty;
+    hit_test_path region;
+    that.prepare_hit_test( empty );
+    bool wrong = that.is_point_in_prepared( empty, 0.0f, 0.0f );
+    that.set_color( fill_style, 0.0f, 0.0f, 1.0f, 1.0f );
+    that.set_color( stroke_style, 1.0f, 1.0f, 1.0f, 1.0f );
+    that.scale( width / 256.0f, height / 256.0f );
+    that.begin_path();
+    that.move_to( 65.0f, 16.0f );
+    that.line_to( 113.0f, 24.0f );
+    that.bezier_curve_to( 113.0f, 24.0f, 93.0f, 126.0f, 119.0f, 160.0f );
+    that.bezier_curve_to( 133.0f, 180.0f, 170.0f, 196.0f, 186.0f, 177.0f );
+    that.bezier_curve_to( 198.0f, 162.0f, 182.0f, 130.0f, 166.0f, 118.0f );
+    that.bezier_curve_to( 123.0f, 80.0f, 84.0f, 124.0f, 84.0f, 124.0f );
+    that.line_to( 35.0f, 124.0f );
+    that.line_to( 18.0f, 56.0f );
+    that.line_to( 202.0f, 56.0f );
+    that.line_to( 202.0f, 90.0f );
+    that.bezier_curve_to( 202.0f, 90.0f, 240.0f, 168.0f, 209.0f, 202.0f );
+    that.bezier_curve_to( 175.0f, 240.0f, 65.0f, 187.0f, 65.0f, 187.0f );
+    that.close_path();
+    that.translate( 40.0f, 160.0f );
+    that.move_to( 110.0f, 0.0f );
+    that.line_to( 0.0f, 0.0f );
+    that.line_to( 0.0f, 0.0f );
+    that.bezier_curve_to( 0.0f, 90.0f, 110.0f, 90.0f, 110.0f, 40.0f );
+    that.close_path();
+    that.prepare_hit_test( region );
+    that.fill();
+    that.stroke();
+    that.set_transform( 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f );
+    float points[ 2048 ];
+    bool inside[ 1024 ];
+    for ( int index = 0; index < 1024; ++index )
+    {
+        points[ index * 2 + 0 ] =
+            static_cast< float >( index % 32 ) / 31.0f * 1.2f * width -
+            0.1f * width;
+        points[ index * 2 + 1 ] =
+            static_cast< float >( index / 32 ) / 31.0f * 1.2f * height -
+            0.1f * height;
+    }
+    float const corners[] = { 65.0f, 16.0f, 113.0f, 24.0f, 35.0f, 124.0f,
+                              100.0f, 56.0f, 202.0f, 70.0f, 150.0f, 160.0f };
+    for ( int index = 0; index < 12; ++index )
+        points[ index ] = corners[ index ] / 256.0f *
+            ( index & 1 ? height : width );
+    that.are_points_in_prepared( region, points, 1024, inside );
+    for ( int index = 0; index < 1024; ++index )
+    {
+        float x = points[ index * 2 + 0 ];
+        float y = points[ index * 2 + 1 ];
+        bool expected = that.is_point_in_path( x, y );
+        wrong = ( wrong || inside[ index ] != expected ||
+                  that.is_point_in_prepared( region, x, y ) != expected ||
+                  ( index < 6 && !expected ) );
+        if ( index % 5 )
+            continue;
+        that.set_color( stroke_style, 1.0f - inside[ index ],
+                        inside[ index ], 0.0f, 1.0f );
+        that.stroke_rectangle( x - 1.5f, y - 1.5f, 3.0f, 3.0f );
+    }
+    hit_test_path unbounded;
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        that.begin_path();
+        that.move_to( 0.0f, 0.0f );
+        that.line_to( pass ? numeric_limits< float >::quiet_NaN() :
+                             numeric_limits< float >::infinity(), 5.0f );
+        that.line_to( 4.0f, 4.0f );
+        that.prepare_hit_test( unbounded );
+        for ( int index = 0; index < 16; ++index )
+        {
+            float x = static_cast< float >( index % 4 ) * 2.0f;
+            float y = static_cast< float >( index / 4 ) * 2.0f;
+            wrong = ( wrong || that.is_point_in_prepared( unbounded, x, y ) !=
+                               that.is_point_in_path( x, y ) );
+        }
+    }
+    that.set_color( fill_style, wrong, !wrong, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.1f * height );
+}
+
+void draw_prepared( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    canvas direct( size_x, size_y );
+    prepared_path star;
+    prepared_path swirl;
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        canvas &target = pass ? that : direct;
+        target.save();
+        target.begin_path();
+        for ( int point = 0; point < 10; ++point )
+        {
+            float angle = static_cast< float >( point ) * 0.62831853f;
+            float radius = point & 1 ? 8.0f : 20.0f;
+            target.line_to( 20.5f + radius * sinf( angle ),
+                            20.25f - radius * cosf( angle ) );
+        }
+        target.close_path();
+        if ( pass )
+            that.prepare_fill( star );
+        target.begin_path();
+        target.move_to( 4.0f, 4.0f );
+        target.bezier_curve_to( 40.0f, 0.0f, 0.0f, 40.0f, 36.0f, 36.0f );
+        target.set_line_width( 3.0f );
+        float segments[] = { 6.0f, 3.0f };
+        target.set_line_dash( segments, 2 );
+        target.line_cap = circle;
+        if ( pass )
+            that.prepare_stroke( swirl );
+        target.begin_path();
+        target.arc( 0.5f * width, 0.5f * height, 0.4f * width,
+                    0.0f, 6.28318531f );
+        target.clip();
+        target.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.5f );
+        target.set_shadow_blur( 2.0f );
+        target.shadow_offset_x = 3.0f;
+        target.shadow_offset_y = 3.0f;
+        for ( int row = -1; row < 6; ++row )
+            for ( int column = -1; column < 6; ++column )
+            {
+                int x = column * 45 + row * 7;
+                int y = row * 45;
+                target.set_color( fill_style,
+                                  static_cast< float >( column ) / 5.0f,
+                                  static_cast< float >( row ) / 5.0f,
+                                  0.5f, 0.8f );
+                target.set_color( stroke_style, 0.0f, 0.2f, 0.8f, 1.0f );
+                if ( pass )
+                {
+                    that.draw_prepared( star, x, y );
+                    that.draw_prepared( swirl, x, y );
+                    continue;
+                }
+                direct.begin_path();
+                direct.set_transform( 1.0f, 0.0f, 0.0f, 1.0f,
+                                      static_cast< float >( x ),
+                                      static_cast< float >( y ) );
+                for ( int point = 0; point < 10; ++point )
+                {
+                    float angle = static_cast< float >( point ) * 0.62831853f;
+                    float radius = point & 1 ? 8.0f : 20.0f;
+                    direct.line_to( 20.5f + radius * sinf( angle ),
+                                    20.25f - radius * cosf( angle ) );
+                }
+                direct.close_path();
+                direct.fill();
+                direct.begin_path();
+                direct.move_to( 4.0f, 4.0f );
+                direct.bezier_curve_to( 40.0f, 0.0f, 0.0f, 40.0f, 36.0f, 36.0f );
+                direct.stroke();
+                direct.set_transform( 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f );
+            }
+    }
+    int error = image_error( that, direct, size_x, size_y );
+    that.restore();
+    prepared_path empty;
+    that.set_transform( 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f );
+    that.prepare_fill( empty );
+    that.draw_prepared( star, 0, 0 );
+    that.set_transform( 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f );
+    that.draw_prepared( empty, 0, 0 );
+    that.set_color( fill_style, error > 2, error <= 2, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.1f * height );
+}
+
+void fill_batch( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    canvas direct( size_x, size_y );
+    canvas replayed( size_x, size_y );
+    display_list list;
+    float offsets[ 240 ];
+    float colors[ 480 ];
+    for ( int copy = 0; copy < 120; ++copy )
+    {
+        float angle = static_cast< float >( copy ) * 0.5f;
+        float radius = 10.0f + static_cast< float >( copy ) * 0.8f;
+        offsets[ copy * 2 + 0 ] = radius * cosf( angle );
+        offsets[ copy * 2 + 1 ] = radius * sinf( angle );
+        colors[ copy * 4 + 0 ] = static_cast< float >( copy % 5 ) / 4.0f;
+        colors[ copy * 4 + 1 ] = static_cast< float >( copy % 7 ) / 6.0f;
+        colors[ copy * 4 + 2 ] = static_cast< float >( copy ) / 119.0f;
+        colors[ copy * 4 + 3 ] = 0.75f;
+    }
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        canvas &target = pass ? that : direct;
+        if ( pass )
+            that.set_recording( &list );
+        target.save();
+        target.set_transform( 1.1f, 0.2f, -0.2f, 0.9f,
+                              0.5f * width, 0.45f * height );
+        target.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.4f );
+        target.set_shadow_blur( 2.0f );
+        target.shadow_offset_x = 2.0f;
+        target.shadow_offset_y = 2.0f;
+        target.set_global_alpha( 0.9f );
+        for ( int copy = 0; copy < 120; ++copy )
+        {
+            if ( !pass )
+            {
+                target.save();
+                target.translate( offsets[ copy * 2 + 0 ],
+                                  offsets[ copy * 2 + 1 ] );
+                target.set_color( fill_style, colors[ copy * 4 + 0 ],
+                                  colors[ copy * 4 + 1 ],
+                                  colors[ copy * 4 + 2 ],
+                                  colors[ copy * 4 + 3 ] );
+            }
+            target.begin_path();
+            target.arc( 0.0f, 0.0f, 6.0f, 0.0f, 6.28318531f );
+            target.rectangle( -2.0f, -2.0f, 4.0f, 4.0f );
+            if ( !pass )
+            {
+                target.fill();
+                target.restore();
+            }
+            else if ( copy == 0 )
+                that.fill_batch( offsets, colors, 120 );
+        }
+        target.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.0f );
+        target.set_transform( 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f );
+        target.set_linear_gradient( fill_style, 0.0f, 0.0f, width, 0.0f );
+        target.add_color_stop( fill_style, 0.0f, 1.0f, 0.5f, 0.0f, 1.0f );
+        target.add_color_stop( fill_style, 1.0f, 0.0f, 0.5f, 1.0f, 1.0f );
+        for ( int copy = 0; copy < 12; ++copy )
+        {
+            float x = static_cast< float >( copy ) * width / 12.0f;
+            float y = 0.9f * height - static_cast< float >( copy & 1 ) * 8.0f;
+            target.begin_path();
+            target.move_to( x + 2.0f, y + 8.0f );
+            target.line_to( x + 10.0f, y - 6.0f );
+            target.line_to( x + 18.0f, y + 8.0f );
+            if ( !pass )
+                target.fill();
+        }
+        if ( pass )
+        {
+            float corners[ 24 ];
+            for ( int copy = 0; copy < 12; ++copy )
+            {
+                corners[ copy * 2 + 0 ] =
+                    static_cast< float >( copy ) * width / 12.0f -
+                    11.0f * width / 12.0f;
+                corners[ copy * 2 + 1 ] =
+                    static_cast< float >( 1 - ( copy & 1 ) ) * 8.0f;
+            }
+            that.fill_batch( corners, 0, 12 );
+            that.fill_batch( 0, colors, 12 );
+            that.fill_batch( corners, colors, 0 );
+            that.set_transform( 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f );
+            that.fill_batch( corners, colors, 12 );
+            that.set_recording( 0 );
+        }
+        target.restore();
+    }
+    replayed.replay( list );
+    int error = max( image_error( that, direct, size_x, size_y ),
+                     image_error( that, replayed, size_x, size_y ) );
+    that.set_color( fill_style, error > 2, error <= 2, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.1f * height );
+}
+
 void clear_rectangle( canvas &that, float width, float height )
 {
     that.set_color( stroke_style, 1.0f, 1.0f, 1.0f, 1.0f );
@@ -1601,6 +2118,99 @@ void stroke_rectangle( canvas &that, float width, float height )
     that.stroke();
 }
 
+void fill_rectangle_aligned( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    canvas general( size_x, size_y );
+    unsigned char checker[ 256 ];
+    for ( int index = 0; index < 256; ++index )
+        checker[ index ] = static_cast< unsigned char >(
+            ( index & 3 ) == 3 ? 255 :
+            ( ( index >> 2 & 1 ) ^ ( index >> 5 & 1 ) ) * 160 + ( index & 3 ) * 40 );
+    float const boxes[][ 4 ] = {
+        { 16.0f, 32.0f, 96.0f, 64.0f },
+        { 200.0f, 40.0f, -64.0f, 48.0f },
+        { -24.0f, 150.0f, 80.0f, 140.0f },
+        { 120.0f, 120.0f, 40.0f, -32.0f } };
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        canvas &target = pass ? general : that;
+        target.save();
+        target.begin_path();
+        target.arc( 0.5f * width, 0.55f * height, 0.42f * width, 0.0f, 6.28318531f );
+        target.clip();
+        target.set_color( fill_style, 0.3f, 0.6f, 0.9f, 1.0f );
+        target.fill_rectangle( 0.0f, 0.0f, width, height );
+        target.translate( 4.0f, 4.0f );
+        target.shadow_offset_x = 3.0f;
+        target.shadow_offset_y = 3.0f;
+        target.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.5f );
+        for ( int box = 0; box < 4; ++box )
+        {
+            target.set_shadow_blur( box & 1 ? 2.0f : 0.0f );
+            target.global_composite_operation = box == 3 ? exclusive_or : source_over;
+            target.set_color( fill_style, 0.25f * static_cast< float >( box ), 0.2f, 0.1f, 0.8f );
+            if ( pass )
+            {
+                float x = boxes[ box ][ 0 ];
+                float y = boxes[ box ][ 1 ];
+                float w = boxes[ box ][ 2 ];
+                float h = boxes[ box ][ 3 ];
+                target.begin_path();
+                target.move_to( x, y );
+                target.line_to( x + 0.5f * w, y );
+                target.line_to( x + w, y );
+                target.line_to( x + w, y + h );
+                target.line_to( x, y + h );
+                target.fill();
+            }
+            else
+                target.fill_rectangle( boxes[ box ][ 0 ], boxes[ box ][ 1 ],
+                                       boxes[ box ][ 2 ], boxes[ box ][ 3 ] );
+        }
+        target.global_composite_operation = source_over;
+        target.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.0f );
+        if ( pass )
+        {
+            target.global_composite_operation = destination_out;
+            target.begin_path();
+            target.move_to( 40.0f, 48.0f );
+            target.line_to( 40.0f, 72.0f );
+            target.line_to( 40.0f, 80.0f );
+            target.line_to( 72.0f, 80.0f );
+            target.line_to( 72.0f, 48.0f );
+            target.fill();
+            target.global_composite_operation = source_over;
+        }
+        else
+            target.clear_rectangle( 40.0f, 48.0f, 32.0f, 32.0f );
+        target.set_pattern( fill_style, checker, 8, 8, 32, repeat );
+        target.fill_rectangle( 136.0f, 176.0f, 24.0f, 24.0f );
+        target.draw_image( checker, 8, 8, 32, 168.0f, 176.0f, 8.0f, 8.0f );
+        target.restore();
+    }
+    vector< unsigned char > aligned( static_cast< size_t >( size_x * size_y * 4 ) );
+    vector< unsigned char > expected( aligned.size() );
+    that.get_image_data( &aligned[ 0 ], size_x, size_y, size_x * 4, 0, 0 );
+    general.get_image_data( &expected[ 0 ], size_x, size_y, size_x * 4, 0, 0 );
+    int error = 0;
+    for ( size_t index = 0; index < aligned.size(); ++index )
+        error = max( error, abs( aligned[ index ] - expected[ index ] ) );
+    for ( int y = 0; y < 24; ++y )
+        for ( int x = 0; x < 32; ++x )
+        {
+            int texel = ( y & 7 ) * 32 + x;
+            size_t pixel = static_cast< size_t >( ( ( y + 180 ) * size_x + 140 ) * 4 + x );
+            size_t image = static_cast< size_t >( ( ( y + 180 ) * size_x + 172 ) * 4 + x );
+            error = max( error, abs( aligned[ pixel ] - checker[ texel ] ) );
+            if ( y < 8 )
+                error = max( error, abs( aligned[ image ] - checker[ texel ] ) );
+        }
+    that.set_color( fill_style, error > 1, error <= 1, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.1f * height );
+}
+
 void text_align( canvas &that, float width, float height )
 {
     that.set_font( &font_a[ 0 ], static_cast< int >( font_a.size() ), 0.2f * height );
@@ -1740,6 +2350,96 @@ void measure_text( canvas &that, float width, float height )
     that.fill_text( "s", place, 0.2f * height );
 }
 
+void set_glyph_cache( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    canvas small( size_x, size_y );
+    canvas none( size_x, size_y );
+    that.set_glyph_cache( -1 );
+    small.set_glyph_cache( 400 );
+    none.set_glyph_cache( 0 );
+    for ( int pass = 0; pass < 3; ++pass )
+    {
+        canvas &target = pass == 0 ? that : pass == 1 ? small : none;
+        target.set_color( fill_style, 0.0f, 0.0f, 0.0f, 1.0f );
+        target.set_font( &font_a[ 0 ], static_cast< int >( font_a.size() ), 0.2f * height );
+        target.fill_text( "CE\xc3\x8dI*", 0.05f * width, 0.35f * height );
+        target.save();
+        target.set_font( &font_b[ 0 ], static_cast< int >( font_b.size() ), 0.2f * height );
+        target.fill_text( "CE\xc3\x8dI*", 0.05f * width, 0.6f * height );
+        target.restore();
+        target.set_font( 0, 0, 0.15f * height );
+        target.rotate( 0.1f );
+        target.set_color( stroke_style, 0.0f, 0.0f, 1.0f, 1.0f );
+        target.stroke_text( "Canvas Ity", 0.1f * width, 0.8f * height );
+        target.set_transform( 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f );
+    }
+    bool same = ( image_error( that, small, size_x, size_y ) == 0 &&
+                  image_error( that, none, size_x, size_y ) == 0 );
+    that.set_color( fill_style, !same, same, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.1f * height );
+}
+
+void set_font_shared( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    typeface missing;
+    bool right = ( !that.set_font( missing, 0.2f * height ) &&
+                   !missing.load( &font_a[ 0 ], 5 ) &&
+                   !that.set_font( missing, 0.2f * height ) );
+    typeface shared;
+    typeface borrowed;
+    shared.load( &font_b[ 0 ], static_cast< int >( font_b.size() ) );
+    borrowed.load( &font_a[ 0 ], static_cast< int >( font_a.size() ), true );
+    typeface reloaded( shared );
+    reloaded.load( &font_a[ 0 ], static_cast< int >( font_a.size() ) );
+    {
+        typeface brief;
+        brief.load( &font_a[ 0 ], static_cast< int >( font_a.size() ) );
+        canvas first( size_x, size_y );
+        first.set_font( shared, 0.1f * height );
+        first.fill_text( "Ity", 0.0f, 0.5f * height );
+        that.set_font( brief, 0.2f * height );
+    }
+    canvas copying( size_x, size_y );
+    copying.set_font( &font_a[ 0 ], static_cast< int >( font_a.size() ), 0.2f * height );
+    char const *const rows[] = { "Ity*", "Cyan", "tansy", "nasty" };
+    float widths[ 2 ][ 4 ];
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        canvas &target = pass ? copying : that;
+        target.set_color( fill_style, 0.1f, 0.1f, 0.1f, 1.0f );
+        target.fill_text( "Canvas", 0.05f * width, 0.32f * height );
+        target.set_line_width( 1.5f );
+        for ( int row = 0; row < 4; ++row )
+        {
+            float size = ( 0.08f + 0.03f * static_cast< float >( row ) ) * height;
+            float y = ( 0.45f + 0.15f * static_cast< float >( row ) ) * height;
+            bool odd = row & 1;
+            if ( pass )
+                target.set_font( odd ? &font_a[ 0 ] : &font_b[ 0 ],
+                                 static_cast< int >( odd ? font_a.size() : font_b.size() ),
+                                 size );
+            else
+                target.set_font( !odd ? shared : row == 1 ? borrowed : reloaded, size );
+            float shade = 0.3f * static_cast< float >( row );
+            target.set_color( fill_style, shade, 0.2f, 0.9f - shade, 1.0f );
+            target.set_color( stroke_style, 0.9f - shade, 0.4f, shade, 1.0f );
+            target.fill_text( rows[ row ], 0.05f * width, y );
+            target.stroke_text( rows[ row ], 0.55f * width, y );
+            widths[ pass ][ row ] = target.measure_text( rows[ row ] );
+        }
+    }
+    for ( int row = 0; row < 4; ++row )
+        right = right && widths[ 0 ][ row ] > 0.0f &&
+            widths[ 0 ][ row ] == widths[ 1 ][ row ];
+    right = right && image_error( that, copying, size_x, size_y ) == 0;
+    that.set_color( fill_style, !right, right, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.1f * height );
+}
+
 void draw_image( canvas &that, float width, float height )
 {
     unsigned char checker[ 1024 ];
@@ -1797,6 +2497,194 @@ void draw_image_matted( canvas &that, float width, float height )
     }
 }
 
+void image_smoothing( canvas &that, float width, float height )
+{
+    unsigned char checker[ 256 ];
+    for ( int index = 0; index < 256; ++index )
+        checker[ index ] = static_cast< unsigned char >(
+            ( ( ( index >> 2 & 1 ) ^ ( index >> 5 & 1 ) ) |
+              ( ( index & 3 ) == 3 ) ) * 255 );
+    unsigned char fine[ 4096 ];
+    for ( int index = 0; index < 4096; ++index )
+        fine[ index ] = static_cast< unsigned char >(
+            ( ( ( ( index >> 2 ) + ( index >> 7 ) ) & 1 ) |
+              ( ( index & 3 ) == 3 ) ) * 255 );
+    smoothing_style const styles[] = { nearest, bilinear, bicubic };
+    for ( int style = 0; style < 3; ++style )
+    {
+        float x = static_cast< float >( style ) * width / 3.0f + 6.0f;
+        that.image_smoothing = styles[ style ];
+        that.draw_image( checker, 8, 8, 32, x, 6.0f, 72.0f, 72.0f );
+        that.draw_image( fine, 32, 32, 128, x, 84.0f, 24.0f, 24.0f );
+        that.draw_image( fine, 32, 32, 128, x + 30.0f, 84.0f, 42.0f, 18.0f );
+        that.save();
+        that.set_pattern( fill_style, checker, 8, 8, 32, repeat );
+        that.translate( x + 0.25f, 114.0f );
+        that.scale( 2.5f, 2.5f );
+        that.fill_rectangle( 0.0f, 0.0f, 28.8f, 24.0f );
+        that.restore();
+        that.save();
+        that.translate( x + 36.0f, height * 0.8f );
+        that.rotate( 0.3f );
+        that.draw_image( checker, 8, 8, 32, -24.0f, -24.0f, 48.0f, 48.0f );
+        that.restore();
+    }
+}
+
+void pattern_edge( canvas &that, float width, float height )
+{
+    unsigned char checker[ 64 * 64 * 4 ];
+    for ( int index = 0; index < 64 * 64 * 4; ++index )
+        checker[ index ] = static_cast< unsigned char >(
+            ( ( ( index >> 4 & 1 ) ^ ( index >> 10 & 1 ) ) |
+              ( ( index & 3 ) == 3 ) ) * 255 );
+    int size_x = static_cast< int >( width );
+    canvas strip( size_x, 64 );
+    strip.set_pattern( fill_style, checker, 64, 64, 256, no_repeat );
+    strip.translate( 100.0f, 0.0f );
+    strip.scale( 0.75f, 0.75f );
+    strip.fill_rectangle( -200.0f, 0.0f, 800.0f, 128.0f );
+    vector< unsigned char > row( static_cast< size_t >( size_x * 64 * 4 ) );
+    strip.get_image_data( &row[ 0 ], size_x, 64, size_x * 4, 0, 0 );
+    for ( int y = 0; y < 4; ++y )
+        that.put_image_data( &row[ 0 ], size_x, 64, size_x * 4, 0,
+                             y * static_cast< int >( height ) / 4 );
+    that.set_pattern( fill_style, checker, 64, 64, 256, no_repeat );
+    that.translate( 30.0f, 70.0f );
+    that.scale( 1.6f, 0.6f );
+    that.fill_rectangle( -200.0f, 0.0f, 800.0f, 128.0f );
+}
+
+void draw_image_shrunk( canvas &that, float width, float height )
+{
+    std::vector< unsigned char > rings( 61 * 59 * 4 );
+    for ( int y = 0; y < 59; ++y )
+        for ( int x = 0; x < 61; ++x )
+        {
+            int radius = ( x - 30 ) * ( x - 30 ) + ( y - 29 ) * ( y - 29 );
+            unsigned char *texel = &rings[ static_cast< size_t >(
+                ( y * 61 + x ) * 4 ) ];
+            texel[ 0 ] = static_cast< unsigned char >(
+                ( radius / 24 & 1 ) * 255 );
+            texel[ 1 ] = static_cast< unsigned char >(
+                ( radius / 40 & 1 ) * 255 );
+            texel[ 2 ] = static_cast< unsigned char >( x * 4 );
+            texel[ 3 ] = 255;
+        }
+    float x = 4.0f;
+    for ( float size = 60.0f; size >= 2.0f; size *= 0.5f )
+    {
+        that.draw_image( &rings[ 0 ], 61, 59, 61 * 4, x, 4.0f, size, size );
+        that.draw_image( &rings[ 0 ], 61, 59, 61 * 4,
+                         x, 72.0f, size, 0.5f * size );
+        x += size + 4.0f;
+    }
+    that.set_pattern( fill_style, &rings[ 0 ], 61, 59, 61 * 4, repeat );
+    that.save();
+    that.scale( 0.1f, 0.1f );
+    that.fill_rectangle( 40.0f, 1100.0f, 1200.0f, 300.0f );
+    that.restore();
+    that.save();
+    that.translate( 0.5f * width, 0.75f * height );
+    that.rotate( 0.4f );
+    that.scale( 0.15f, 0.2f );
+    that.fill_rectangle( -400.0f, -200.0f, 800.0f, 400.0f );
+    that.restore();
+    that.image_smoothing = bilinear;
+    that.draw_image( &rings[ 0 ], 61, 59, 61 * 4,
+                     0.0f, height - 24.0f, 20.0f, 20.0f );
+}
+
+void draw_image_shared( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    std::vector< unsigned char > rings( 61 * 59 * 4 );
+    for ( int y = 0; y < 59; ++y )
+        for ( int x = 0; x < 61; ++x )
+        {
+            int radius = ( x - 30 ) * ( x - 30 ) + ( y - 29 ) * ( y - 29 );
+            unsigned char *texel = &rings[ static_cast< size_t >(
+                ( y * 61 + x ) * 4 ) ];
+            texel[ 0 ] = static_cast< unsigned char >(
+                ( radius / 24 & 1 ) * 255 );
+            texel[ 1 ] = static_cast< unsigned char >(
+                ( radius / 40 & 1 ) * 255 );
+            texel[ 2 ] = static_cast< unsigned char >( x * 4 );
+            texel[ 3 ] = 255;
+        }
+    shared_image missing;
+    bool failed = ( !missing.load( 0, 61, 59, 61 * 4 ) &&
+                    !missing.load( &rings[ 0 ], 0, 59, 61 * 4 ) );
+    that.set_pattern( fill_style, missing, repeat );
+    that.draw_image( missing, 0.0f, 0.0f, width, height );
+    shared_image image;
+    {
+        shared_image loaded;
+        loaded.load( &rings[ 0 ], 61, 59, 61 * 4 );
+        image = loaded;
+    }
+    canvas copying( size_x, size_y );
+    canvas recorder( size_x, size_y );
+    display_list list;
+    recorder.set_recording( &list );
+    for ( int pass = 0; pass < 3; ++pass )
+    {
+        canvas &target = pass == 0 ? that : pass == 1 ? copying : recorder;
+        bool copied = pass == 1;
+        float x = 4.0f;
+        for ( float size = 60.0f; size >= 2.0f; size *= 0.5f )
+        {
+            if ( copied )
+                target.draw_image( &rings[ 0 ], 61, 59, 61 * 4,
+                                   x, 4.0f, size, size );
+            else
+                target.draw_image( image, x, 4.0f, size, size );
+            x += size + 4.0f;
+        }
+        if ( copied )
+            target.set_pattern( fill_style, &rings[ 0 ], 61, 59, 61 * 4, repeat );
+        else
+            target.set_pattern( fill_style, image, repeat );
+        target.save();
+        target.scale( 0.1f, 0.1f );
+        target.fill_rectangle( 40.0f, 700.0f, 1200.0f, 300.0f );
+        target.set_color( fill_style, 0.0f, 0.0f, 1.0f, 1.0f );
+        target.fill_rectangle( 1300.0f, 700.0f, 1000.0f, 300.0f );
+        target.restore();
+        target.save();
+        target.translate( 0.5f * width, 0.65f * height );
+        target.rotate( 0.4f );
+        target.scale( 0.15f, 0.2f );
+        target.fill_rectangle( -400.0f, -150.0f, 800.0f, 300.0f );
+        target.restore();
+        target.save();
+        target.translate( 4.0f, 0.78f * height );
+        if ( copied )
+            target.set_pattern( stroke_style, &rings[ 0 ], 61, 59, 61 * 4, no_repeat );
+        else
+            target.set_pattern( stroke_style, image, no_repeat );
+        target.set_line_width( 8.0f );
+        target.stroke_rectangle( 6.0f, 6.0f, 50.0f, 40.0f );
+        target.image_smoothing = nearest;
+        if ( copied )
+            target.draw_image( &rings[ 0 ], 61, 59, 61 * 4,
+                               0.55f * width, 0.0f, 80.0f, 40.0f );
+        else
+            target.draw_image( image, 0.55f * width, 0.0f, 80.0f, 40.0f );
+        target.restore();
+        target.fill_rectangle( 0.3f * width, 0.8f * height, 40.0f, 40.0f );
+    }
+    recorder.set_recording( 0 );
+    canvas tiled( size_x, size_y );
+    tiled.replay_tiles( list, 0, 0, size_x, size_y, 48 );
+    bool same = ( failed &&
+                  image_error( that, copying, size_x, size_y ) == 0 &&
+                  image_error( that, tiled, size_x, size_y ) <= 1 );
+    that.set_color( fill_style, !same, same, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.05f * height );
+}
+
 void get_image_data( canvas &that, float width, float height )
 {
     for ( int index = 0; index < 100; ++index )
@@ -1852,6 +2740,204 @@ void put_image_data( canvas &that, float width, float height )
     that.put_image_data( 0, 32, 32, 128, 0, 0 );
 }
 
+void image_data_round_trip( canvas &that, float width, float height )
+{
+    unsigned char levels[ 64 * 64 * 4 ];
+    for ( int y = 0; y < 64; ++y )
+        for ( int x = 0; x < 64; ++x )
+        {
+            int level = ( x >> 2 ) + ( ( y >> 2 ) << 4 );
+            levels[ ( y * 64 + x ) * 4 + 0 ] = static_cast< unsigned char >( level );
+            levels[ ( y * 64 + x ) * 4 + 1 ] = static_cast< unsigned char >( 255 - level );
+            levels[ ( y * 64 + x ) * 4 + 2 ] = static_cast< unsigned char >( level * 37 & 255 );
+            levels[ ( y * 64 + x ) * 4 + 3 ] = 255;
+        }
+    that.put_image_data( levels, 64, 64, 256, 0, 0 );
+    unsigned char again[ 64 * 64 * 4 ];
+    that.get_image_data( again, 64, 64, 256, 0, 0 );
+    bool exact = true;
+    for ( int index = 0; index < 64 * 64 * 4; ++index )
+        exact = exact && again[ index ] == levels[ index ];
+    for ( int column = 0; column < 256; ++column )
+    {
+        float level = ( static_cast< float >( column ) + 0.37f ) / 256.0f;
+        that.set_color( fill_style, level, level * level, 1.0f - level, 1.0f );
+        that.fill_rectangle( static_cast< float >( column ), 0.5f * height,
+                             1.0f, 0.25f * height );
+    }
+    static float const bayer[][ 4 ] = {
+        { 0.03125f, 0.53125f, 0.15625f, 0.65625f },
+        { 0.78125f, 0.28125f, 0.90625f, 0.40625f },
+        { 0.21875f, 0.71875f, 0.09375f, 0.59375f },
+        { 0.96875f, 0.46875f, 0.84375f, 0.34375f } };
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( 0.25f * height );
+    int top = static_cast< int >( 0.5f * height );
+    vector< unsigned char > ramp( static_cast< size_t >( size_x * size_y * 4 ) );
+    that.get_image_data( &ramp[ 0 ], size_x, size_y, size_x * 4, 0, top );
+    int error = 0;
+    for ( int y = 0; y < size_y; ++y )
+        for ( int x = 0; x < size_x; ++x )
+        {
+            double level = ( x + 0.37 ) / 256.0;
+            double values[] = { level, level * level, 1.0 - level };
+            for ( int channel = 0; channel < 3; ++channel )
+            {
+                int expect = static_cast< int >(
+                    static_cast< double >( bayer[ ( y + top ) & 3 ][ x & 3 ] ) +
+                    255.0 * values[ channel ] );
+                int actual = ramp[ static_cast< size_t >( ( y * size_x + x ) * 4 + channel ) ];
+                error = max( error, abs( actual - expect ) );
+            }
+        }
+    that.set_color( fill_style, !exact || error > 1, exact && error <= 1, 0.0f, 1.0f );
+    that.fill_rectangle( 64.0f, 0.0f, width, 64.0f );
+}
+
+void tall_canvas( canvas &that, float width, float height )
+{
+#ifdef CANVAS_ITY_WIDE_RUNS
+    int const rows = 70000;
+#else
+    int const rows = 32768;
+#endif
+    canvas tall( 64, rows, srgb_byte );
+    canvas small( 64, 256, srgb_byte );
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        canvas &target = pass ? small : tall;
+        target.translate( 0.0f, static_cast< float >( pass ? 0 : rows - 256 ) );
+        target.set_linear_gradient( fill_style, 0.0f, 0.0f, 64.0f, 256.0f );
+        target.add_color_stop( fill_style, 0.0f, 0.9f, 0.2f, 0.1f, 1.0f );
+        target.add_color_stop( fill_style, 1.0f, 0.1f, 0.3f, 0.9f, 1.0f );
+        target.fill_rectangle( 4.0f, 8.0f, 56.0f, 100.5f );
+        target.set_color( fill_style, 0.1f, 0.8f, 0.3f, 1.0f );
+        target.begin_path();
+        target.move_to( 4.0f, 250.0f );
+        target.line_to( 32.0f, 120.0f );
+        target.line_to( 60.0f, 250.0f );
+        target.line_to( 32.0f, 180.5f );
+        target.fill();
+    }
+    vector< unsigned char > strip( 64 * 256 * 4 );
+    vector< unsigned char > expected( 64 * 256 * 4 );
+    tall.get_image_data( &strip[ 0 ], 64, 256, 64 * 4, 0, rows - 256 );
+    small.get_image_data( &expected[ 0 ], 64, 256, 64 * 4, 0, 0 );
+    int error = 0;
+    for ( size_t index = 0; index < strip.size(); ++index )
+        error = max( error, abs( strip[ index ] - expected[ index ] ) );
+    for ( int x = 0; x < static_cast< int >( width ); x += 64 )
+        that.put_image_data( &strip[ 0 ], 64, 256, 64 * 4, x, 0 );
+    that.set_color( fill_style, error > 1, error <= 1, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.9f * height, width, 0.1f * height );
+}
+
+void fill_large( canvas &that, float width, float height )
+{
+    canvas large( 2048, 2048, srgb_byte );
+    canvas upper( 2048, 1024, srgb_byte );
+    canvas lower( 2048, 1024, srgb_byte );
+    for ( int pass = 0; pass < 3; ++pass )
+    {
+        canvas &target = pass == 0 ? large : pass == 1 ? upper : lower;
+        target.translate( 0.0f, pass == 2 ? -1024.0f : 0.0f );
+        target.set_radial_gradient( fill_style, 1024.0f, 1024.0f, 0.0f,
+                                    1024.0f, 1024.0f, 1200.0f );
+        target.add_color_stop( fill_style, 0.0f, 1.0f, 0.8f, 0.1f, 1.0f );
+        target.add_color_stop( fill_style, 1.0f, 0.5f, 0.0f, 0.4f, 1.0f );
+        target.begin_path();
+        for ( int point = 0; point < 48; ++point )
+        {
+            float angle = static_cast< float >( point ) * 0.130899694f;
+            float radius = point & 1 ? 40.0f : 1400.0f;
+            target.line_to( 1024.0f + radius * cosf( angle ),
+                            1024.0f + radius * sinf( angle ) );
+        }
+        target.fill();
+    }
+    vector< unsigned char > whole( 2048 * 1024 * 4 );
+    vector< unsigned char > half( 2048 * 1024 * 4 );
+    int error = 0;
+    for ( int part = 0; part < 2; ++part )
+    {
+        large.get_image_data( &whole[ 0 ], 2048, 1024, 2048 * 4, 0, part * 1024 );
+        ( part ? lower : upper ).get_image_data( &half[ 0 ], 2048, 1024, 2048 * 4, 0, 0 );
+        for ( size_t index = 0; index < whole.size(); ++index )
+            error = max( error, abs( whole[ index ] - half[ index ] ) );
+    }
+    bool right = error <= 1;
+    large.get_image_data( &whole[ 0 ], 256, 256, 256 * 4, 896, 896 );
+    that.put_image_data( &whole[ 0 ], 256, 256, 256 * 4, 0, 0 );
+    that.set_color( fill_style, !right, right, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.9f * height, width, 0.1f * height );
+}
+
+void take_dirty_region( canvas &that, float width, float height )
+{
+    int x, y, size_x, size_y;
+    bool right = !that.take_dirty_region( x, y, size_x, size_y ) &&
+        x == 0 && y == 0 && size_x == 0 && size_y == 0;
+    int expected[][ 4 ] = {
+        { 20, 20, 60, 50 }, { 100, 20, 170, 92 }, { 200, 0, 256, 40 },
+        { 20, 120, 120, 200 }, { 140, 150, 180, 190 } };
+    for ( int step = 0; step < 5; ++step )
+    {
+        if ( step == 0 )
+            that.fill_rectangle( 20.0f, 20.0f, 40.0f, 30.0f );
+        else if ( step == 1 )
+        {
+            that.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.5f );
+            that.shadow_offset_x = 10.0f;
+            that.shadow_offset_y = 12.0f;
+            that.begin_path();
+            that.arc( 130.0f, 50.0f, 30.0f, 0.0f, 6.28318531f );
+            that.fill();
+            that.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.0f );
+        }
+        else if ( step == 2 )
+        {
+            unsigned char gray[ 64 * 64 * 4 ];
+            for ( int index = 0; index < 64 * 64 * 4; ++index )
+                gray[ index ] = 128;
+            that.put_image_data( gray, 64, 64, 256, 200, -24 );
+        }
+        else if ( step == 3 )
+        {
+            that.save();
+            that.begin_path();
+            that.rectangle( 20.0f, 120.0f, 100.0f, 80.0f );
+            that.clip();
+            that.global_composite_operation = source_copy;
+            that.set_color( fill_style, 0.2f, 0.4f, 0.8f, 1.0f );
+            that.fill_rectangle( 40.0f, 140.0f, 20.0f, 20.0f );
+            that.restore();
+            that.fill_rectangle( -50.0f, -50.0f, 20.0f, 20.0f );
+        }
+        else
+        {
+            that.set_color( fill_style, 0.8f, 0.4f, 0.2f, 1.0f );
+            that.fill_rectangle( 130.0f, 140.0f, 60.0f, 60.0f );
+            that.take_dirty_region( x, y, size_x, size_y );
+            that.clear_rectangle( 140.0f, 150.0f, 40.0f, 40.0f );
+        }
+        bool taken = that.take_dirty_region( x, y, size_x, size_y );
+        int const *box = expected[ step ];
+        right = right && taken &&
+            box[ 0 ] - 4 <= x && x <= box[ 0 ] &&
+            box[ 1 ] - 4 <= y && y <= box[ 1 ] &&
+            box[ 2 ] <= x + size_x && x + size_x <= box[ 2 ] + 4 &&
+            box[ 3 ] <= y + size_y && y + size_y <= box[ 3 ] + 4;
+        right = right && !that.take_dirty_region( x, y, size_x, size_y );
+    }
+    that.set_color( fill_style, !right, right, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.9f * height, width, 0.1f * height );
+    that.take_dirty_region( x, y, size_x, size_y );
+    right = x == 0 && size_x == static_cast< int >( width ) &&
+        y + size_y == static_cast< int >( height );
+    that.set_color( fill_style, !right, right, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.85f * height, width, 0.05f * height );
+}
+
 void save_restore( canvas &that, float width, float height )
 {
     that.rectangle( width * 0.25f, height * 0.25f,
@@ -1872,6 +2958,551 @@ void save_restore( canvas &that, float width, float height )
     that.save();
 }
 
+void save_restore_nested( canvas &that, float width, float height )
+{
+    that.set_font( &font_a[ 0 ], static_cast< int >( font_a.size() ), 0.2f * height );
+    that.set_line_width( 4.0f );
+    that.set_linear_gradient( fill_style, 0.0f, 0.0f, width, 0.0f );
+    that.add_color_stop( fill_style, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f );
+    that.add_color_stop( fill_style, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f );
+    that.save();
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.2f * height );
+    float dash[] = { 8.0f, 4.0f };
+    that.set_line_dash( dash, 2 );
+    that.set_color( stroke_style, 0.0f, 0.5f, 0.0f, 1.0f );
+    that.save();
+    that.add_color_stop( fill_style, 0.5f, 1.0f, 1.0f, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.2f * height, width, 0.2f * height );
+    that.set_font( &font_b[ 0 ], static_cast< int >( font_b.size() ), 0.15f * height );
+    that.save();
+    that.set_color( fill_style, 0.0f, 0.0f, 0.0f, 1.0f );
+    that.set_line_dash( 0, 0 );
+    that.fill_text( "CE", 0.05f * width, 0.6f * height );
+    that.stroke_rectangle( 0.05f * width, 0.42f * height, 0.4f * width, 0.25f * height );
+    that.restore();
+    that.fill_text( "CE", 0.55f * width, 0.6f * height );
+    that.stroke_rectangle( 0.55f * width, 0.42f * height, 0.4f * width, 0.25f * height );
+    that.restore();
+    that.fill_text( "CE", 0.05f * width, 0.9f * height );
+    that.stroke_rectangle( 0.05f * width, 0.72f * height, 0.4f * width, 0.25f * height );
+    that.restore();
+    that.fill_text( "CE", 0.55f * width, 0.9f * height );
+    that.stroke_rectangle( 0.55f * width, 0.72f * height, 0.4f * width, 0.25f * height );
+}
+
+void display_scene( canvas &target, unsigned char const *checker, float width, float height )
+{
+    target.set_linear_gradient( fill_style, 0.0f, 0.0f, width, height );
+    target.add_color_stop( fill_style, 0.0f, 0.9f, 0.8f, 0.6f, 1.0f );
+    target.add_color_stop( fill_style, 1.0f, 0.5f, 0.7f, 0.9f, 1.0f );
+    target.fill_rectangle( 0.0f, 0.0f, width, height );
+    target.save();
+    target.translate( 0.3f * width, 0.3f * height );
+    target.rotate( 0.3f );
+    float dash[] = { 12.0f, 6.0f, 3.0f };
+    target.set_line_dash( dash, 3 );
+    target.line_cap = circle;
+    target.set_line_width( 5.0f );
+    target.set_color( stroke_style, 0.2f, 0.1f, 0.6f, 1.0f );
+    target.begin_path();
+    target.arc( 0.0f, 0.0f, 0.2f * width, 0.0f, 5.0f );
+    target.quadratic_curve_to( 0.1f * width, 0.3f * height, 0.0f, 0.0f );
+    target.stroke();
+    target.restore();
+    target.set_pattern( fill_style, checker, 16, 16, 64, repeat );
+    target.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.5f );
+    target.set_shadow_blur( 4.0f );
+    target.shadow_offset_x = 3.0f;
+    target.shadow_offset_y = 3.0f;
+    target.begin_path();
+    target.move_to( 0.6f * width, 0.1f * height );
+    target.bezier_curve_to( 0.9f * width, 0.0f, 1.0f * width, 0.4f * height,
+                              0.7f * width, 0.4f * height );
+    target.arc_to( 0.5f * width, 0.4f * height, 0.6f * width, 0.1f * height, 10.0f );
+    target.close_path();
+    target.fill();
+    target.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.0f );
+    target.set_font( &font_a[ 0 ], static_cast< int >( font_a.size() ), 0.2f * height );
+    target.set_color( fill_style, 0.1f, 0.3f, 0.1f, 1.0f );
+    target.text_align = center;
+    target.fill_text( "CE", 0.2f * width, 0.6f * height );
+    target.set_font( 0, 0, 0.15f * height );
+    target.stroke_text( "CE", 0.2f * width, 0.72f * height, 0.3f * width );
+    target.save();
+    target.begin_path();
+    target.rectangle( 0.5f * width, 0.5f * height, 0.4f * width, 0.4f * height );
+    target.clip();
+    target.image_smoothing = nearest;
+    target.set_global_alpha( 0.75f );
+    target.draw_image( checker, 16, 16, 64, 0.45f * width, 0.45f * height,
+                         0.3f * width, 0.3f * height );
+    target.global_composite_operation = lighter;
+    target.set_color( fill_style, 0.0f, 0.4f, 0.0f, 1.0f );
+    target.set_transform( 1.0f, 0.2f, 0.0f, 1.0f, 0.0f, 0.0f );
+    target.fill_rectangle( 0.7f * width, 0.5f * height, 0.2f * width, 0.2f * height );
+    target.restore();
+    target.stroke_rectangle( 0.5f * width, 0.5f * height, 0.4f * width, 0.4f * height );
+    target.clear_rectangle( 0.92f * width, 0.92f * height, 0.05f * width, 0.05f * height );
+    target.put_image_data( checker, 8, 8, 64, static_cast< int >( width ) - 16, 16 );
+}
+
+void display_list_replay( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    unsigned char checker[ 1024 ];
+    for ( int index = 0; index < 1024; ++index )
+        checker[ index ] = static_cast< unsigned char >(
+            ( ( ( index >> 2 & 1 ) ^ ( index >> 6 & 1 ) ) |
+              ( ( index & 3 ) == 3 ) ) * 255 );
+    canvas direct( size_x, size_y );
+    canvas recorder( size_x, size_y );
+    display_list list;
+    recorder.set_recording( &list );
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        canvas &target = pass ? recorder : direct;
+        display_scene( target, checker, width, height );
+        target.save();
+        target.transform( 1.0f, 0.0f, -0.3f, 1.0f, 0.27f * width, 0.0f );
+        target.set_radial_gradient( stroke_style,
+                                    0.37f * width, 0.87f * height, 0.0f,
+                                    0.37f * width, 0.87f * height,
+                                    0.1f * width );
+        target.add_color_stop( stroke_style, 0.0f, 1.0f, 0.9f, 0.2f, 1.0f );
+        target.add_color_stop( stroke_style, 1.0f, 0.8f, 0.1f, 0.3f, 1.0f );
+        target.line_join = miter;
+        target.set_miter_limit( 3.0f );
+        target.set_line_width( 4.0f );
+        target.begin_path();
+        target.move_to( 0.28f * width, 0.95f * height );
+        target.line_to( 0.31f * width, 0.8f * height );
+        target.line_to( 0.34f * width, 0.95f * height );
+        target.line_to( 0.4f * width, 0.8f * height );
+        target.line_to( 0.46f * width, 0.95f * height );
+        target.stroke();
+        target.restore();
+    }
+    recorder.set_recording( 0 );
+    recorder.fill_rectangle( 0.0f, 0.0f, width, height );
+    display_list copied;
+    that.set_recording( &copied );
+    that.replay( list );
+    that.set_recording( 0 );
+    canvas twice( size_x, size_y );
+    twice.replay( copied );
+    display_list cleared( list );
+    cleared.clear();
+    twice.replay( cleared );
+    bool same = ( image_error( that, direct, size_x, size_y ) == 0 &&
+                  image_error( that, twice, size_x, size_y ) == 0 );
+    vector< unsigned char > scaled( static_cast< size_t >( size_x * size_y / 4 ) );
+    canvas small( size_x / 4, size_y / 4 );
+    small.scale( 0.25f, 0.25f );
+    small.replay( list );
+    small.get_image_data( &scaled[ 0 ], size_x / 4, size_y / 4, size_x, 0, 0 );
+    that.put_image_data( &scaled[ 0 ], size_x / 4, size_y / 4, size_x, 0, size_y - size_y / 4 );
+    that.set_color( fill_style, !same, same, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.05f * height );
+}
+
+struct reverse_runner : task_runner
+{
+    void run( void ( *task )( void *, int ), void *data, int count )
+    {
+        for ( int index = count - 1; index >= 0; --index )
+            task( data, index );
+    }
+};
+
+// Runs each task on a thread of its own when built with TEST_WITH_THREADS,
+// so that a thread sanitizer can check how canvases on different threads
+// share resources.  Otherwise, it just runs them in order.
+//
+struct thread_runner : task_runner
+{
+    struct job { void ( *task )( void *, int ); void *data; int index; };
+#if defined( TEST_WITH_THREADS ) && defined( _WIN32 )
+    static DWORD WINAPI start( LPVOID argument )
+    {
+        job &that = *static_cast< job * >( argument );
+        that.task( that.data, that.index );
+        return 0;
+    }
+#elif defined( TEST_WITH_THREADS )
+    static void *start( void *argument )
+    {
+        job &that = *static_cast< job * >( argument );
+        that.task( that.data, that.index );
+        return 0;
+    }
+#endif
+    void run( void ( *task )( void *, int ), void *data, int count )
+    {
+        vector< job > jobs( static_cast< size_t >( count ) );
+        for ( int index = 0; index < count; ++index )
+        {
+            jobs[ static_cast< size_t >( index ) ].task = task;
+            jobs[ static_cast< size_t >( index ) ].data = data;
+            jobs[ static_cast< size_t >( index ) ].index = index;
+        }
+#if defined( TEST_WITH_THREADS ) && defined( _WIN32 )
+        vector< HANDLE > threads( jobs.size() );
+        for ( size_t index = 0; index < jobs.size(); ++index )
+            threads[ index ] = CreateThread( 0, 0, start, &jobs[ index ], 0, 0 );
+        for ( size_t index = 0; index < jobs.size(); ++index )
+        {
+            WaitForSingleObject( threads[ index ], INFINITE );
+            CloseHandle( threads[ index ] );
+        }
+#elif defined( TEST_WITH_THREADS )
+        vector< pthread_t > threads( jobs.size() );
+        for ( size_t index = 0; index < jobs.size(); ++index )
+            pthread_create( &threads[ index ], 0, start, &jobs[ index ] );
+        for ( size_t index = 0; index < jobs.size(); ++index )
+            pthread_join( threads[ index ], 0 );
+#else
+        for ( size_t index = 0; index < jobs.size(); ++index )
+            task( data, jobs[ index ].index );
+#endif
+    }
+};
+
+void set_task_runner( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    canvas serial( size_x, size_y );
+    reverse_runner runner;
+    that.set_task_runner( &runner, 0 );
+    that.set_task_runner( &runner, 7 );
+    unsigned char checker[ 64 ];
+    for ( int index = 0; index < 64; ++index )
+        checker[ index ] = static_cast< unsigned char >(
+            ( ( index >> 2 & 1 ) ^ ( index >> 4 & 1 ) ) * 255 );
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        canvas &target = pass ? that : serial;
+        target.save();
+        target.arc( 0.5f * width, 0.5f * height, 0.45f * height,
+                    0.0f, 6.28318531f );
+        target.clip();
+        target.set_radial_gradient( fill_style,
+                                    0.3f * width, 0.3f * height, 0.0f,
+                                    0.5f * width, 0.5f * height,
+                                    0.6f * width );
+        target.add_color_stop( fill_style, 0.0f, 1.0f, 1.0f, 0.0f, 1.0f );
+        target.add_color_stop( fill_style, 0.5f, 0.0f, 0.5f, 1.0f, 0.8f );
+        target.add_color_stop( fill_style, 1.0f, 0.5f, 0.0f, 0.2f, 1.0f );
+        target.fill_rectangle( 0.0f, 0.0f, width, height );
+        target.set_pattern( stroke_style, checker, 4, 4, 16, repeat );
+        target.set_line_width( 12.0f );
+        target.rotate( 0.3f );
+        target.stroke_rectangle( 0.3f * width, 0.0f,
+                                 0.4f * width, 0.5f * height );
+        target.global_composite_operation = source_atop;
+        target.set_color( fill_style, 0.0f, 0.0f, 0.0f, 0.5f );
+        target.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.5f );
+        target.set_shadow_blur( 4.0f );
+        target.fill_rectangle( 0.4f * width, 0.4f * height,
+                               0.3f * width, 0.1f * height );
+    }
+    bool same = image_error( that, serial, size_x, size_y ) == 0;
+    that.set_task_runner( 0, 1 );
+    that.restore();
+    that.set_color( fill_style, !same, same, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.9f * height, width, 0.1f * height );
+}
+
+void replay_tiles( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    unsigned char checker[ 1024 ];
+    for ( int index = 0; index < 1024; ++index )
+        checker[ index ] = static_cast< unsigned char >(
+            ( ( ( index >> 2 & 1 ) ^ ( index >> 6 & 1 ) ) |
+              ( ( index & 3 ) == 3 ) ) * 255 );
+    canvas recorder( size_x, size_y );
+    display_list list;
+    recorder.set_recording( &list );
+    recorder.scale( 0.5f, 0.5f );
+    display_scene( recorder, checker, width, height );
+    recorder.set_recording( 0 );
+    reverse_runner runner;
+    canvas whole( size_x, size_y, srgb_byte );
+    canvas serial( size_x, size_y, srgb_byte );
+    whole.replay( list );
+    serial.replay_tiles( list, -16, -16, size_x + 32, size_y + 32, 40 );
+    serial.replay_tiles( list, 0, 0, size_x, size_y, 0 );
+    serial.replay_tiles( list, 0, 0, 0, size_y, 32 );
+    serial.set_color( fill_style, 1.0f, 0.0f, 0.0f, 1.0f );
+    serial.fill_rectangle( 20.0f, 30.0f, 50.0f, 60.0f );
+    serial.clear_rectangle( 10.0f, 25.0f, 70.0f, 70.0f );
+    serial.replay_tiles( list, 10, 25, 70, 70, 16 );
+    canvas direct( size_x, size_y, linear_half );
+    canvas zoomed( size_x, size_y, linear_half );
+    direct.scale( 2.0f, 2.0f );
+    zoomed.scale( 2.0f, 2.0f );
+    direct.replay( list );
+    zoomed.replay_tiles( list, 0, 0, size_x, size_y, 100 );
+    that.set_task_runner( &runner, 4 );
+    that.replay_tiles( list, 0, 0, size_x, size_y, 48 );
+    that.set_task_runner( 0, 1 );
+    int error = max( image_error( recorder, that, size_x, size_y ),
+                     max( image_error( whole, serial, size_x, size_y ),
+                          image_error( direct, zoomed, size_x, size_y ) ) );
+    bool same = error <= 1;
+    that.set_color( fill_style, !same, same, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.05f * height );
+}
+
+void collect_band( void *data, unsigned char const *image, int width, int height, int stride, int y )
+{
+    canvas &target = *static_cast< canvas * >( data );
+    target.put_image_data( image, width, height, stride, 0, y );
+}
+
+void replay_bands( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    unsigned char checker[ 1024 ];
+    for ( int index = 0; index < 1024; ++index )
+        checker[ index ] = static_cast< unsigned char >(
+            ( ( ( index >> 2 & 1 ) ^ ( index >> 6 & 1 ) ) |
+              ( ( index & 3 ) == 3 ) ) * 255 );
+    canvas recorder( size_x, size_y );
+    display_list list;
+    recorder.set_recording( &list );
+    display_scene( recorder, checker, width, height );
+    recorder.save();
+    recorder.translate( 0.0f, 0.5f * height );
+    recorder.begin_path();
+    recorder.rectangle( 0.1f * width, 0.0f, 0.2f * width, 0.2f * height );
+    recorder.set_recording( 0 );
+    canvas whole( size_x, size_y, srgb_byte );
+    whole.replay( list );
+    canvas direct( size_x, size_y, linear_half );
+    canvas halves( size_x, 37, linear_half );
+    direct.scale( 2.0f, 2.0f );
+    halves.scale( 2.0f, 2.0f );
+    direct.replay( list );
+    canvas zoomed( size_x, size_y, srgb_byte );
+    halves.replay_bands( list, 0, collect_band, &zoomed );
+    halves.replay_bands( list, size_y, 0, &zoomed );
+    halves.replay_bands( list, size_y, collect_band, &zoomed );
+    halves.fill_rectangle( 0.0f, 0.0f, width, height );
+    unsigned char mark[ 4 ];
+    halves.get_image_data( mark, 1, 1, 4, 0, 0 );
+    canvas banded( size_x, 40, srgb_byte );
+    banded.replay_bands( list, size_y, collect_band, &that );
+    int error = max( image_error( whole, that, size_x, size_y ),
+                     image_error( direct, zoomed, size_x, size_y ) );
+    bool same = error <= 1 && mark[ 0 ] == 0 && mark[ 1 ] == 0 &&
+        mark[ 2 ] == 0 && mark[ 3 ] == 255;
+    that.set_color( fill_style, !same, same, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.05f * height );
+}
+
+void shared_scene( canvas &target, shared_image const &image, typeface const &font, float width, float height )
+{
+    target.set_pattern( fill_style, image, repeat );
+    target.save();
+    target.scale( 3.0f, 3.0f );
+    target.fill_rectangle( 0.02f * width, 0.03f * height,
+                           0.29f * width, 0.14f * height );
+    target.restore();
+    target.draw_image( image, 0.05f * width, 0.55f * height,
+                       0.4f * width, 0.4f * width );
+    target.draw_image( image, 0.5f * width, 0.55f * height, 8.0f, 8.0f );
+    target.set_font( font, 0.2f * height );
+    target.set_color( fill_style, 0.0f, 0.0f, 0.0f, 1.0f );
+    target.fill_text( "CE\xc3\x8dI*", 0.5f * width, 0.85f * height );
+}
+
+struct shared_work
+{
+    shared_image const *image;
+    typeface const *font;
+    int size_x;
+    int size_y;
+    vector< unsigned char > pixels;
+};
+
+void shared_task( void *data, int index )
+{
+    shared_work &work = static_cast< shared_work * >( data )[ index ];
+    shared_image image = *work.image;
+    typeface font;
+    font.view( *work.font );
+    canvas target( work.size_x, work.size_y );
+    shared_scene( target, image, font, static_cast< float >( work.size_x ),
+                  static_cast< float >( work.size_y ) );
+    work.pixels.resize( static_cast< size_t >( work.size_x * work.size_y * 4 ) );
+    target.get_image_data( &work.pixels[ 0 ], work.size_x, work.size_y,
+                           work.size_x * 4, 0, 0 );
+}
+
+void shared_threads( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    unsigned char checker[ 1024 ];
+    for ( int index = 0; index < 1024; ++index )
+        checker[ index ] = static_cast< unsigned char >(
+            ( ( ( index >> 2 & 1 ) ^ ( index >> 6 & 1 ) ) |
+              ( ( index & 3 ) == 3 ) ) * 255 );
+    shared_image image;
+    image.load( checker, 16, 16, 64 );
+    typeface font;
+    font.load( &font_a[ 0 ], static_cast< int >( font_a.size() ) );
+    typeface missing;
+    bool failed = !missing.view( typeface() );
+    shared_scene( that, image, font, width, height );
+    vector< shared_work > work( 8 );
+    for ( size_t index = 0; index < work.size(); ++index )
+    {
+        work[ index ].image = &image;
+        work[ index ].font = &font;
+        work[ index ].size_x = size_x;
+        work[ index ].size_y = size_y;
+    }
+    thread_runner runner;
+    runner.run( shared_task, &work[ 0 ], static_cast< int >( work.size() ) );
+    canvas recorder( size_x, size_y );
+    display_list list;
+    recorder.set_recording( &list );
+    shared_scene( recorder, image, font, width, height );
+    recorder.set_recording( 0 );
+    canvas tiled( size_x, size_y );
+    tiled.set_task_runner( &runner, 4 );
+    tiled.replay_tiles( list, 0, 0, size_x, size_y, 64 );
+    canvas banded( size_x, size_y );
+    banded.set_task_runner( &runner, 4 );
+    shared_scene( banded, image, font, width, height );
+    vector< unsigned char > serial( static_cast< size_t >( size_x * size_y * 4 ) );
+    that.get_image_data( &serial[ 0 ], size_x, size_y, size_x * 4, 0, 0 );
+    bool same = ( failed &&
+                  image_error( that, banded, size_x, size_y ) == 0 &&
+                  image_error( that, tiled, size_x, size_y ) <= 1 );
+    for ( size_t index = 0; index < work.size(); ++index )
+        same = same && work[ index ].pixels == serial;
+    that.set_color( fill_style, !same, same, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.05f * height );
+}
+
+void set_scratch_limit( canvas &that, float width, float height )
+{
+    int size_x = static_cast< int >( width );
+    int size_y = static_cast< int >( height );
+    unsigned char checker[ 1024 ];
+    for ( int index = 0; index < 1024; ++index )
+        checker[ index ] = static_cast< unsigned char >(
+            ( ( ( index >> 2 & 1 ) ^ ( index >> 6 & 1 ) ) |
+              ( ( index & 3 ) == 3 ) ) * 255 );
+    canvas kept( size_x, size_y );
+    bool right = kept.take_scratch_peak() == 0;
+    display_scene( kept, checker, width, height );
+    int peak = kept.take_scratch_peak();
+    int held = kept.take_scratch_peak();
+    right = right && peak > 0 && 0 < held && held <= peak;
+    kept.set_scratch_limit( -5 );
+    right = right && kept.take_scratch_peak() == held;
+    kept.set_scratch_limit( 0 );
+    right = right && kept.take_scratch_peak() == held &&
+        kept.take_scratch_peak() == 0;
+    that.set_scratch_limit( 0 );
+    display_scene( that, checker, width, height );
+    right = right && that.take_scratch_peak() > 0 &&
+        that.take_scratch_peak() == 0;
+    that.set_scratch_limit( 65536 );
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        canvas &target = pass ? that : kept;
+        target.begin_path();
+        for ( int index = 0; index < 4096; ++index )
+        {
+            float angle = static_cast< float >( index ) * 0.0122718463f;
+            float radius = ( index & 1 ? 0.3f : 0.1f ) * width;
+            target.line_to( 0.5f * width + radius * cosf( angle ),
+                            0.9f * height + radius * 0.1f * sinf( angle ) );
+        }
+        target.set_color( fill_style, 0.4f, 0.2f, 0.6f, 1.0f );
+        target.fill();
+    }
+    right = right && that.take_scratch_peak() > 65536 &&
+        that.take_scratch_peak() == 0;
+    right = right && image_error( that, kept, size_x, size_y ) == 0;
+    that.set_color( fill_style, !right, right, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.0f, width, 0.05f * height );
+}
+
+void stats( canvas &that, float width, float height )
+{
+    bool right = true;
+    unsigned char checker[ 64 ];
+    for ( int index = 0; index < 64; ++index )
+        checker[ index ] = static_cast< unsigned char >(
+            ( index & 3 ) == 1 ? 0 :
+            ( ( index >> 2 & 1 ) ^ ( index >> 4 & 1 ) ) * 255 );
+#ifdef CANVAS_ITY_STATS
+    right = right && that.stats.bezier_segments == 0 &&
+        that.stats.merged_runs == 0 && that.stats.color_pixels == 0;
+#endif
+    that.set_color( fill_style, 0.2f, 0.5f, 0.3f, 1.0f );
+    that.fill_rectangle( 0.1f * width, 0.1f * height, 0.3f * width, 0.2f * height );
+#ifdef CANVAS_ITY_STATS
+    size_t const block = static_cast< size_t >( 0.3f * width * 0.2f * height );
+    right = right && that.stats.color_pixels >= block &&
+        that.stats.color_pixels <= block + 256 &&
+        that.stats.unmerged_runs == that.stats.merged_runs &&
+        that.stats.bezier_segments == 0;
+    that.stats = canvas_stats();
+#endif
+    that.set_linear_gradient( stroke_style, 0.0f, 0.0f, width, 0.0f );
+    that.add_color_stop( stroke_style, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f );
+    that.add_color_stop( stroke_style, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f );
+    float dash[] = { 10.0f, 5.0f };
+    that.set_line_dash( dash, 2 );
+    that.set_line_width( 6.0f );
+    that.begin_path();
+    that.move_to( 0.1f * width, 0.5f * height );
+    that.bezier_curve_to( 0.3f * width, 0.3f * height, 0.6f * width, 0.7f * height,
+                          0.9f * width, 0.5f * height );
+    that.stroke();
+#ifdef CANVAS_ITY_STATS
+    right = right && that.stats.bezier_segments > 0 &&
+        that.stats.dashed_points > 0 &&
+        that.stats.stroked_points > that.stats.dashed_points &&
+        that.stats.unmerged_runs > that.stats.merged_runs &&
+        that.stats.linear_pixels > 0 && that.stats.color_pixels == 0 &&
+        that.stats.shadow_floats == 0;
+#endif
+    that.set_line_dash( 0, 0 );
+    that.set_radial_gradient( fill_style, 0.7f * width, 0.2f * height, 0.0f,
+                              0.7f * width, 0.2f * height, 0.15f * width );
+    that.add_color_stop( fill_style, 0.0f, 1.0f, 1.0f, 0.0f, 1.0f );
+    that.add_color_stop( fill_style, 1.0f, 0.0f, 0.5f, 0.5f, 1.0f );
+    that.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.5f );
+    that.set_shadow_blur( 4.0f );
+    that.shadow_offset_y = 5.0f;
+    that.begin_path();
+    that.arc( 0.7f * width, 0.2f * height, 0.15f * width, 0.0f, 6.28318531f );
+    that.fill();
+    that.set_shadow_color( 0.0f, 0.0f, 0.0f, 0.0f );
+    that.set_pattern( fill_style, checker, 4, 4, 16, repeat );
+    that.fill_rectangle( 0.1f * width, 0.7f * height, 0.8f * width, 0.2f * height );
+#ifdef CANVAS_ITY_STATS
+    right = right && that.stats.radial_pixels > 0 &&
+        that.stats.pattern_pixels >= static_cast< size_t >( 0.8f * width * 0.2f * height ) &&
+        that.stats.shadow_floats > 0 &&
+        that.stats.shadow_floats == that.stats.largest_shadow;
+#endif
+    that.set_color( fill_style, !right, right, 0.0f, 1.0f );
+    that.fill_rectangle( 0.0f, 0.95f * height, width, 0.05f * height );
+}
+
 void example_button( canvas &that, float width, float height )
 {
     float left = roundf( 0.25f * width );
@@ -2183,82 +3814,109 @@ struct test
     void ( *call )( canvas &, float, float );
     char const *name;
 } const tests[] = {
-    { 0xc99ddee7, 256, 256, scale_uniform, "scale_uniform" },
+    { 0xfff9ffc7, 256, 256, pixel_formats, "pixel_formats" },
+    { 0xec30e0ed, 256, 256, external_image, "external_image" },
+    { 0x548cbaf8, 256, 256, scale_uniform, "scale_uniform" },
     { 0xe93d3c6f, 256, 256, scale_non_uniform, "scale_non_uniform" },
     { 0x05a0e377, 256, 256, rotate, "rotate" },
-    { 0x36e7fa56, 256, 256, translate, "translate" },
+    { 0xd4e82ee6, 256, 256, translate, "translate" },
     { 0xcfae3e4f, 256, 256, transform, "transform" },
     { 0x98f5594a, 256, 256, transform_fill, "transform_fill" },
-    { 0x822964b0, 256, 256, transform_stroke, "transform_stroke" },
+    { 0x1441617e, 256, 256, transform_stroke, "transform_stroke" },
     { 0xb7056a3a, 256, 256, set_transform, "set_transform" },
     { 0x8f6dd6c3, 256, 256, global_alpha, "global_alpha" },
     { 0x98a0609d, 256, 256, global_composite_operation, "global_composite_operation" },
+    { 0xece19a6b, 256, 256, global_composite_sampled, "global_composite_sampled" },
     { 0x9def5b00, 256, 256, shadow_color, "shadow_color" },
     { 0x8294edd8, 256, 256, shadow_offset, "shadow_offset" },
-    { 0xcdeba51c, 256, 256, shadow_offset_offscreen, "shadow_offset_offscreen" },
+    { 0x59ae6b44, 256, 256, shadow_offset_offscreen, "shadow_offset_offscreen" },
     { 0x5b542224, 256, 256, shadow_blur, "shadow_blur" },
     { 0xd6c150e6, 256, 256, shadow_blur_offscreen, "shadow_blur_offscreen" },
-    { 0x5affc092, 256, 256, shadow_blur_composite, "shadow_blur_composite" },
+    { 0x05dd68dd, 256, 256, shadow_blur_composite, "shadow_blur_composite" },
+    { 0x7bbe3835, 256, 256, shadow_blur_rectangle, "shadow_blur_rectangle" },
     { 0x1720e9b2, 256, 256, line_width, "line_width" },
     { 0xf8d2bb0d, 256, 256, line_width_angular, "line_width_angular" },
-    { 0x7bda8673, 256, 256, line_cap, "line_cap" },
-    { 0x53639198, 256, 256, line_cap_offscreen, "line_cap_offscreen" },
-    { 0x8f49c41d, 256, 256, line_join, "line_join" },
-    { 0xca27ce8c, 256, 256, line_join_offscreen, "line_join_offscreen" },
+    { 0x6fda8573, 256, 256, line_cap, "line_cap" },
+    { 0xfbbf2715, 256, 256, line_cap_offscreen, "line_cap_offscreen" },
+    { 0x7d033445, 256, 256, line_join, "line_join" },
+    { 0xcb831a5e, 256, 256, line_join_offscreen, "line_join_offscreen" },
     { 0xe68273e2, 256, 256, miter_limit, "miter_limit" },
     { 0x27c38a8a, 256, 256, line_dash_offset, "line_dash_offset" },
     { 0x129f9595, 256, 256, line_dash, "line_dash" },
     { 0x88a74152, 256, 256, line_dash_closed, "line_dash_closed" },
-    { 0x064f194d, 256, 256, line_dash_overlap, "line_dash_overlap" },
-    { 0xf7259c0f, 256, 256, line_dash_offscreen, "line_dash_offscreen" },
-    { 0xeb4338e8, 256, 256, color, "color" },
-    { 0x6dc35a07, 256, 256, linear_gradient, "linear_gradient" },
-    { 0x418fe678, 256, 256, radial_gradient, "radial_gradient" },
+    { 0x9d8aceaf, 256, 256, line_dash_overlap, "line_dash_overlap" },
+    { 0x075c3924, 256, 256, line_dash_offscreen, "line_dash_offscreen" },
+    { 0x4ba950d4, 256, 256, color, "color" },
+    { 0xa513576a, 256, 256, linear_gradient, "linear_gradient" },
+    { 0x91018fcb, 256, 256, radial_gradient, "radial_gradient" },
     { 0x67aada11, 256, 256, color_stop, "color_stop" },
-    { 0xc6c721d6, 256, 256, pattern, "pattern" },
+    { 0x2e8aa830, 256, 256, pattern, "pattern" },
     { 0xb0b391cd, 256, 256, begin_path, "begin_path" },
     { 0xf79ed394, 256, 256, move_to, "move_to" },
     { 0xe9602309, 256, 256, close_path, "close_path" },
     { 0x3160ace7, 256, 256, line_to, "line_to" },
     { 0xb6176812, 256, 256, quadratic_curve_to, "quadratic_curve_to" },
     { 0x5f523029, 256, 256, bezier_curve_to, "bezier_curve_to" },
-    { 0x1f847aaf, 256, 256, arc_to, "arc_to" },
-    { 0x26457553, 256, 256, arc, "arc" },
+    { 0x873ecdcd, 256, 256, arc_to, "arc_to" },
+    { 0xc6596bc4, 256, 256, arc, "arc" },
     { 0x7520990c, 256, 256, rectangle, "rectangle" },
     { 0xf1d774dc, 256, 256, fill, "fill" },
     { 0x5e6e6b75, 256, 256, fill_rounding, "fill_rounding" },
     { 0xf0cf6566, 256, 256, fill_converging, "fill_converging" },
-    { 0x3692d10e, 256, 256, fill_zone_plate, "fill_zone_plate" },
+    { 0x191e268f, 256, 256, fill_zone_plate, "fill_zone_plate" },
     { 0x2003f926, 256, 256, stroke, "stroke" },
-    { 0xc44fc157, 256, 256, stroke_wide, "stroke_wide" },
-    { 0x691cfe49, 256, 256, stroke_inner_join, "stroke_inner_join" },
+    { 0x392f48f2, 256, 256, stroke_wide, "stroke_wide" },
+    { 0x2b1cea4d, 256, 256, stroke_inner_join, "stroke_inner_join" },
     { 0xc0bd9324, 256, 256, stroke_spiral, "stroke_spiral" },
     { 0x3b2dae15, 256, 256, stroke_long, "stroke_long" },
-    { 0xa7e06559, 256, 256, clip, "clip" },
+    { 0x22c43ba4, 256, 256, clip, "clip" },
     { 0x31e6112b, 256, 256, clip_winding, "clip_winding" },
+    { 0xe5f2d7c5, 256, 256, clip_nested, "clip_nested" },
     { 0xc2188d67, 256, 256, is_point_in_path, "is_point_in_path" },
     { 0x6505bdc9, 256, 256, is_point_in_path_offscreen, "is_point_in_path_offscreen" },
+    { 0x372dd4da, 256, 256, is_point_in_prepared, "is_point_in_prepared" },
+    { 0xc33b4c57, 256, 256, draw_prepared, "draw_prepared" },
+    { 0x40a375b2, 256, 256, fill_batch, "fill_batch" },
     { 0x5e792c96, 256, 256, clear_rectangle, "clear_rectangle" },
     { 0x286e96fa, 256, 256, fill_rectangle, "fill_rectangle" },
     { 0xc2b0803d, 256, 256, stroke_rectangle, "stroke_rectangle" },
+    { 0xc78ee490, 256, 256, fill_rectangle_aligned, "fill_rectangle_aligned" },
     { 0xe6c4d9c7, 256, 256, text_align, "text_align" },
     { 0x72cb6b06, 256, 256, text_baseline, "text_baseline" },
     { 0x4d41daa2, 256, 256, font, "font" },
     { 0x70e3232d, 256, 256, fill_text, "fill_text" },
     { 0xed6477c8, 256, 256, stroke_text, "stroke_text" },
     { 0x32d1ee3b, 256, 256, measure_text, "measure_text" },
+    { 0x5418229e, 256, 256, set_glyph_cache, "set_glyph_cache" },
+    { 0x993b7103, 256, 256, set_font_shared, "set_font_shared" },
     { 0x78cb460c, 256, 256, draw_image, "draw_image" },
     { 0xb530077b, 256, 256, draw_image_matted, "draw_image_matted" },
+    { 0x6afac217, 256, 256, image_smoothing, "image_smoothing" },
+    { 0x6f83cee4, 256, 256, pattern_edge, "pattern_edge" },
+    { 0x1af2ca6c, 256, 256, draw_image_shrunk, "draw_image_shrunk" },
+    { 0x1c6f56ed, 256, 256, draw_image_shared, "draw_image_shared" },
     { 0xaf04e7a2, 256, 256, get_image_data, "get_image_data" },
     { 0x5acae0b6, 256, 256, put_image_data, "put_image_data" },
+    { 0x5af16df4, 256, 256, image_data_round_trip, "image_data_round_trip" },
+    { 0xb98ccf7d, 256, 256, tall_canvas, "tall_canvas" },
+    { 0x22f5834e, 256, 256, fill_large, "fill_large" },
+    { 0xaeaef941, 256, 256, take_dirty_region, "take_dirty_region" },
     { 0xb6e854b1, 256, 256, save_restore, "save_restore" },
-    { 0x62bc9606, 256, 256, example_button, "example_button" },
-    { 0x92731a7b, 256, 256, example_smiley, "example_smiley" },
-    { 0xe2f1e1de, 256, 256, example_knot, "example_knot" },
-    { 0xc02d01ea, 256, 256, example_icon, "example_icon" },
-    { 0xa1607c4a, 256, 256, example_illusion, "example_illusion" },
-    { 0x7c861f87, 256, 256, example_star, "example_star" },
-    { 0x429ca194, 256, 256, example_neon, "example_neon" },
+    { 0x64e8b12d, 256, 256, save_restore_nested, "save_restore_nested" },
+    { 0x542e3300, 256, 256, display_list_replay, "display_list_replay" },
+    { 0xaa9702e3, 256, 256, set_task_runner, "set_task_runner" },
+    { 0x45b1623a, 256, 256, replay_tiles, "replay_tiles" },
+    { 0xe4dbe274, 256, 256, replay_bands, "replay_bands" },
+    { 0x5a5e1970, 256, 256, shared_threads, "shared_threads" },
+    { 0xd58e94a2, 256, 256, set_scratch_limit, "set_scratch_limit" },
+    { 0xdc833f0d, 256, 256, stats, "stats" },
+    { 0x62acb656, 256, 256, example_button, "example_button" },
+    { 0xcf11d4d2, 256, 256, example_smiley, "example_smiley" },
+    { 0xe6f1e0de, 256, 256, example_knot, "example_knot" },
+    { 0xb4711d07, 256, 256, example_icon, "example_icon" },
+    { 0x14421ba0, 256, 256, example_illusion, "example_illusion" },
+    { 0x8b0c0c87, 256, 256, example_star, "example_star" },
+    { 0xba50d042, 256, 256, example_neon, "example_neon" },
 };
 
 // Simple glob style string matcher.  This accepts both * and ? glob